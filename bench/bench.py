@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+# Runs parsa over a generated corpus several times and reports throughput,
+# peak RSS and run to run variance, next to `cpp -E -P` on the same files.
+#
+#   python3 bench/bench.py --parsa build_release/parsa
+#
+# Peak RSS comes from wait4, so it is only reported on POSIX.
+
+import argparse
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import gen_corpus
+
+def run_measured(command):
+    """Runs command, returns its exit code and peak RSS in KiB (None if unknown)."""
+    process = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    if not hasattr(os, "wait4"):
+        return process.wait(), None
+
+    _, status, usage = os.wait4(process.pid, 0)
+    # Popen would otherwise try to reap the process again
+    process.returncode = os.waitstatus_to_exitcode(status)
+    peak_rss = usage.ru_maxrss
+    if sys.platform == "darwin":
+        peak_rss //= 1024
+    return process.returncode, peak_rss
+
+def reset_dir(path):
+    if os.path.exists(path):
+        shutil.rmtree(path)
+    os.makedirs(path)
+
+def run_parsa(parsa, src_dir, out_dir, jobs, files):
+    reset_dir(out_dir)
+    # Headers include each other as "inc/...", so like cpp they are looked up from src_dir
+    command = [parsa, src_dir + os.sep, "-o", out_dir + os.sep, "-I", src_dir]
+    if jobs:
+        command += ["-j", str(jobs)]
+    return run_measured(command)
+
+def run_cpp(cpp, src_dir, out_dir, jobs, files):
+    reset_dir(out_dir)
+
+    def preprocess(name):
+        return run_measured([cpp, "-E", "-P", "-I", src_dir, os.path.join(src_dir, name), "-o", os.path.join(out_dir, name)])
+
+    with ThreadPoolExecutor(jobs or os.cpu_count()) as pool:
+        results = list(pool.map(preprocess, files))
+    exit_code = next((code for code, _ in results if code), 0)
+    peak_rss = max((rss for _, rss in results), default=None, key=lambda rss: rss or 0)
+    return exit_code, peak_rss
+
+def measure(name, run, runs, warmup, *args):
+    times = []
+    peak_rss = None
+    for i in range(warmup + runs):
+        start = time.perf_counter()
+        exit_code, rss = run(*args)
+        elapsed = time.perf_counter() - start
+        if exit_code:
+            print(f"{name} failed with exit code {exit_code}!")
+            return None
+        if i >= warmup:
+            times.append(elapsed)
+            if rss is not None:
+                peak_rss = max(peak_rss or 0, rss)
+    return times, peak_rss
+
+def report(name, measurement, input_size, files_count):
+    times, peak_rss = measurement
+    mean = statistics.mean(times)
+    deviation = statistics.stdev(times) if len(times) > 1 else 0.0
+    rss = f"{peak_rss / 1024:8.1f} MiB" if peak_rss is not None else "       n/a"
+    print(f"{name:<6} {mean * 1000:9.1f} ms  ±{deviation / mean * 100:5.1f}%  min {min(times) * 1000:9.1f} ms  "
+          f"{input_size / mean / 1e6:8.1f} MB/s  {files_count / mean:9.0f} files/s  peak RSS {rss}")
+
+def main():
+    script_dir = os.path.dirname(os.path.abspath(__file__))
+    default_parsa = os.path.join(script_dir, "..", "build_release", "parsa.exe" if os.name == "nt" else "parsa")
+
+    parser = argparse.ArgumentParser(description="Benchmark parsa against cpp -E -P")
+    parser.add_argument("--parsa", default=default_parsa, help="parsa executable")
+    parser.add_argument("--corpus", default=os.path.join(tempfile.gettempdir(), "parsa_bench"), help="Corpus directory, generated if it doesn't exist")
+    parser.add_argument("--regenerate", action="store_true", help="Generate the corpus even if it exists")
+    parser.add_argument("--seed", type=int, default=1, help="Corpus random seed")
+    parser.add_argument("--scale", type=float, default=1.0, help="Corpus size multiplier")
+    parser.add_argument("--runs", type=int, default=5, help="Measured runs")
+    parser.add_argument("--warmup", type=int, default=1, help="Unmeasured runs before measuring, to warm up the page cache")
+    parser.add_argument("-j", "--jobs", type=int, default=0, help="Worker threads, parsa's default if 0")
+    parser.add_argument("--cpp", default=shutil.which("cpp"), help="C preprocessor to compare with")
+    parser.add_argument("--no-cpp", action="store_true", help="Don't compare with cpp")
+    args = parser.parse_args()
+
+    if not os.path.isfile(args.parsa):
+        print(f"Can't find parsa at \"{args.parsa}\", build it with `python3 build.py` first!")
+        return 1
+
+    src_dir = os.path.join(args.corpus, "src")
+    if args.regenerate or not os.path.isdir(src_dir):
+        print(f"Generating corpus in \"{args.corpus}\"...")
+        gen_corpus.generate(args.corpus, args.seed, args.scale)
+
+    files = sorted(name for name in os.listdir(src_dir) if os.path.isfile(os.path.join(src_dir, name)))
+    input_size = sum(os.path.getsize(os.path.join(src_dir, name)) for name in files)
+    print(f"{len(files)} files, {input_size / 1e6:.1f} MB, {args.runs} runs after {args.warmup} warmup")
+
+    measurement = measure("parsa", run_parsa, args.runs, args.warmup, args.parsa, src_dir, os.path.join(args.corpus, "out_parsa"), args.jobs, files)
+    if not measurement:
+        return 1
+    report("parsa", measurement, input_size, len(files))
+
+    if not args.no_cpp:
+        if not args.cpp:
+            print("Can't find cpp, skipping the comparison")
+        else:
+            measurement = measure("cpp", run_cpp, args.runs, args.warmup, args.cpp, src_dir, os.path.join(args.corpus, "out_cpp"), args.jobs, files)
+            if not measurement:
+                return 1
+            report("cpp", measurement, input_size, len(files))
+
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+# Writes a deterministic C corpus for benchmarking: the same seed and scale
+# always produce the same bytes. Only uses what parsa understands, quoted
+# #include, object-like #define/#undef, #pragma once and include guards.
+#
+#   src/inc/chain_NN.h  deep include chain, each header includes the next one
+#   src/inc/leaf_NNN.h  small headers, all included by src/inc/fan.h
+#   src/big_N.c         multi-megabyte files
+#   src/mid_NNN.c       medium files including a few leaves and the chain
+#   src/tiny_NNNN.c     many tiny files
+#
+# Some files use CRLF, some LF, so both paths of the line ending conversion run.
+
+import argparse
+import os
+import random
+import shutil
+
+IDENTS = ["count", "size", "index", "value", "result", "buffer", "offset", "flags", "next", "data"]
+TYPES = ["int", "unsigned", "long", "char*", "float", "double", "size_t"]
+
+def code_lines(rng, target_size, defines):
+    lines = []
+    size = 0
+    function = 0
+    while size < target_size:
+        kind = rng.random()
+        if kind < 0.05:
+            name = f"CONST_{function}_{len(lines)}"
+            line = f"#define {name} {rng.randrange(1 << 16)}"
+            defines.append(name)
+            lines.append(line)
+            size += len(line) + 1
+            continue
+
+        body = [f"static {rng.choice(TYPES)} function_{function}({rng.choice(TYPES)} {rng.choice(IDENTS)})", "{"]
+        for _ in range(rng.randrange(4, 24)):
+            statement = rng.random()
+            ident = rng.choice(IDENTS)
+            if statement < 0.2:
+                body.append(f"\t// {ident} has to be updated before the loop below")
+            elif statement < 0.3:
+                body.append(f"\tputs(\"{ident} \\\" #include \\\"not_a_file.h\\\"\");")
+            elif statement < 0.4 and defines:
+                body.append(f"\t{ident} += {rng.choice(defines)};")
+            elif statement < 0.5:
+                body.append(f"\t/* {ident} is {rng.randrange(1000)} */ {ident}++;")
+            else:
+                body.append(f"\t{ident} = {ident} * {rng.randrange(1, 97)} + {rng.randrange(1000)};")
+        body.append("}")
+        body.append("")
+        function += 1
+        lines.extend(body)
+        size += sum(len(line) + 1 for line in body)
+    return lines
+
+def write_file(path, lines, crlf):
+    with open(path, "wb") as f:
+        f.write(("\r\n" if crlf else "\n").join(lines).encode() + (b"\r\n" if crlf else b"\n"))
+
+def generate(out_dir, seed, scale):
+    rng = random.Random(seed)
+    src_dir = os.path.join(out_dir, "src")
+    inc_dir = os.path.join(src_dir, "inc")
+    if os.path.exists(out_dir):
+        shutil.rmtree(out_dir)
+    os.makedirs(inc_dir)
+
+    # parsa opens at most 64 files at once, the input and its chain of includes
+    chain_depth = 62
+    for i in range(chain_depth):
+        guard = f"CHAIN_{i:02}_H"
+        lines = [f"#ifndef {guard}", f"#define {guard}"]
+        if i + 1 < chain_depth:
+            lines.append(f"#include \"inc/chain_{i + 1:02}.h\"")
+        lines += code_lines(rng, 512, [])
+        lines.append("#endif")
+        write_file(os.path.join(inc_dir, f"chain_{i:02}.h"), lines, i % 3 == 0)
+
+    leaves_count = 256
+    for i in range(leaves_count):
+        lines = ["#pragma once", f"#define LEAF_{i} {i}"] + code_lines(rng, 256, [])
+        write_file(os.path.join(inc_dir, f"leaf_{i:03}.h"), lines, i % 2 == 0)
+    write_file(os.path.join(inc_dir, "fan.h"), ["#pragma once"] + [f"#include \"inc/leaf_{i:03}.h\"" for i in range(leaves_count)], 0)
+
+    for i in range(max(1, int(4 * scale))):
+        lines = ["#include \"inc/fan.h\"", "#include \"inc/chain_00.h\""] + code_lines(rng, 4 * 1024 * 1024, [])
+        write_file(os.path.join(src_dir, f"big_{i}.c"), lines, i % 2 == 1)
+
+    for i in range(max(1, int(200 * scale))):
+        lines = [f"#include \"inc/leaf_{rng.randrange(leaves_count):03}.h\"" for _ in range(rng.randrange(1, 8))]
+        if rng.random() < 0.5:
+            lines.append("#include \"inc/chain_00.h\"")
+        defines = []
+        lines += code_lines(rng, rng.randrange(16 * 1024, 128 * 1024), defines)
+        write_file(os.path.join(src_dir, f"mid_{i:03}.c"), lines, rng.random() < 0.3)
+
+    for i in range(max(1, int(2000 * scale))):
+        lines = [f"#include \"inc/leaf_{rng.randrange(leaves_count):03}.h\"", f"int tiny_{i} = LEAF_0;"]
+        write_file(os.path.join(src_dir, f"tiny_{i:04}.c"), lines, i % 5 == 0)
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Generate a deterministic C corpus for benchmarking parsa")
+    parser.add_argument("out", help="Directory to generate the corpus in, deleted first if it exists")
+    parser.add_argument("--seed", type=int, default=1, help="Random seed")
+    parser.add_argument("--scale", type=float, default=1.0, help="Multiplies the number of files")
+    args = parser.parse_args()
+    generate(args.out, args.seed, args.scale)
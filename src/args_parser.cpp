@@ -21,8 +21,8 @@ const wchar_t* get_arg_entry_value(const ArgEntry* entries, const int entries_co
 	for (int i = 0; i < entries_count; i++)
 	{
 		auto& entry = entries[i];
-		if (entry.short_name && wcscmp(entry.short_name, entry_name) == 0 ||
-			entry.long_name && wcscmp(entry.long_name, entry_name) == 0)
+		if ((entry.short_name && wcscmp(entry.short_name, entry_name) == 0) ||
+			(entry.long_name && wcscmp(entry.long_name, entry_name) == 0))
 		{
 			return entry.value;
 		}
@@ -31,6 +31,36 @@ const wchar_t* get_arg_entry_value(const ArgEntry* entries, const int entries_co
 	return 0;
 }
 
+// Every value of an option that may be given more than once, like "-I a -I b",
+// the entry itself only keeps the first. values has room for argc of them.
+int get_arg_entry_values(const wchar_t** values, const ArgEntry* entries, const int entries_count, const wchar_t* entry_name, const int argc, const wchar_t** argv)
+{
+	const ArgEntry* entry = 0;
+	for (int i = 0; i < entries_count; i++)
+	{
+		if ((entries[i].short_name && wcscmp(entries[i].short_name, entry_name) == 0) ||
+			(entries[i].long_name && wcscmp(entries[i].long_name, entry_name) == 0))
+		{
+			entry = &entries[i];
+			break;
+		}
+	}
+	if (!entry || !entry->value) return 0;
+
+	int values_count = 0;
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		const auto option = argv[i];
+		if (option[0] != L'-') continue;
+
+		const auto matched = (entry->short_name && wcscmp(option + 1, entry->short_name) == 0) ||
+			(option[1] == L'-' && entry->long_name && wcscmp(option + 2, entry->long_name) == 0);
+		if (matched && argv[i + 1][0] != L'-')
+			values[values_count++] = argv[++i];
+	}
+	return values_count;
+}
+
 enum class ParseArgsResult {
 	Success, Error, Help
 };
@@ -60,7 +90,8 @@ ParseArgsResult parse_args(ArgEntry* arg_entries, const int arg_entries_count, c
 	const wchar_t* prev_argv = 0;
 	for (int i = 1; i < argc; i++)
 	{
-		const auto arg_is_option = *argv[i] == L'-';
+		// A lone "-" is a value, it stands for stdin or stdout
+		const auto arg_is_option = argv[i][0] == L'-' && argv[i][1];
 
 		if (arg_is_option)
 		{
@@ -83,8 +114,8 @@ ParseArgsResult parse_args(ArgEntry* arg_entries, const int arg_entries_count, c
 					if (entry.short_name)
 					{
 						auto next_char = argv[i]+1;
-						if (*next_char && wcscmp(next_char, entry.short_name) == 0 ||
-								*(next_char++) == L'-' && *next_char && entry.long_name && wcscmp(next_char, entry.long_name) == 0)
+						if ((*next_char && wcscmp(next_char, entry.short_name) == 0) ||
+								(*(next_char++) == L'-' && *next_char && entry.long_name && wcscmp(next_char, entry.long_name) == 0))
 						{
 							entry_matched = &entry;
 							break;
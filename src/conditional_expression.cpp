@@ -0,0 +1,492 @@
+// Evaluates the constant expressions of #if and #elif. Macros are substituted
+// as the expression is read, identifiers that are left over are 0. Values are
+// 64 bit integers, signed unless they're unsigned literals or an operand of
+// theirs is unsigned, like intmax_t and uintmax_t are in C.
+
+enum class ExpressionTokenKind : u8 {
+	End, Number, Defined, Operator, Invalid,
+};
+
+struct ExpressionToken {
+	ExpressionTokenKind kind;
+	// Up to two characters, see expression_op
+	u16 op;
+	i64 value;
+	bool is_unsigned;
+};
+
+struct ExpressionValue {
+	i64 value;
+	bool is_unsigned;
+};
+
+// The expression itself or the value of a macro substituted into it
+struct ExpressionSource {
+	const char* c;
+	const char* end;
+	const Symbol* macro;
+};
+
+struct ExpressionLexer {
+	const SymbolTable* symbols;
+	ExpressionSource sources[32];
+	u32 sources_count;
+	// The current token, the next one is read on demand
+	ExpressionToken token;
+	// Why the expression is invalid
+	const wchar_t* error;
+};
+
+constexpr u16 expression_op(const char a, const char b = 0)
+{
+	return (u16)((u8)a | (u8)b << 8);
+}
+
+bool is_op(const ExpressionToken& token, const u16 op)
+{
+	return token.kind == ExpressionTokenKind::Operator && token.op == op;
+}
+
+bool expression_fail(ExpressionLexer& lexer, const wchar_t* error)
+{
+	if (!lexer.error)
+		lexer.error = error;
+	lexer.token = {.kind = ExpressionTokenKind::Invalid};
+	return 0;
+}
+
+// Blanks, comments and continuation lines
+void skip_expression_blanks(ExpressionSource& source)
+{
+	while (source.c < source.end)
+	{
+		const auto c = source.c;
+		if (is_blank(*c) || *c == '\n' || (*c == '\\' && c + 1 < source.end && c[1] == '\n'))
+			source.c += *c == '\\' ? 2 : 1;
+		else if (*c == '/' && c + 1 < source.end && c[1] == '/')
+			source.c = source.end;
+		else if (*c == '/' && c + 1 < source.end && c[1] == '*')
+		{
+			auto comment_end = c + 2;
+			for (; comment_end + 1 < source.end && !(comment_end[0] == '*' && comment_end[1] == '/'); comment_end++);
+			source.c = comment_end + 1 < source.end ? comment_end + 2 : source.end;
+		}
+		else
+			break;
+	}
+}
+
+bool is_macro_expanding(const ExpressionLexer& lexer, const Symbol* symbol)
+{
+	for (u32 i = 1; i < lexer.sources_count; i++)
+	{
+		if (lexer.sources[i].macro == symbol)
+			return 1;
+	}
+	return 0;
+}
+
+// Pushes the replacement of an invocation of a function-like macro. Its
+// arguments may come after the end of the replacement it's named in. Without
+// them it isn't an invocation and the name is 0, like any other.
+bool read_macro_invocation(ExpressionLexer& lexer, const Symbol& symbol, bool& invoked)
+{
+	invoked = 0;
+	auto index = lexer.sources_count - 1;
+	skip_expression_blanks(lexer.sources[index]);
+	for (; index && lexer.sources[index].c == lexer.sources[index].end; index--)
+		skip_expression_blanks(lexer.sources[index - 1]);
+
+	auto& source = lexer.sources[index];
+	if (source.c == source.end || *source.c != '(')
+		return 1;
+
+	MacroArgument arguments[macro_max_parameters];
+	if (!collect_macro_arguments(arguments, symbol, source.c, source.end))
+		return expression_fail(lexer, L"Invalid macro invocation");
+
+	// The replacements the arguments came after are over
+	lexer.sources_count = index + 1;
+	ActiveMacros active = {.replacements = lexer.symbols->arena};
+	for (u32 i = 1; i < lexer.sources_count; i++)
+		active.symbols[active.count++] = lexer.sources[i].macro;
+
+	MacroArgument replacement;
+	if (!build_macro_replacement(replacement, *lexer.symbols, active, symbol, arguments))
+		return expression_fail(lexer, L"Failed to substitute macros");
+	if (lexer.sources_count == COUNTOF(lexer.sources))
+		return expression_fail(lexer, L"Macro substitution too deep");
+
+	lexer.sources[lexer.sources_count++] = {.c = replacement.content, .end = replacement.content + replacement.size, .macro = &symbol};
+	invoked = 1;
+	return 1;
+}
+
+// Integer literals in any base, with their suffixes
+bool read_expression_number(ExpressionLexer& lexer, ExpressionSource& source)
+{
+	auto c = source.c;
+	u32 base = 10;
+	if (*c == '0' && c + 1 < source.end && (c[1] == 'x' || c[1] == 'X'))
+	{
+		base = 16;
+		c += 2;
+	}
+	else if (*c == '0' && c + 1 < source.end && (c[1] == 'b' || c[1] == 'B'))
+	{
+		base = 2;
+		c += 2;
+	}
+	else if (*c == '0')
+		base = 8;
+
+	u64 value = 0;
+	for (; c < source.end; c++)
+	{
+		u32 digit;
+		if (*c >= '0' && *c <= '9')
+			digit = *c - '0';
+		else if (*c >= 'a' && *c <= 'f')
+			digit = *c - 'a' + 10;
+		else if (*c >= 'A' && *c <= 'F')
+			digit = *c - 'A' + 10;
+		else if (*c == '\'')
+			continue;
+		else
+			break;
+		if (digit >= base)
+			break;
+		value = value * base + digit;
+	}
+	// Too large for a signed one, it's unsigned like it would be in C
+	bool is_unsigned = value > (u64)std::numeric_limits<i64>::max();
+	for (; c < source.end && (*c == 'u' || *c == 'U' || *c == 'l' || *c == 'L'); c++)
+		is_unsigned |= *c == 'u' || *c == 'U';
+	if (c < source.end && (is_identifier_char(*c) || *c == '.'))
+		return expression_fail(lexer, L"Invalid integer");
+
+	source.c = c;
+	lexer.token = {.kind = ExpressionTokenKind::Number, .value = (i64)value, .is_unsigned = is_unsigned};
+	return 1;
+}
+
+bool read_expression_char(ExpressionLexer& lexer, ExpressionSource& source)
+{
+	auto c = source.c + 1;
+	i64 value = 0;
+	if (c < source.end && *c == '\\' && c + 1 < source.end)
+	{
+		c++;
+		switch (*c)
+		{
+			case 'n': value = '\n'; c++; break;
+			case 't': value = '\t'; c++; break;
+			case 'r': value = '\r'; c++; break;
+			case 'x':
+				for (c++; c < source.end && ((*c >= '0' && *c <= '9') || (*c >= 'a' && *c <= 'f') || (*c >= 'A' && *c <= 'F')); c++)
+					value = value * 16 + (*c <= '9' ? *c - '0' : (*c | 0x20) - 'a' + 10);
+				break;
+			default:
+				if (*c >= '0' && *c <= '7')
+				{
+					for (; c < source.end && *c >= '0' && *c <= '7'; c++)
+						value = value * 8 + *c - '0';
+				}
+				else
+					value = (u8)*c++;
+		}
+	}
+	else if (c < source.end && *c != '\'')
+		value = (u8)*c++;
+
+	if (c == source.end || *c != '\'')
+		return expression_fail(lexer, L"Invalid character literal");
+
+	source.c = c + 1;
+	lexer.token = {.kind = ExpressionTokenKind::Number, .value = value};
+	return 1;
+}
+
+bool expression_next(ExpressionLexer& lexer)
+{
+	if (lexer.token.kind == ExpressionTokenKind::Invalid)
+		return 0;
+
+	while (true)
+	{
+		auto& source = lexer.sources[lexer.sources_count - 1];
+		skip_expression_blanks(source);
+		if (source.c == source.end)
+		{
+			if (lexer.sources_count == 1)
+			{
+				lexer.token = {.kind = ExpressionTokenKind::End};
+				return 1;
+			}
+			lexer.sources_count--;
+			continue;
+		}
+
+		const auto c = source.c;
+		if (is_identifier_start(*c))
+		{
+			auto name_end = c + 1;
+			for (; name_end < source.end && is_identifier_char(*name_end); name_end++);
+			source.c = name_end;
+
+			const auto name_size = (u32)(name_end - c);
+			if (name_size == 7 && memcmp(c, "defined", 7) == 0)
+			{
+				lexer.token = {.kind = ExpressionTokenKind::Defined};
+				return 1;
+			}
+
+			const auto symbol = symbol_table_find(*lexer.symbols, c, name_size);
+			if (!symbol || is_macro_expanding(lexer, symbol))
+			{
+				lexer.token = {.kind = ExpressionTokenKind::Number};
+				return 1;
+			}
+			if (symbol->plan)
+			{
+				bool invoked;
+				if (!read_macro_invocation(lexer, *symbol, invoked))
+					return 0;
+				if (invoked) continue;
+				lexer.token = {.kind = ExpressionTokenKind::Number};
+				return 1;
+			}
+			if (lexer.sources_count == COUNTOF(lexer.sources))
+				return expression_fail(lexer, L"Macro substitution too deep");
+
+			lexer.sources[lexer.sources_count++] = {.c = symbol->value, .end = symbol->value + symbol->value_size, .macro = symbol};
+			continue;
+		}
+
+		if (*c >= '0' && *c <= '9')
+			return read_expression_number(lexer, source);
+		if (*c == '\'')
+			return read_expression_char(lexer, source);
+
+		constexpr u16 two_char_ops[] = {
+			expression_op('&', '&'), expression_op('|', '|'), expression_op('=', '='), expression_op('!', '='),
+			expression_op('<', '='), expression_op('>', '='), expression_op('<', '<'), expression_op('>', '>'),
+		};
+		if (c + 1 < source.end)
+		{
+			const auto op = expression_op(c[0], c[1]);
+			for (const auto two_char_op : two_char_ops)
+			{
+				if (op != two_char_op) continue;
+				source.c += 2;
+				lexer.token = {.kind = ExpressionTokenKind::Operator, .op = op};
+				return 1;
+			}
+		}
+
+		if (!strchr("+-*/%<>&^|!~()?:", *c) || !*c)
+			return expression_fail(lexer, L"Unexpected character");
+		source.c++;
+		lexer.token = {.kind = ExpressionTokenKind::Operator, .op = expression_op(*c)};
+		return 1;
+	}
+}
+
+// "defined X" or "defined(X)", the name isn't substituted
+bool read_defined_operand(ExpressionLexer& lexer, ExpressionValue& value)
+{
+	auto& source = lexer.sources[lexer.sources_count - 1];
+	skip_expression_blanks(source);
+	const auto parenthesized = source.c < source.end && *source.c == '(';
+	if (parenthesized)
+	{
+		source.c++;
+		skip_expression_blanks(source);
+	}
+
+	if (source.c == source.end || !is_identifier_start(*source.c))
+		return expression_fail(lexer, L"Missing macro name after defined");
+	const auto name = source.c;
+	for (source.c++; source.c < source.end && is_identifier_char(*source.c); source.c++);
+	value = {.value = symbol_table_find(*lexer.symbols, name, (u32)(source.c - name)) != 0};
+
+	if (parenthesized)
+	{
+		skip_expression_blanks(source);
+		if (source.c == source.end || *source.c != ')')
+			return expression_fail(lexer, L"Missing ) after defined");
+		source.c++;
+	}
+	return expression_next(lexer);
+}
+
+bool parse_conditional_expression(ExpressionLexer& lexer, ExpressionValue& value, const bool evaluated);
+
+bool parse_unary_expression(ExpressionLexer& lexer, ExpressionValue& value, const bool evaluated)
+{
+	const auto token = lexer.token;
+	switch (token.kind)
+	{
+		case ExpressionTokenKind::Number:
+			value = {.value = token.value, .is_unsigned = token.is_unsigned};
+			return expression_next(lexer);
+		case ExpressionTokenKind::Defined:
+			return read_defined_operand(lexer, value);
+		case ExpressionTokenKind::End:
+			return expression_fail(lexer, L"Missing operand");
+		case ExpressionTokenKind::Invalid:
+			return 0;
+		case ExpressionTokenKind::Operator:
+			break;
+	}
+
+	if (token.op == expression_op('('))
+	{
+		if (!expression_next(lexer) || !parse_conditional_expression(lexer, value, evaluated))
+			return 0;
+		if (!is_op(lexer.token, expression_op(')')))
+			return expression_fail(lexer, L"Missing )");
+		return expression_next(lexer);
+	}
+
+	if (token.op != expression_op('+') && token.op != expression_op('-') && token.op != expression_op('!') && token.op != expression_op('~'))
+		return expression_fail(lexer, L"Unexpected operator");
+	if (!expression_next(lexer) || !parse_unary_expression(lexer, value, evaluated))
+		return 0;
+
+	if (token.op == expression_op('-'))
+		value.value = (i64)(0 - (u64)value.value);
+	else if (token.op == expression_op('!'))
+		value = {.value = !value.value};
+	else if (token.op == expression_op('~'))
+		value.value = ~value.value;
+	return 1;
+}
+
+// 0 for operators that aren't binary
+int get_binary_precedence(const u16 op)
+{
+	switch (op)
+	{
+		case expression_op('*'): case expression_op('/'): case expression_op('%'): return 10;
+		case expression_op('+'): case expression_op('-'): return 9;
+		case expression_op('<', '<'): case expression_op('>', '>'): return 8;
+		case expression_op('<'): case expression_op('<', '='): case expression_op('>'): case expression_op('>', '='): return 7;
+		case expression_op('=', '='): case expression_op('!', '='): return 6;
+		case expression_op('&'): return 5;
+		case expression_op('^'): return 4;
+		case expression_op('|'): return 3;
+		case expression_op('&', '&'): return 2;
+		case expression_op('|', '|'): return 1;
+	}
+	return 0;
+}
+
+// Operands that aren't evaluated, like the right one of "0 && x", can't fail
+// on a division by zero. Arithmetic and comparisons are unsigned when either
+// operand is, shifts when the left one is.
+bool parse_binary_expression(ExpressionLexer& lexer, ExpressionValue& value, const int min_precedence, const bool evaluated)
+{
+	if (!parse_unary_expression(lexer, value, evaluated))
+		return 0;
+
+	while (lexer.token.kind == ExpressionTokenKind::Operator)
+	{
+		const auto op = lexer.token.op;
+		const auto precedence = get_binary_precedence(op);
+		if (!precedence || precedence < min_precedence)
+			break;
+
+		const auto short_circuited = (op == expression_op('&', '&') && !value.value) || (op == expression_op('|', '|') && value.value);
+		ExpressionValue rhs;
+		if (!expression_next(lexer) || !parse_binary_expression(lexer, rhs, precedence + 1, evaluated && !short_circuited))
+			return 0;
+
+		const auto lhs = value.value;
+		const auto a = (u64)lhs;
+		const auto b = (u64)rhs.value;
+		const auto lhs_unsigned = value.is_unsigned;
+		const auto is_unsigned = lhs_unsigned || rhs.is_unsigned;
+		// A negative shift count is out of range as well
+		const auto shift_in_range = b <= 63;
+		value.is_unsigned = is_unsigned;
+		switch (op)
+		{
+			case expression_op('*'): value.value = (i64)(a * b); break;
+			case expression_op('/'):
+			case expression_op('%'):
+				if (!b)
+				{
+					if (evaluated)
+						return expression_fail(lexer, L"Division by zero");
+					value.value = 0;
+				}
+				else if (is_unsigned)
+					value.value = (i64)(op == expression_op('/') ? a / b : a % b);
+				else if (lhs == std::numeric_limits<i64>::min() && rhs.value == -1)
+					value.value = op == expression_op('/') ? lhs : 0;
+				else
+					value.value = op == expression_op('/') ? lhs / rhs.value : lhs % rhs.value;
+				break;
+			case expression_op('+'): value.value = (i64)(a + b); break;
+			case expression_op('-'): value.value = (i64)(a - b); break;
+			case expression_op('<', '<'):
+				value = {.value = shift_in_range ? (i64)(a << b) : 0, .is_unsigned = lhs_unsigned};
+				break;
+			case expression_op('>', '>'):
+				value.is_unsigned = lhs_unsigned;
+				if (lhs_unsigned)
+					value.value = shift_in_range ? (i64)(a >> b) : 0;
+				else
+					value.value = shift_in_range ? lhs >> b : (lhs < 0 ? -1 : 0);
+				break;
+			case expression_op('<'): value = {.value = is_unsigned ? a < b : lhs < rhs.value}; break;
+			case expression_op('<', '='): value = {.value = is_unsigned ? a <= b : lhs <= rhs.value}; break;
+			case expression_op('>'): value = {.value = is_unsigned ? a > b : lhs > rhs.value}; break;
+			case expression_op('>', '='): value = {.value = is_unsigned ? a >= b : lhs >= rhs.value}; break;
+			case expression_op('=', '='): value = {.value = a == b}; break;
+			case expression_op('!', '='): value = {.value = a != b}; break;
+			case expression_op('&'): value.value = (i64)(a & b); break;
+			case expression_op('^'): value.value = (i64)(a ^ b); break;
+			case expression_op('|'): value.value = (i64)(a | b); break;
+			case expression_op('&', '&'): value = {.value = lhs && rhs.value}; break;
+			case expression_op('|', '|'): value = {.value = lhs || rhs.value}; break;
+		}
+	}
+	return 1;
+}
+
+// The result is unsigned if either of the alternatives is
+bool parse_conditional_expression(ExpressionLexer& lexer, ExpressionValue& value, const bool evaluated)
+{
+	if (!parse_binary_expression(lexer, value, 1, evaluated))
+		return 0;
+	if (!is_op(lexer.token, expression_op('?')))
+		return 1;
+
+	ExpressionValue if_true;
+	ExpressionValue if_false;
+	if (!expression_next(lexer) || !parse_conditional_expression(lexer, if_true, evaluated && value.value))
+		return 0;
+	if (!is_op(lexer.token, expression_op(':')))
+		return expression_fail(lexer, L"Missing : of ?");
+	if (!expression_next(lexer) || !parse_conditional_expression(lexer, if_false, evaluated && !value.value))
+		return 0;
+
+	value = {.value = value.value ? if_true.value : if_false.value, .is_unsigned = if_true.is_unsigned || if_false.is_unsigned};
+	return 1;
+}
+
+// Evaluates the expression in [begin, end). On failure error says why.
+bool evaluate_expression(i64& value, const wchar_t*& error, const SymbolTable& symbols, const char* begin, const char* end)
+{
+	ExpressionLexer lexer = {.symbols = &symbols, .sources_count = 1};
+	lexer.sources[0] = {.c = begin, .end = end};
+
+	ExpressionValue result;
+	const auto evaluated = expression_next(lexer) && parse_conditional_expression(lexer, result, 1) &&
+		(lexer.token.kind == ExpressionTokenKind::End || expression_fail(lexer, L"Unexpected token after the expression"));
+	value = result.value;
+	error = lexer.error;
+	return evaluated;
+}
@@ -0,0 +1,515 @@
+// Finds every preprocessor directive line of a buffer in one pass. Only the
+// bytes that can change the state of the scanner ('#', '\n', '/', '"', '\'')
+// are looked at one by one, the rest is skipped 16 bytes at a time.
+
+enum class DirectiveKind : u8 {
+	Other, Include, Define, Undef, If, Ifdef, Ifndef, Elif, Else, Endif, Pragma, Error, Line,
+};
+
+struct DirectiveKeyword {
+	const char* name;
+	u8 size;
+	DirectiveKind kind;
+};
+
+constexpr DirectiveKeyword directive_keywords[] = {
+	{"include", 7, DirectiveKind::Include},
+	{"define", 6, DirectiveKind::Define},
+	{"undef", 5, DirectiveKind::Undef},
+	{"if", 2, DirectiveKind::If},
+	{"ifdef", 5, DirectiveKind::Ifdef},
+	{"ifndef", 6, DirectiveKind::Ifndef},
+	{"elif", 4, DirectiveKind::Elif},
+	{"else", 4, DirectiveKind::Else},
+	{"endif", 5, DirectiveKind::Endif},
+	{"pragma", 6, DirectiveKind::Pragma},
+	{"error", 5, DirectiveKind::Error},
+	{"line", 4, DirectiveKind::Line},
+};
+
+struct Directive {
+	// Of the whole line, leading whitespace and continuation lines included, without the '\n'
+	u64 offset;
+	u32 size;
+	// Of the first non blank character after the keyword, from offset
+	u32 arguments_offset;
+	// Index of the matching #endif for #if, #ifdef and #ifndef, so branches that
+	// aren't taken jump over the conditionals nested in them. 0 if it isn't in the buffer.
+	u32 end;
+	DirectiveKind kind;
+};
+
+struct DirectiveIndex {
+	Directive* directives;
+	u64 count;
+	u64 capacity;
+	// Allocates from it instead of the heap when set
+	Arena* arena;
+	// After the last '\n' that ends a line outside of any comment, so the buffer
+	// can be cut there without splitting a directive or a comment. 0 if there's none.
+	u64 cut_offset;
+};
+
+inline bool is_conditional_start(const DirectiveKind kind)
+{
+	return kind == DirectiveKind::If || kind == DirectiveKind::Ifdef || kind == DirectiveKind::Ifndef;
+}
+
+inline bool is_blank(const char c)
+{
+	return c == ' ' || c == '\t' || c == '\f' || c == '\v' || c == '\r';
+}
+
+inline bool is_identifier_char(const char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+DirectiveKind get_directive_kind(const char* keyword, const u64 keyword_size)
+{
+	for (const auto& directive_keyword : directive_keywords)
+	{
+		if (directive_keyword.size == keyword_size && memcmp(directive_keyword.name, keyword, keyword_size) == 0)
+			return directive_keyword.kind;
+	}
+
+	return DirectiveKind::Other;
+}
+
+const char* find_scanner_char(const char* begin, const char* end)
+{
+	auto c = begin;
+#ifdef SIMD_X86
+	const auto hash = _mm_set1_epi8('#');
+	const auto newline = _mm_set1_epi8('\n');
+	const auto slash = _mm_set1_epi8('/');
+	const auto double_quote = _mm_set1_epi8('"');
+	const auto single_quote = _mm_set1_epi8('\'');
+	for (; end - c >= 16; c += 16)
+	{
+		const auto block = _mm_loadu_si128((const __m128i*)c);
+		auto matches = _mm_or_si128(_mm_cmpeq_epi8(block, hash), _mm_cmpeq_epi8(block, newline));
+		matches = _mm_or_si128(matches, _mm_cmpeq_epi8(block, slash));
+		matches = _mm_or_si128(matches, _mm_or_si128(_mm_cmpeq_epi8(block, double_quote), _mm_cmpeq_epi8(block, single_quote)));
+		const auto mask = (u32)_mm_movemask_epi8(matches);
+		if (mask)
+			return c + count_trailing_zeros(mask);
+	}
+#endif
+	for (; c < end; c++)
+	{
+		if (*c == '#' || *c == '\n' || *c == '/' || *c == '"' || *c == '\'')
+			return c;
+	}
+
+	return end;
+}
+
+// Line end of a directive starting at c, following backslash continuations and
+// the block comments that go on past the end of a line, which are part of it
+const char* find_logical_line_end(const char* c, const char* end)
+{
+	const auto start = c;
+	for (; c < end; c++)
+	{
+		if (*c == '\n')
+		{
+			auto last = c - 1;
+			if (last >= start && *last == '\r') last--;
+			if (last < start || *last != '\\') return c;
+		}
+		else if (*c == '"' || *c == '\'')
+		{
+			// Unterminated ones end at the end of their line
+			const auto quote = *c;
+			for (c++; c < end && *c != quote && *c != '\n'; c++)
+			{
+				if (*c == '\\' && c + 1 < end)
+					c++;
+			}
+			if (c == end || *c == '\n')
+				c--;
+		}
+		else if (*c == '/' && c + 1 < end && c[1] == '/')
+		{
+			// Its '\n' is looked at next, like any other
+			const auto newline = (const char*)memchr(c, '\n', end - c);
+			if (!newline) return end;
+			c = newline - 1;
+		}
+		else if (*c == '/' && c + 1 < end && c[1] == '*')
+		{
+			for (c += 2; c + 1 < end && !(c[0] == '*' && c[1] == '/'); c++);
+			if (c + 1 >= end) return end;
+			c++;
+		}
+	}
+	return end;
+}
+
+bool directive_index_push(DirectiveIndex& index, const Directive& directive)
+{
+	if (index.count == index.capacity)
+	{
+		const auto new_capacity = index.capacity ? index.capacity * 2 : 64;
+		Directive* new_directives;
+		if (index.arena)
+			new_directives = (Directive*)arena_realloc(*index.arena, index.directives, index.count * sizeof(Directive), new_capacity * sizeof(Directive));
+		else
+			new_directives = (Directive*)memory_alloc(new_capacity * sizeof(Directive));
+		if (!new_directives)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+
+		if (index.directives && !index.arena)
+		{
+			memcpy(new_directives, index.directives, index.count * sizeof(Directive));
+			memory_free(index.directives);
+		}
+		index.directives = new_directives;
+		index.capacity = new_capacity;
+	}
+
+	index.directives[index.count++] = directive;
+	return 1;
+}
+
+void directive_index_free(DirectiveIndex& index)
+{
+	if (!index.arena)
+		memory_free(index.directives);
+	index = {};
+}
+
+// Sets the end of every conditional. While a conditional is open its end holds
+// the open one around it plus 1, so no stack is needed.
+void link_conditionals(DirectiveIndex& index)
+{
+	u64 open = 0;
+	for (u64 i = 0; i < index.count; i++)
+	{
+		auto& directive = index.directives[i];
+		if (is_conditional_start(directive.kind))
+		{
+			directive.end = (u32)open;
+			open = i + 1;
+		}
+		else if (directive.kind == DirectiveKind::Endif && open)
+		{
+			auto& start = index.directives[open - 1];
+			open = start.end;
+			start.end = (u32)i;
+		}
+	}
+
+	// Closed after the end of the buffer, if at all
+	while (open)
+	{
+		auto& start = index.directives[open - 1];
+		open = start.end;
+		start.end = 0;
+	}
+}
+
+// A '#' starts a directive when only blanks and comments come before it on its line.
+// Directives inside comments and string literals are skipped.
+bool build_directive_index(DirectiveIndex& index, const Buffer& buffer)
+{
+	index.count = 0;
+	index.cut_offset = 0;
+
+	const char* begin = buffer.content;
+	const auto end = buffer.content + buffer.size;
+
+	bool in_block_comment = 0;
+	bool line_has_code = 0;
+	// Where code can start on the current line, after its start or the last comment
+	auto code_start = begin;
+	// After the last '\n' outside of a comment, a comment over several lines is part of the line it starts on
+	auto line_start = begin;
+
+	auto c = begin;
+	while (c < end)
+	{
+		c = find_scanner_char(c, end);
+		if (c == end) break;
+
+		if (*c == '\n')
+		{
+			auto last = c - 1;
+			if (last >= begin && *last == '\r') last--;
+			if (!in_block_comment && (last < begin || *last != '\\'))
+				index.cut_offset = c + 1 - begin;
+
+			c++;
+			code_start = c;
+			if (!in_block_comment)
+			{
+				line_start = c;
+				line_has_code = 0;
+			}
+			continue;
+		}
+
+		if (in_block_comment)
+		{
+			if (*c == '/' && c > begin && c[-1] == '*' && c - 1 >= code_start)
+			{
+				in_block_comment = 0;
+				code_start = c + 1;
+			}
+			c++;
+			continue;
+		}
+
+		switch (*c)
+		{
+			case '/':
+			{
+				if (c + 1 < end && c[1] == '/')
+				{
+					c = (const char*)memchr(c, '\n', end - c);
+					if (!c) c = end;
+					continue;
+				}
+
+				if (c + 1 < end && c[1] == '*')
+				{
+					for (auto p = code_start; p < c; p++)
+					{
+						if (!is_blank(*p))
+							line_has_code = 1;
+					}
+					in_block_comment = 1;
+					// So the '*' of "/*" can't be taken for the one of "*/"
+					code_start = c + 2;
+					c += 2;
+					continue;
+				}
+
+				line_has_code = 1;
+				c++;
+				continue;
+			}
+
+			case '"':
+			case '\'':
+			{
+				line_has_code = 1;
+				const auto quote = *c;
+				for (c++; c < end && *c != quote && *c != '\n'; c++)
+				{
+					if (*c == '\\' && c + 1 < end)
+						c++;
+				}
+				if (c < end && *c == quote)
+					c++;
+				continue;
+			}
+
+			case '#':
+			{
+				auto is_directive = !line_has_code;
+				for (auto p = code_start; is_directive && p < c; p++)
+				{
+					if (!is_blank(*p))
+						is_directive = 0;
+				}
+
+				if (!is_directive)
+				{
+					line_has_code = 1;
+					c++;
+					continue;
+				}
+
+				auto keyword = c + 1;
+				for (; keyword < end && is_blank(*keyword); keyword++);
+				auto keyword_end = keyword;
+				for (; keyword_end < end && is_identifier_char(*keyword_end); keyword_end++);
+
+				auto arguments = keyword_end;
+				for (; arguments < end && is_blank(*arguments); arguments++);
+
+				const auto line_end = find_logical_line_end(c, end);
+				if (arguments > line_end)
+					arguments = line_end;
+
+				if ((u64)(line_end - line_start) > std::numeric_limits<u32>::max())
+				{
+					wprintf(L"Directive line is too large!\n");
+					return 0;
+				}
+
+				const Directive directive = {
+					.offset = (u64)(line_start - begin),
+					.size = (u32)(line_end - line_start),
+					.arguments_offset = (u32)(arguments - line_start),
+					.kind = get_directive_kind(keyword, keyword_end - keyword),
+				};
+				if (!directive_index_push(index, directive))
+					return 0;
+
+				c = line_end;
+				continue;
+			}
+		}
+	}
+
+	link_conditionals(index);
+	return 1;
+}
+
+// How a header protects itself against being included twice
+struct IncludeGuard {
+	bool pragma_once;
+	// Macro of an #ifndef/#define/#endif guard around the whole file
+	const char* macro;
+	u32 macro_size;
+};
+
+// Whether only blanks and comments are between begin and end
+bool is_blank_text(const char* begin, const char* end)
+{
+	for (auto c = begin; c < end; c++)
+	{
+		if (is_blank(*c) || *c == '\n') continue;
+
+		if (*c == '/' && c + 1 < end && c[1] == '/')
+		{
+			for (; c < end && *c != '\n'; c++);
+			continue;
+		}
+
+		if (*c == '/' && c + 1 < end && c[1] == '*')
+		{
+			const auto comment_start = c + 2;
+			for (c = comment_start; c < end && !(*c == '/' && c > comment_start && c[-1] == '*'); c++);
+			if (c == end) return 0;
+			continue;
+		}
+
+		return 0;
+	}
+
+	return 1;
+}
+
+// Returns the identifier at c, which has to be followed by nothing but blanks before end
+const char* get_sole_identifier(const char* c, const char* end, u32& size)
+{
+	if (c == end || !((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || *c == '_'))
+		return 0;
+
+	auto identifier_end = c + 1;
+	for (; identifier_end < end && is_identifier_char(*identifier_end); identifier_end++);
+	if (!is_blank_text(identifier_end, end))
+		return 0;
+
+	size = (u32)(identifier_end - c);
+	return c;
+}
+
+// Macro X of "#ifndef X" or "#if !defined(X)"
+const char* get_guard_condition_macro(const Buffer& buffer, const Directive& directive, u32& size)
+{
+	auto c = buffer.content + directive.offset + directive.arguments_offset;
+	auto end = buffer.content + directive.offset + directive.size;
+	if (directive.kind == DirectiveKind::Ifndef)
+		return get_sole_identifier(c, end, size);
+	if (directive.kind != DirectiveKind::If)
+		return 0;
+
+	if (c == end || *c != '!') return 0;
+	for (c++; c < end && is_blank(*c); c++);
+	if (end - c < 7 || memcmp(c, "defined", 7) != 0) return 0;
+	for (c += 7; c < end && is_blank(*c); c++);
+
+	if (c < end && *c == '(')
+	{
+		for (c++; c < end && is_blank(*c); c++);
+		auto close = c;
+		for (; close < end && *close != ')'; close++);
+		if (close == end || !is_blank_text(close + 1, end)) return 0;
+		end = close;
+	}
+
+	return get_sole_identifier(c, end, size);
+}
+
+// Done once per header, so including it again can be skipped without looking at it
+IncludeGuard find_include_guard(const Buffer& buffer, const DirectiveIndex& index)
+{
+	IncludeGuard guard = {};
+	// Only a #pragma once outside of the conditionals is sure to be seen whenever the header is expanded
+	u64 conditional_depth = 0;
+	for (u64 i = 0; i < index.count; i++)
+	{
+		const auto& directive = index.directives[i];
+		if (directive.kind == DirectiveKind::If || directive.kind == DirectiveKind::Ifdef || directive.kind == DirectiveKind::Ifndef)
+			conditional_depth++;
+		else if (directive.kind == DirectiveKind::Endif && conditional_depth)
+			conditional_depth--;
+		if (directive.kind != DirectiveKind::Pragma || conditional_depth) continue;
+
+		u32 size;
+		const auto argument = get_sole_identifier(buffer.content + directive.offset + directive.arguments_offset, buffer.content + directive.offset + directive.size, size);
+		if (argument && size == 4 && memcmp(argument, "once", 4) == 0)
+		{
+			guard.pragma_once = 1;
+			break;
+		}
+	}
+
+	if (index.count < 3) return guard;
+
+	const auto& first = index.directives[0];
+	const auto& second = index.directives[1];
+	const auto& last = index.directives[index.count - 1];
+	if (second.kind != DirectiveKind::Define || last.kind != DirectiveKind::Endif)
+		return guard;
+
+	u32 macro_size;
+	const auto macro = get_guard_condition_macro(buffer, first, macro_size);
+	if (!macro) return guard;
+
+	// "#define X" or "#define X 1"
+	const auto define_arguments = buffer.content + second.offset + second.arguments_offset;
+	const auto define_end = buffer.content + second.offset + second.size;
+	if ((u64)(define_end - define_arguments) < macro_size || memcmp(define_arguments, macro, macro_size) != 0 ||
+		(define_arguments + macro_size < define_end && (is_identifier_char(define_arguments[macro_size]) || define_arguments[macro_size] == '(')))
+		return guard;
+
+	// The #endif of the first condition has to be the last directive
+	u64 depth = 0;
+	for (u64 i = 0; i < index.count; i++)
+	{
+		const auto kind = index.directives[i].kind;
+		if (kind == DirectiveKind::If || kind == DirectiveKind::Ifdef || kind == DirectiveKind::Ifndef)
+			depth++;
+		else if ((kind == DirectiveKind::Else || kind == DirectiveKind::Elif) && depth == 1)
+			return guard;
+		else if (kind == DirectiveKind::Endif && depth && !--depth && i != index.count - 1)
+			return guard;
+	}
+	if (depth) return guard;
+
+	// Nothing but comments outside of it
+	if (!is_blank_text(buffer.content, buffer.content + first.offset) ||
+		!is_blank_text(buffer.content + last.offset + last.size, buffer.content + buffer.size))
+		return guard;
+
+	guard.macro = macro;
+	guard.macro_size = macro_size;
+	return guard;
+}
+
+// A unix buffer together with its directives
+struct SourceFile {
+	Buffer buffer;
+	const Directive* directives;
+	u64 directives_count;
+	IncludeGuard guard;
+};
@@ -0,0 +1,189 @@
+// Lists every file of a directory tree for --recursive. The tree is walked one
+// level at a time: the directories of a level are read in parallel on the
+// thread pool, and the subdirectories they hold make up the next level.
+struct WalkedFile {
+	// Starts with the root, so it's relative to the current directory like it
+	PathId path;
+	// 0 where read_directory doesn't know it
+	u64 size;
+};
+
+template <typename T>
+bool walker_push(T*& items, u32& count, u32& capacity, const T& item)
+{
+	if (count == capacity)
+	{
+		const auto new_capacity = capacity ? capacity * 2 : 256;
+		const auto new_items = (T*)memory_alloc(new_capacity * sizeof(T));
+		if (!new_items)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+
+		if (items)
+		{
+			memcpy(new_items, items, count * sizeof(T));
+			memory_free(items);
+		}
+		items = new_items;
+		capacity = new_capacity;
+	}
+
+	items[count++] = item;
+	return 1;
+}
+
+// What a worker found in the directories it read during a level
+struct WalkerOutput {
+	WalkedFile* files;
+	u32 files_count;
+	u32 files_capacity;
+	// With a trailing separator
+	PathId* dirs;
+	u32 dirs_count;
+	u32 dirs_capacity;
+	bool failed;
+};
+
+struct DirectoryWalker {
+	// Wildcards the file names have to match
+	const char* pattern;
+	// Directories of the level being read
+	const PathId* level;
+	// One per worker
+	WalkerOutput* outputs;
+};
+
+struct WalkResult {
+	// Sorted by path, so the jobs are the same from one run to the next
+	WalkedFile* files;
+	u32 files_count;
+	u32 files_capacity;
+	// Every directory walked, the root first and parents before their children
+	PathId* dirs;
+	u32 dirs_count;
+	u32 dirs_capacity;
+};
+
+struct WalkedDirectory {
+	const DirectoryWalker* walker;
+	WalkerOutput* output;
+	PathId dir;
+};
+
+void walk_directory_entry(const DirectoryEntry& entry, void* user)
+{
+	auto& walked = *(WalkedDirectory*)user;
+	auto& output = *walked.output;
+	if (!entry.is_directory && !file_name_matches(walked.walker->pattern, entry.name)) return;
+
+	const auto& dir = path_pool_entry(g_paths, walked.dir);
+	char path[max_path_size];
+	auto path_size = dir.size + entry.name_size;
+	if (path_size + 1 >= sizeof(path))
+	{
+		wprintf(L"File path is too large!\n");
+		output.failed = 1;
+		return;
+	}
+	memcpy(path, dir.path, dir.size);
+	memcpy(path + dir.size, entry.name, entry.name_size);
+	if (entry.is_directory)
+		path[path_size++] = PATH_SEPARATOR[0];
+
+	const auto path_id = path_pool_intern(g_paths, path, path_size);
+	if (!path_id ||
+		(entry.is_directory && !walker_push(output.dirs, output.dirs_count, output.dirs_capacity, path_id)) ||
+		(!entry.is_directory && !walker_push(output.files, output.files_count, output.files_capacity, {.path = path_id, .size = entry.size})))
+		output.failed = 1;
+}
+
+void walk_directory(u32 item, u32 worker_index, void* user)
+{
+	const auto& walker = *(DirectoryWalker*)user;
+	WalkedDirectory walked = {.walker = &walker, .output = &walker.outputs[worker_index], .dir = walker.level[item]};
+	if (!read_directory(get_path(walked.dir), walk_directory_entry, &walked))
+		walked.output->failed = 1;
+}
+
+void walk_result_free(WalkResult& result)
+{
+	memory_free(result.files);
+	memory_free(result.dirs);
+	result = {};
+}
+
+// root ends with a separator or is empty for the current directory. Fails if any directory can't be read.
+bool walk_directory_tree(WalkResult& result, const PathId root, const char* pattern, const u32 workers_count)
+{
+	result = {};
+	const auto outputs = (WalkerOutput*)memory_alloc(workers_count * sizeof(WalkerOutput));
+	if (!outputs)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+	memset(outputs, 0, workers_count * sizeof(WalkerOutput));
+
+	DirectoryWalker walker = {.pattern = pattern, .outputs = outputs};
+	auto failed = !walker_push(result.dirs, result.dirs_count, result.dirs_capacity, root);
+	// The level is a range of result.dirs, items index into it
+	u32 level_start = 0;
+	u32* items = 0;
+	u32 items_capacity = 0;
+	while (!failed && level_start < result.dirs_count)
+	{
+		const auto level_count = result.dirs_count - level_start;
+		if (level_count > items_capacity)
+		{
+			memory_free(items);
+			items_capacity = level_count * 2;
+			items = (u32*)memory_alloc(items_capacity * sizeof(u32));
+			if (!items)
+			{
+				wprintf(L"Failed to allocate memory!\n");
+				failed = 1;
+				break;
+			}
+		}
+		for (u32 i = 0; i < level_count; i++)
+			items[i] = i;
+
+		walker.level = result.dirs + level_start;
+		thread_pool_run(workers_count, items, level_count, walk_directory, &walker);
+		level_start = result.dirs_count;
+
+		for (u32 w = 0; w < workers_count; w++)
+		{
+			auto& output = outputs[w];
+			failed |= output.failed;
+			for (u32 i = 0; i < output.files_count && !failed; i++)
+				failed = !walker_push(result.files, result.files_count, result.files_capacity, output.files[i]);
+			for (u32 i = 0; i < output.dirs_count && !failed; i++)
+				failed = !walker_push(result.dirs, result.dirs_count, result.dirs_capacity, output.dirs[i]);
+			output.files_count = 0;
+			output.dirs_count = 0;
+		}
+	}
+
+	memory_free(items);
+	for (u32 w = 0; w < workers_count; w++)
+	{
+		memory_free(outputs[w].files);
+		memory_free(outputs[w].dirs);
+	}
+	memory_free(outputs);
+
+	if (failed)
+	{
+		walk_result_free(result);
+		return 0;
+	}
+
+	if (result.files_count)
+		qsort(result.files, result.files_count, sizeof(WalkedFile), [](const void* a, const void* b) {
+		return strcmp(get_path(((const WalkedFile*)a)->path), get_path(((const WalkedFile*)b)->path));
+	});
+	return 1;
+}
@@ -1,22 +1,90 @@
+#ifdef _WIN32
+typedef HANDLE FileHandle;
+const FileHandle invalid_file_handle = 0;
+#define PATH_SEPARATOR "\\"
+#else
+typedef int FileHandle;
+const FileHandle invalid_file_handle = -1;
+#define PATH_SEPARATOR "/"
+#endif
+
+// Longest UTF-8 path parsa builds, the same as PATH_MAX
+constexpr u64 max_path_size = 4096;
+
+// Stands for stdin as the input and for stdout as the output
+constexpr const char* stdio_path = "-";
+
+inline bool is_stdio_path(const char* path)
+{
+	return path[0] == '-' && !path[1];
+}
+
 struct FileView {
-	const HANDLE handle;
+	const FileHandle handle;
 	const Buffer buffer;
 };
 
-HANDLE create_wo_file(const wchar_t* file_path)
+// Unix buffer of a file, pointing either into its own memory or into the file view
+struct UnixBuffer {
+	Buffer buffer;
+	void* memory;
+	u64 memory_size;
+	bool is_file_view;
+};
+
+struct FileInfo {
+	u64 size;
+	u64 last_write_time;
+};
+
+// Entry of read_directory, only valid during the call of its DirectoryEntryProc
+struct DirectoryEntry {
+	const char* name;
+	u64 name_size;
+	bool is_directory;
+	// 0 where knowing it would take a stat of every entry
+	u64 size;
+};
+
+typedef void (*DirectoryEntryProc)(const DirectoryEntry& entry, void* user);
+
+// Piece of a file being written, pointing into a buffer that outlives the write
+struct OutputSlice {
+	const char* content;
+	u64 size;
+};
+
+#ifdef _WIN32
+// Paths are UTF-8 inside parsa and converted to UTF-16 at the API call
+template <u64 N>
+bool get_native_path(wchar_t (&dest)[N], const char* path)
 {
-	const auto file_handle = CreateFileW(file_path, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (!utf8_to_wide(dest, N, path, strlen(path)) && path[0])
+	{
+		wprintf(L"File path is too large!\n");
+		return 0;
+	}
+	return 1;
+}
+
+HANDLE create_wo_file(const char* file_path)
+{
+	wchar_t native_path[max_path_size];
+	if (!get_native_path(native_path, file_path))
+		return 0;
+
+	const auto file_handle = CreateFileW(native_path, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
 
 	if (INVALID_HANDLE_VALUE == file_handle)
 	{
-		nice_wprintf(L"Failed to create file \"%ls\"", file_path);
+		nice_wprintf(L"Failed to create file \"%hs\"", file_path);
 		const auto error = GetLastError();
 		if (ERROR_FILE_EXISTS == error)
-			wprintf(L": File already exists");
+			nice_wprintf(L": File already exists");
 		else if (ERROR_PATH_NOT_FOUND == error)
-			wprintf(L": Path doesn't exist");
+			nice_wprintf(L": Path doesn't exist");
 
-		wprintf(L"!\n");
+		nice_wprintf(L"!\n");
 
 		return 0;
 	}
@@ -24,47 +92,103 @@ HANDLE create_wo_file(const wchar_t* file_path)
 	return file_handle;
 }
 
-bool write_file(const HANDLE file_handle, const wchar_t* file_path, const Buffer& file_buffer)
+bool write_file(const HANDLE file_handle, const char* file_path, const Buffer& file_buffer)
 {
 	auto file_size_to_write = file_buffer.size;
+	auto file_buffer_cursor = file_buffer.content;
 	while (true)
 	{
 		const auto max_dword_value = std::numeric_limits<DWORD>::max();
 		const auto to_write = (DWORD)(file_size_to_write > max_dword_value ? max_dword_value : file_size_to_write);
 
 		DWORD bytes_written;
-		const auto ret = WriteFile(file_handle, file_buffer.content, to_write, &bytes_written, 0);
+		const auto ret = WriteFile(file_handle, file_buffer_cursor, to_write, &bytes_written, 0);
 		if (!ret)
 		{
-			nice_wprintf(L"Failed to write to file \"%ls\"!\n", file_path);
+			nice_wprintf(L"Failed to write to file \"%hs\"!\n", file_path);
 			break;
 		}
 		if (!bytes_written)
 		{
-			nice_wprintf(L"Successfuly wrote to file \"%ls\"\n", file_path);
+			log_verbose(L"Successfuly wrote to file \"%hs\"\n", file_path);
 			return 1;
 		}
 
 		file_size_to_write -= bytes_written;
+		file_buffer_cursor += bytes_written;
 	}
 
 	return 0;
 }
 
-HANDLE open_ro_file(const wchar_t* file_path)
+bool write_file_data(const HANDLE file_handle, const char* data, u64 size)
+{
+	while (size)
+	{
+		const auto max_dword_value = std::numeric_limits<DWORD>::max();
+		const auto to_write = (DWORD)(size > max_dword_value ? max_dword_value : size);
+
+		DWORD bytes_written;
+		if (!WriteFile(file_handle, data, to_write, &bytes_written, 0) || !bytes_written)
+			return 0;
+
+		data += bytes_written;
+		size -= bytes_written;
+	}
+
+	return 1;
+}
+
+// WriteFileGather only takes page aligned pages of unbuffered files, so small
+// slices are gathered into a staging buffer and large ones are written as they are
+bool write_slices(const HANDLE file_handle, const OutputSlice* slices, const u64 slices_count)
+{
+	char staging[64 * 1024];
+	u64 staged = 0;
+	bool written = 1;
+	for (u64 i = 0; written && i < slices_count; i++)
+	{
+		const auto& slice = slices[i];
+		if (staged + slice.size > sizeof(staging))
+		{
+			written = write_file_data(file_handle, staging, staged);
+			staged = 0;
+			if (slice.size > sizeof(staging))
+			{
+				written = written && write_file_data(file_handle, slice.content, slice.size);
+				continue;
+			}
+		}
+
+		memcpy(staging + staged, slice.content, slice.size);
+		staged += slice.size;
+	}
+	return written && write_file_data(file_handle, staging, staged);
+}
+
+void close_file(const HANDLE file_handle)
 {
-	const auto file_handle = CreateFileW(file_path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	CloseHandle(file_handle);
+}
+
+HANDLE open_ro_file(const char* file_path)
+{
+	wchar_t native_path[max_path_size];
+	if (!get_native_path(native_path, file_path))
+		return 0;
+
+	const auto file_handle = CreateFileW(native_path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
 
 	if (INVALID_HANDLE_VALUE == file_handle)
 	{
-		nice_wprintf(L"Failed to open file \"%ls\"", file_path);
+		nice_wprintf(L"Failed to open file \"%hs\"", file_path);
 		const auto error = GetLastError();
 		if (ERROR_FILE_NOT_FOUND == error)
-			wprintf(L": File doesn't exist");
+			nice_wprintf(L": File doesn't exist");
 		else if (ERROR_FILE_CHECKED_OUT == error)
-			wprintf(L": File is being used by other program");
+			nice_wprintf(L": File is being used by other program");
 
-		wprintf(L"!\n");
+		nice_wprintf(L"!\n");
 
 		return 0;
 	}
@@ -81,7 +205,45 @@ u64 get_file_size(const HANDLE file_handle)
 	return large_int.QuadPart;
 }
 
-const FileView create_ro_file_view(const wchar_t* file_path)
+// Reads what's available up to size bytes, bytes_read is 0 at the end of the file
+bool read_file_data(const HANDLE file_handle, const char* file_path, char* data, const u64 size, u64& bytes_read)
+{
+	const auto max_dword_value = std::numeric_limits<DWORD>::max();
+	DWORD chunk_read;
+	if (!ReadFile(file_handle, data, (DWORD)(size > max_dword_value ? max_dword_value : size), &chunk_read, 0))
+	{
+		// The writing end of the pipe was closed
+		if (GetLastError() != ERROR_BROKEN_PIPE)
+		{
+			nice_wprintf(L"Failed to read from file \"%hs\"!\n", file_path);
+			return 0;
+		}
+		chunk_read = 0;
+	}
+
+	bytes_read = chunk_read;
+	return 1;
+}
+
+HANDLE get_stdin_handle()
+{
+	return GetStdHandle(STD_INPUT_HANDLE);
+}
+
+// Keeps the stdout of the process for the output, messages go to stderr from then on
+HANDLE take_stdout_handle()
+{
+	fflush(stdout);
+	const auto out_fd = _dup(_fileno(stdout));
+	if (out_fd < 0 || _dup2(_fileno(stderr), _fileno(stdout)) != 0)
+		return 0;
+
+	_setmode(_fileno(stdout), _O_U16TEXT);
+	g_conout = GetStdHandle(STD_ERROR_HANDLE);
+	return (HANDLE)_get_osfhandle(out_fd);
+}
+
+const FileView create_ro_file_view(const char* file_path)
 {
 	Buffer buffer = {};
 	FileView result = {.buffer = buffer};
@@ -92,138 +254,888 @@ const FileView create_ro_file_view(const wchar_t* file_path)
 	const auto file_map = CreateFileMappingW(file_handle, 0, PAGE_READONLY, 0, 0, 0);
 	if (!file_map)
 	{
-		nice_wprintf(L"Failed to create file mapping of file \"%ls\"!\n", file_path);
+		nice_wprintf(L"Failed to create file mapping of file \"%hs\"!\n", file_path);
 		if (GetLastError() == ERROR_FILE_INVALID)
-			nice_wprintf(L"File \"%ls\" is empty!\n", file_path);
+			nice_wprintf(L"File \"%hs\" is empty!\n", file_path);
 		return result;
 	}
 
 	const auto file_view = (char*)MapViewOfFile(file_map, FILE_MAP_READ, 0, 0, 0);
+	// The view keeps the mapping alive
+	CloseHandle(file_map);
 	if (!file_view)
 	{
-		nice_wprintf(L"Failed to create file view of file \"%ls\"!\n", file_path);
+		nice_wprintf(L"Failed to create file view of file \"%hs\"!\n", file_path);
 		return result;
 	}
 
 	const auto file_view_size = get_file_size(file_handle);
 	if (!file_view_size) {
-		nice_wprintf(L"Failed to get file size of file \"%ls\"!\n", file_path);
+		nice_wprintf(L"Failed to get file size of file \"%hs\"!\n", file_path);
 		return result;
 	}
 
 	return {.handle = file_handle, .buffer = {.content = file_view, .size = file_view_size}};
 }
 
-u64 read_file_view_to_unix_buffer(char* out_buffer, const FileView file_view, const wchar_t* file_path)
+void close_file_view(const FileView& file_view)
 {
-	if (!strstr(file_view.buffer.content, "\r\n"))
+	UnmapViewOfFile(file_view.buffer.content);
+	CloseHandle(file_view.handle);
+}
+
+bool get_file_info(const char* file_path, FileInfo& file_info)
+{
+	wchar_t native_path[max_path_size];
+	if (!get_native_path(native_path, file_path))
+		return 0;
+
+	WIN32_FILE_ATTRIBUTE_DATA file_attrs;
+	if (!GetFileAttributesExW(native_path, GetFileExInfoStandard, &file_attrs))
+		return 0;
+
+	file_info.size = (u64)file_attrs.nFileSizeHigh << 32 | file_attrs.nFileSizeLow;
+	file_info.last_write_time = (u64)file_attrs.ftLastWriteTime.dwHighDateTime << 32 | file_attrs.ftLastWriteTime.dwLowDateTime;
+	return 1;
+}
+
+// Returns the length of the full path, or 0 if it doesn't fit in dest
+u64 get_full_path_name(char* dest, const u64 dest_size, const char* src, char** file_part)
+{
+	wchar_t native_src[max_path_size];
+	wchar_t native_dest[max_path_size];
+	if (!get_native_path(native_src, src))
+		return 0;
+
+	const auto written = GetFullPathNameW(native_src, (DWORD)COUNTOF(native_dest), native_dest, 0);
+	if (!written || written >= COUNTOF(native_dest)) return 0;
+
+	const auto size = wide_to_utf8(dest, dest_size, native_dest);
+	if (!size) return 0;
+
+	if (file_part)
 	{
-#ifdef DEBUG
-		nice_wprintf(L"File \"%ls\" is unix\n", file_path);
-#endif
-		size_t size;
-		if (strcmp(&file_view.buffer.content[file_view.buffer.size-1], "\n") == 0)
-			size = file_view.buffer.size - 1;
-		else
-			size = file_view.buffer.size;
+		const auto last_separator = strrchr(dest, '\\');
+		*file_part = last_separator && last_separator[1] ? last_separator + 1 : 0;
+	}
+	return size;
+}
+
+u64 get_current_directory(char* dest, const u64 dest_size)
+{
+	wchar_t native_path[max_path_size];
+	const auto written = GetCurrentDirectoryW((DWORD)COUNTOF(native_path), native_path);
+	if (!written || written >= COUNTOF(native_path)) return 0;
+	return wide_to_utf8(dest, dest_size, native_path);
+}
+
+bool is_directory(const char* path)
+{
+	wchar_t native_path[max_path_size];
+	if (!get_native_path(native_path, path))
+		return 0;
+
+	const auto file_attrs = GetFileAttributesW(native_path);
+	return file_attrs != INVALID_FILE_ATTRIBUTES && file_attrs & FILE_ATTRIBUTE_DIRECTORY;
+}
+
+bool path_exists(const char* path)
+{
+	wchar_t native_path[max_path_size];
+	return get_native_path(native_path, path) && PathFileExistsW(native_path);
+}
+
+bool create_directory(const char* path)
+{
+	wchar_t native_path[max_path_size];
+	if (!get_native_path(native_path, path))
+		return 0;
+
+	return CreateDirectoryW(native_path, 0) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+// Moves from over to, atomically when both are on the same volume
+bool replace_file(const char* from, const char* to)
+{
+	wchar_t native_from[max_path_size];
+	wchar_t native_to[max_path_size];
+	if (!get_native_path(native_from, from) || !get_native_path(native_to, to))
+		return 0;
 
-		memcpy(out_buffer, file_view.buffer.content, size);
-		return size;
+	if (!MoveFileExW(native_from, native_to, MOVEFILE_REPLACE_EXISTING))
+	{
+		nice_wprintf(L"Failed to replace file \"%hs\"!\n", to);
+		return 0;
 	}
 
-#ifdef DEBUG
-	nice_wprintf(L"File \"%ls\" is dos\n", file_path);
-#endif
+	return 1;
+}
 
-	u64 result = file_view.buffer.size;
+struct DirectorySearch {
+	HANDLE handle;
+	WIN32_FIND_DATAW ffd;
+	bool failed;
 
-	auto out_buffer_end = out_buffer;
-	auto haystack = file_view.buffer.content;
-	const char* last_dos_le = 0;
-	while (true)
+	// Current entry
+	const char* file_name;
+	bool is_directory;
+	u64 file_size;
+	char file_name_buffer[MAX_PATH * 3];
+};
+
+bool directory_search_fill(DirectorySearch& search)
+{
+	if (!wide_to_utf8(search.file_name_buffer, sizeof(search.file_name_buffer), search.ffd.cFileName))
+		return 0;
+
+	search.file_name = search.file_name_buffer;
+	search.is_directory = search.ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
+	search.file_size = (u64)search.ffd.nFileSizeHigh << 32 | search.ffd.nFileSizeLow;
+	return 1;
+}
+
+bool directory_search_next(DirectorySearch& search)
+{
+	while (FindNextFileW(search.handle, &search.ffd))
+	{
+		if (directory_search_fill(search))
+			return 1;
+	}
+
+	search.failed = GetLastError() != ERROR_NO_MORE_FILES;
+	return 0;
+}
+
+bool directory_search_first(DirectorySearch& search, const char* pattern)
+{
+	search = {};
+
+	wchar_t native_pattern[max_path_size];
+	if (!get_native_path(native_pattern, pattern))
+		return 0;
+
+	search.handle = FindFirstFileW(native_pattern, &search.ffd);
+	if (INVALID_HANDLE_VALUE == search.handle)
+		return 0;
+
+	return directory_search_fill(search) || directory_search_next(search);
+}
+
+void directory_search_close(DirectorySearch& search)
+{
+	FindClose(search.handle);
+}
+
+// Calls proc with every file and directory in path, without "." and "..".
+// Directory links are skipped, so walking a tree never loops.
+bool read_directory(const char* path, DirectoryEntryProc proc, void* user)
+{
+	char pattern[max_path_size];
+	wchar_t native_pattern[max_path_size];
+	if (strlcpy(pattern, path, sizeof(pattern)) >= sizeof(pattern) ||
+		strlcat(pattern, "*", sizeof(pattern)) >= sizeof(pattern) ||
+		!get_native_path(native_pattern, pattern))
+		return 0;
+
+	// Basic info skips the short names, large fetches read many entries per call
+	WIN32_FIND_DATAW ffd;
+	const auto handle = FindFirstFileExW(native_pattern, FindExInfoBasic, &ffd, FindExSearchNameMatch, 0, FIND_FIRST_EX_LARGE_FETCH);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		nice_wprintf(L"Failed to read directory \"%hs\"!\n", path);
+		return 0;
+	}
+
+	do {
+		const auto is_directory = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		if (is_directory && (ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) continue;
+		if (ffd.cFileName[0] == L'.' && (!ffd.cFileName[1] || (ffd.cFileName[1] == L'.' && !ffd.cFileName[2]))) continue;
+
+		char name[MAX_PATH * 3];
+		const auto name_size = wide_to_utf8(name, sizeof(name), ffd.cFileName);
+		if (!name_size) continue;
+
+		proc({
+			.name = name,
+			.name_size = name_size,
+			.is_directory = is_directory,
+			.size = (u64)ffd.nFileSizeHigh << 32 | ffd.nFileSizeLow,
+		}, user);
+	}
+	while (FindNextFileW(handle, &ffd));
+
+	const auto failed = GetLastError() != ERROR_NO_MORE_FILES;
+	FindClose(handle);
+	if (failed)
+		nice_wprintf(L"Failed to read directory \"%hs\"!\n", path);
+	return !failed;
+}
+
+// Same wildcards as directory_search_first
+bool file_name_matches(const char* pattern, const char* name)
+{
+	wchar_t native_pattern[MAX_PATH];
+	wchar_t native_name[MAX_PATH];
+	return get_native_path(native_pattern, pattern) && get_native_path(native_name, name) && PathMatchSpecW(native_name, native_pattern);
+}
+#else
+// Paths are UTF-8 inside parsa, so they are given to the syscalls as they are
+int create_wo_file(const char* file_path)
+{
+	const auto file_handle = open(file_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (file_handle < 0)
+	{
+		nice_wprintf(L"Failed to create file \"%hs\"", file_path);
+		if (errno == ENOENT)
+			nice_wprintf(L": Path doesn't exist");
+		else if (errno == EACCES)
+			nice_wprintf(L": Permission denied");
+
+		nice_wprintf(L"!\n");
+
+		return invalid_file_handle;
+	}
+
+	return file_handle;
+}
+
+bool write_file(const int file_handle, const char* file_path, const Buffer& file_buffer)
+{
+	u64 offset = 0;
+	while (offset < file_buffer.size)
+	{
+		const auto bytes_written = pwrite(file_handle, file_buffer.content + offset, file_buffer.size - offset, offset);
+		if (bytes_written < 0)
+		{
+			if (errno == EINTR) continue;
+			nice_wprintf(L"Failed to write to file \"%hs\"!\n", file_path);
+			return 0;
+		}
+
+		offset += bytes_written;
+	}
+
+	log_verbose(L"Successfuly wrote to file \"%hs\"\n", file_path);
+	return 1;
+}
+
+// Writes every slice with as few writev calls as possible, nothing is copied
+bool write_slices(const int file_handle, const OutputSlice* slices, const u64 slices_count)
+{
+	u64 slice_index = 0;
+	u64 slice_offset = 0;
+	while (slice_index < slices_count)
 	{
-		const auto dos_le = strstr(haystack, "\r\n");
-		if (!dos_le) {
-			const auto eof = file_view.buffer.content + file_view.buffer.size;
-			if (last_dos_le != eof - 2)
+		// Linux doesn't take more than 1024 at once
+		iovec iovecs[1024];
+		int iovecs_count = 0;
+		for (auto i = slice_index; i < slices_count && iovecs_count < (int)COUNTOF(iovecs); i++)
+		{
+			const auto offset = i == slice_index ? slice_offset : 0;
+			iovecs[iovecs_count++] = {.iov_base = (void*)(slices[i].content + offset), .iov_len = slices[i].size - offset};
+		}
+
+		auto bytes_written = writev(file_handle, iovecs, iovecs_count);
+		if (bytes_written < 0)
+		{
+			if (errno == EINTR) continue;
+			return 0;
+		}
+
+		// Partial writes can stop in the middle of a slice
+		while (bytes_written > 0)
+		{
+			const auto remaining = slices[slice_index].size - slice_offset;
+			if ((u64)bytes_written < remaining)
 			{
-				// File doesn't have eol
-				memcpy(out_buffer_end, haystack, eof - haystack);
+				slice_offset += bytes_written;
 				break;
 			}
-			result--;
-			break;
+
+			bytes_written -= remaining;
+			slice_index++;
+			slice_offset = 0;
 		}
+	}
 
-		const auto size = dos_le - haystack;
-		memcpy(out_buffer_end, haystack, size);
-		out_buffer_end += size;
-		haystack = dos_le + 1;
-		result--;
-		last_dos_le = dos_le;
+	return 1;
+}
+
+void close_file(const int file_handle)
+{
+	close(file_handle);
+}
+
+int open_ro_file(const char* file_path)
+{
+	const auto file_handle = open(file_path, O_RDONLY | O_CLOEXEC);
+	if (file_handle < 0)
+	{
+		nice_wprintf(L"Failed to open file \"%hs\"", file_path);
+		if (errno == ENOENT)
+			nice_wprintf(L": File doesn't exist");
+		else if (errno == EACCES)
+			nice_wprintf(L": Permission denied");
+
+		nice_wprintf(L"!\n");
+
+		return invalid_file_handle;
 	}
 
-	return result;
+	return file_handle;
+}
+
+u64 get_file_size(const int file_handle)
+{
+	struct stat file_stat;
+	if (fstat(file_handle, &file_stat) != 0) return 0;
 
-#if 0
-	if (strcmp(&file_view.buffer.content[file_view.buffer.size-2], "\r\n") != 0)
+	return file_stat.st_size;
+}
+
+// Reads what's available up to size bytes, bytes_read is 0 at the end of the file
+bool read_file_data(const int file_handle, const char* file_path, char* data, const u64 size, u64& bytes_read)
+{
+	while (true)
 	{
-#ifdef DEBUG
-		nice_wprintf(L"File \"%ls\" is unix\n", file_path);
-#endif
-		const auto size = file_view.buffer.size - 1;
-		memcpy(out_buffer, file_view.buffer.content, size);
-		return size;
+		const auto chunk_read = read(file_handle, data, size);
+		if (chunk_read >= 0)
+		{
+			bytes_read = chunk_read;
+			return 1;
+		}
+		if (errno == EINTR) continue;
+
+		nice_wprintf(L"Failed to read from file \"%hs\"!\n", file_path);
+		return 0;
+	}
+}
+
+int get_stdin_handle()
+{
+	return STDIN_FILENO;
+}
+
+// Keeps the stdout of the process for the output, messages go to stderr from then on
+int take_stdout_handle()
+{
+	fflush(stdout);
+	const auto file_handle = dup(STDOUT_FILENO);
+	if (file_handle < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+		return invalid_file_handle;
+
+	return file_handle;
+}
+
+// The view is a private mapping, so it can be normalized in place: pages are
+// only copied by the kernel once they are written, pure LF files never are.
+const FileView create_ro_file_view(const char* file_path)
+{
+	Buffer buffer = {};
+	FileView result = {.handle = invalid_file_handle, .buffer = buffer};
+
+	const auto file_handle = open_ro_file(file_path);
+	if (file_handle == invalid_file_handle) return result;
+
+	const auto file_view_size = get_file_size(file_handle);
+	if (!file_view_size) {
+		nice_wprintf(L"File \"%hs\" is empty!\n", file_path);
+		close(file_handle);
+		return result;
 	}
-	else if (strcmp(&file_view.buffer.content[file_view.buffer.size-1], "\n") != 0)
+
+	const auto file_view = (char*)mmap(0, file_view_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file_handle, 0);
+	if (file_view == MAP_FAILED)
+	{
+		nice_wprintf(L"Failed to create file view of file \"%hs\"!\n", file_path);
+		close(file_handle);
+		return result;
+	}
+
+	// Advices aren't flags, they have to be given one at a time
+	madvise(file_view, file_view_size, MADV_SEQUENTIAL);
+	madvise(file_view, file_view_size, MADV_WILLNEED);
+
+	return {.handle = file_handle, .buffer = {.content = file_view, .size = file_view_size}};
+}
+
+void close_file_view(const FileView& file_view)
+{
+	munmap(file_view.buffer.content, file_view.buffer.size);
+	close(file_view.handle);
+}
+
+bool get_file_info(const char* file_path, FileInfo& file_info)
+{
+	struct stat file_stat;
+	if (stat(file_path, &file_stat) != 0)
+		return 0;
+
+	file_info.size = file_stat.st_size;
+	file_info.last_write_time = (u64)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+	return 1;
+}
+
+u64 get_current_directory(char* dest, const u64 dest_size)
+{
+	if (!getcwd(dest, dest_size))
+		return 0;
+
+	return strlen(dest);
+}
+
+// Lexical equivalent of GetFullPathNameW, the path doesn't have to exist.
+// Returns the length of the full path, or 0 if it doesn't fit in dest.
+u64 get_full_path_name(char* dest, const u64 dest_size, const char* src, char** file_part)
+{
+	char path[max_path_size];
+	u64 path_size = 0;
+	if (src[0] != '/')
 	{
-		nice_wprintf(L"File \"%ls\" may be corrupted\n", file_path);
+		path_size = get_current_directory(path, sizeof(path));
+		if (!path_size || path_size + 1 >= sizeof(path))
+			return 0;
+		path[path_size++] = '/';
+	}
+	const auto src_size = strlen(src);
+	if (path_size + src_size >= sizeof(path))
 		return 0;
+	memcpy(path + path_size, src, src_size + 1);
+
+	// Rebuild the path one component at a time, resolving "." and ".."
+	u64 size = 0;
+	auto c = path;
+	while (*c)
+	{
+		for (; *c == '/'; c++);
+		const auto component = c;
+		for (; *c && *c != '/'; c++);
+		const auto component_size = (u64)(c - component);
+
+		if (!component_size || (component_size == 1 && component[0] == '.'))
+			continue;
+		if (component_size == 2 && component[0] == '.' && component[1] == '.')
+		{
+			for (; size && dest[size - 1] != '/'; size--);
+			if (size) size--;
+			continue;
+		}
+
+		if (size + 1 + component_size >= dest_size)
+			return 0;
+		dest[size++] = '/';
+		memcpy(dest + size, component, component_size);
+		size += component_size;
 	}
 
-#ifdef DEBUG
-	nice_wprintf(L"File \"%ls\" is dos\n", file_path);
-#endif
+	const auto ends_with_separator = src_size && src[src_size - 1] == '/';
+	if (!size || ends_with_separator)
+	{
+		if (size + 1 >= dest_size)
+			return 0;
+		dest[size++] = '/';
+	}
+	dest[size] = 0;
+
+	if (file_part)
+		*file_part = dest[size - 1] == '/' ? 0 : strrchr(dest, '/') + 1;
 
-	u64 result = file_view.buffer.size;
+	return size;
+}
+
+bool is_directory(const char* path)
+{
+	struct stat file_stat;
+	return stat(path, &file_stat) == 0 && S_ISDIR(file_stat.st_mode);
+}
+
+bool path_exists(const char* path)
+{
+	return access(path, F_OK) == 0;
+}
+
+bool create_directory(const char* path)
+{
+	return mkdir(path, 0777) == 0 || errno == EEXIST;
+}
+
+// Moves from over to, atomically when both are on the same file system
+bool replace_file(const char* from, const char* to)
+{
+	if (rename(from, to) != 0)
+	{
+		nice_wprintf(L"Failed to replace file \"%hs\"!\n", to);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Equivalent of FindFirstFileW/FindNextFileW: the pattern may only have wildcards in its last component
+struct DirectorySearch {
+	DIR* dir;
+	// File name of a search without wildcards, which has no dirent
+	char native_pattern[max_path_size];
+	bool failed;
+
+	// Current entry, points into the dirent or native_pattern
+	const char* file_name;
+	bool is_directory;
+	u64 file_size;
+};
+
+bool directory_search_fill(DirectorySearch& search, const char* file_name, const struct stat& file_stat)
+{
+	search.file_name = file_name;
+	search.is_directory = S_ISDIR(file_stat.st_mode);
+	search.file_size = file_stat.st_size;
+	return 1;
+}
+
+bool directory_search_next(DirectorySearch& search)
+{
+	if (!search.dir) return 0;
 
-	auto out_buffer_end = out_buffer;
-	auto haystack = file_view.buffer.content;
 	while (true)
 	{
-		const auto dos_le = strstr(haystack, "\r\n");
-		if (!dos_le) {
-			break;
+		errno = 0;
+		const auto entry = readdir(search.dir);
+		if (!entry)
+		{
+			search.failed = errno != 0;
+			return 0;
 		}
 
-		const auto size = dos_le - haystack;
-		memcpy(out_buffer_end, haystack, size);
-		out_buffer_end += size;
-		haystack = dos_le + 1;
-		result--;
+		if (fnmatch(search.native_pattern, entry->d_name, 0) != 0)
+			continue;
+
+		struct stat file_stat;
+		if (fstatat(dirfd(search.dir), entry->d_name, &file_stat, 0) != 0)
+			continue;
+
+		if (directory_search_fill(search, entry->d_name, file_stat))
+			return 1;
+	}
+}
+
+bool directory_search_first(DirectorySearch& search, const char* pattern)
+{
+	search = {};
+
+	char native_path[max_path_size];
+	if (strlcpy(native_path, pattern, sizeof(native_path)) >= sizeof(native_path))
+		return 0;
+
+	const auto last_slash = strrchr(native_path, '/');
+	const auto file_name = last_slash ? last_slash + 1 : native_path;
+
+	if (!strpbrk(file_name, "*?["))
+	{
+		struct stat file_stat;
+		if (stat(native_path, &file_stat) != 0)
+			return 0;
+		// native_path goes away with this call
+		strcpy(search.native_pattern, file_name);
+		return directory_search_fill(search, search.native_pattern, file_stat);
+	}
+
+	strcpy(search.native_pattern, file_name);
+	if (last_slash)
+	{
+		*last_slash = 0;
+		search.dir = opendir(native_path[0] ? native_path : "/");
+	}
+	else
+		search.dir = opendir(".");
+
+	if (!search.dir)
+		return 0;
+
+	return directory_search_next(search);
+}
+
+void directory_search_close(DirectorySearch& search)
+{
+	if (search.dir)
+		closedir(search.dir);
+}
+
+// Layout of the records getdents64 fills the buffer with
+struct LinuxDirent64 {
+	u64 d_ino;
+	i64 d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+// Calls proc with every file and directory in path, without "." and "..".
+// Entries are read in batches with getdents64 and told apart by d_type, so
+// only links and file systems that don't fill d_type cost a stat.
+// Directory links are skipped, so walking a tree never loops.
+bool read_directory(const char* path, DirectoryEntryProc proc, void* user)
+{
+	const auto fd = open(path[0] ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		nice_wprintf(L"Failed to read directory \"%hs\"!\n", path);
+		return 0;
+	}
+
+	alignas(LinuxDirent64) char buffer[32 * 1024];
+	while (true)
+	{
+		const auto size = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+		if (size <= 0)
+		{
+			close(fd);
+			if (size < 0)
+				nice_wprintf(L"Failed to read directory \"%hs\"!\n", path);
+			return size == 0;
+		}
+
+		for (long offset = 0; offset < size;)
+		{
+			const auto& dirent = *(const LinuxDirent64*)(buffer + offset);
+			offset += dirent.d_reclen;
+
+			const auto name = dirent.d_name;
+			if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+
+			DirectoryEntry entry = {.name = name, .name_size = strlen(name)};
+			if (dirent.d_type == DT_DIR)
+				entry.is_directory = 1;
+			else if (dirent.d_type == DT_UNKNOWN || dirent.d_type == DT_LNK)
+			{
+				// Links are only followed to files
+				struct stat file_stat;
+				if (fstatat(fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) continue;
+				if (S_ISLNK(file_stat.st_mode) && (fstatat(fd, name, &file_stat, 0) != 0 || S_ISDIR(file_stat.st_mode))) continue;
+				entry.is_directory = S_ISDIR(file_stat.st_mode);
+				if (!entry.is_directory && !S_ISREG(file_stat.st_mode)) continue;
+				entry.size = file_stat.st_size;
+			}
+			else if (dirent.d_type != DT_REG)
+				continue;
+
+			proc(entry, user);
+		}
 	}
+}
 
-	return result - 1;
+bool file_name_matches(const char* pattern, const char* name)
+{
+	return fnmatch(pattern, name, 0) == 0;
+}
 #endif
+
+// Writes a whole output at once, streamed outputs write their chunks with write_slices
+bool write_file_slices(const FileHandle file_handle, const char* file_path, const OutputSlice* slices, const u64 slices_count)
+{
+	if (!write_slices(file_handle, slices, slices_count))
+	{
+		nice_wprintf(L"Failed to write to file \"%hs\"!\n", file_path);
+		return 0;
+	}
+
+	log_verbose(L"Successfuly wrote to file \"%hs\"\n", file_path);
+	return 1;
 }
 
-const Buffer read_file_to_unix_buffer(const wchar_t* file_path)
+// Whether the file already holds exactly the slices, for --restat. A file that
+// can't be compared counts as different, so it's written over.
+bool file_equals_slices(const char* file_path, const u64 size, const OutputSlice* slices, const u64 slices_count)
 {
+	// Most changes change the size too, those are caught without reading the file
+	FileInfo file_info;
+	if (!get_file_info(file_path, file_info) || file_info.size != size)
+		return 0;
+	if (!size)
+		return 1;
+
 	const auto file_view = create_ro_file_view(file_path);
+	if (!file_view.buffer.content)
+		return 0;
+
+	u64 offset = 0;
+	bool equal = 1;
+	for (u64 i = 0; i < slices_count && equal; i++)
+	{
+		equal = memcmp(file_view.buffer.content + offset, slices[i].content, slices[i].size) == 0;
+		offset += slices[i].size;
+	}
+
+	close_file_view(file_view);
+	return equal;
+}
+
+bool create_directories(const char* path)
+{
+	char parent_path[max_path_size];
+	if (strlcpy(parent_path, path, sizeof(parent_path)) >= sizeof(parent_path))
+	{
+		wprintf(L"File path is too large!\n");
+		return 0;
+	}
+
+	// Create every parent first, the first component may be a drive or the root
+	for (auto c = parent_path + 1; *c; c++)
+	{
+		if (*c != '\\' && *c != '/') continue;
+
+		const auto separator = *c;
+		*c = 0;
+		const auto created = create_directory(parent_path);
+		*c = separator;
+		if (!created && c[-1] != ':') return 0;
+	}
+
+	return create_directory(parent_path);
+}
+
+// out_buffer may be the view itself, the content is then normalized in place
+u64 read_file_view_to_unix_buffer(char* out_buffer, const FileView file_view, const char* file_path)
+{
+	const auto content = file_view.buffer.content;
+	const auto size = file_view.buffer.size;
+
+	const auto dos_le = find_dos_line_ending(content, content + size);
+	u64 result;
+	if (!dos_le)
+	{
+#ifdef DEBUG
+		nice_wprintf(L"File \"%hs\" is unix\n", file_path);
+#endif
+		if (out_buffer != content)
+			memcpy(out_buffer, content, size);
+		result = size;
+	}
+	else
+	{
+#ifdef DEBUG
+		nice_wprintf(L"File \"%hs\" is dos\n", file_path);
+#endif
+		// Everything before the first line ending is already unix
+		const auto unix_size = dos_le - content;
+		if (out_buffer != content)
+			memcpy(out_buffer, content, unix_size);
+		result = unix_size + normalize_line_endings(out_buffer + unix_size, dos_le, size - unix_size);
+	}
+
+	// The last line ending isn't part of the buffer
+	if (result && out_buffer[result - 1] == '\n')
+		result--;
+
+	return result;
+}
+
+const UnixBuffer file_view_to_unix_buffer(const FileView& file_view, const char* file_path, FileStats* stats)
+{
 	if (!file_view.buffer.content)
 		return {};
 
-	const auto file_buffer = (char*)VirtualAlloc(0, file_view.buffer.size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	const auto content = file_view.buffer.content;
+	auto size = file_view.buffer.size;
+
+	// Unix files are handed out as the view itself
+	if (!find_dos_line_ending(content, content + size))
+	{
+#ifdef DEBUG
+		nice_wprintf(L"File \"%hs\" is unix\n", file_path);
+#endif
+		close_file(file_view.handle);
+
+		if (content[size - 1] == '\n')
+			size--;
+		return {.buffer = {.content = content, .size = size}, .memory = content, .memory_size = file_view.buffer.size, .is_file_view = 1};
+	}
+
+	if (stats)
+		stats->bytes_normalized += size;
+
+#ifdef _WIN32
+	const auto file_buffer = (char*)memory_alloc(file_view.buffer.size);
 	if (!file_buffer)
 	{
 		wprintf(L"Failed to allocate memory!\n");
+		close_file_view(file_view);
 		return {};
 	}
 
 	const auto file_buffer_size = read_file_view_to_unix_buffer(file_buffer, file_view, file_path);
 
-	CloseHandle(file_view.handle);
-	UnmapViewOfFile(file_view.buffer.content);
+	close_file_view(file_view);
+
+	return {.buffer = {.content = file_buffer, .size = file_buffer_size}, .memory = file_buffer, .memory_size = file_view.buffer.size};
+#else
+	// Normalize straight into the private mapping, only the pages after the first "\r\n" get copied
+	const auto file_buffer_size = read_file_view_to_unix_buffer(content, file_view, file_path);
+
+	// The mapping stays valid once the file is closed
+	close_file(file_view.handle);
 
-	return {.content = file_buffer, .size = file_buffer_size};
+	return {.buffer = {.content = content, .size = file_buffer_size}, .memory = content, .memory_size = file_view.buffer.size, .is_file_view = 1};
+#endif
+}
+
+const UnixBuffer read_file_to_unix_buffer(const char* file_path, FileStats* stats = 0)
+{
+	if (!stats && !t_trace)
+		return file_view_to_unix_buffer(create_ro_file_view(file_path), file_path, 0);
+
+	const auto map_start = get_time_ns();
+	const auto file_view = create_ro_file_view(file_path);
+	const auto normalize_start = get_time_ns();
+	const auto unix_buffer = file_view_to_unix_buffer(file_view, file_path, stats);
+	const auto normalize_end = get_time_ns();
+
+	trace_span("create_ro_file_view", map_start, normalize_start, file_path);
+	trace_span("normalize", normalize_start, normalize_end, file_path);
+	if (stats)
+	{
+		stats->phase_ns[(int)Phase::Normalize] += normalize_end - normalize_start;
+		stats->phase_ns[(int)Phase::Map] += normalize_start - map_start;
+		stats->bytes_mapped += file_view.buffer.size;
+	}
+	return unix_buffer;
+}
+
+// Unix buffer of a file already read into memory, which it takes over and normalizes in place
+const UnixBuffer memory_to_unix_buffer(char* memory, const u64 size, const char* file_path, FileStats* stats = 0)
+{
+	const auto normalize_start = stats || t_trace ? get_time_ns() : 0;
+	if (stats && find_dos_line_ending(memory, memory + size))
+		stats->bytes_normalized += size;
+
+	const FileView file_view = {.handle = invalid_file_handle, .buffer = {.content = memory, .size = size}};
+	const auto buffer_size = read_file_view_to_unix_buffer(memory, file_view, file_path);
+
+	if (stats || t_trace)
+	{
+		const auto normalize_end = get_time_ns();
+		trace_span("normalize", normalize_start, normalize_end, file_path);
+		if (stats)
+		{
+			stats->phase_ns[(int)Phase::Normalize] += normalize_end - normalize_start;
+			stats->bytes_mapped += size;
+		}
+	}
+	return {.buffer = {.content = memory, .size = buffer_size}, .memory = memory, .memory_size = size};
+}
+
+void free_unix_buffer(const UnixBuffer& unix_buffer)
+{
+	if (!unix_buffer.memory) return;
+
+	if (!unix_buffer.is_file_view)
+	{
+		memory_free(unix_buffer.memory);
+		return;
+	}
+
+#ifdef _WIN32
+	UnmapViewOfFile(unix_buffer.memory);
+#else
+	munmap(unix_buffer.memory, unix_buffer.memory_size);
+#endif
 }
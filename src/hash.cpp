@@ -0,0 +1,80 @@
+// 64-bit content hash (XXH64), fast enough to hash every input of a run
+constexpr u64 hash_prime1 = 11400714785074694791ull;
+constexpr u64 hash_prime2 = 14029467366897019727ull;
+constexpr u64 hash_prime3 = 1609587929392839161ull;
+constexpr u64 hash_prime4 = 9650029242287828579ull;
+constexpr u64 hash_prime5 = 2870177450012600261ull;
+
+inline u64 rotate_left(const u64 value, const int bits)
+{
+	return value << bits | value >> (64 - bits);
+}
+
+inline u64 read_u64(const char* data)
+{
+	u64 value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+inline u32 read_u32(const char* data)
+{
+	u32 value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+inline u64 hash_round(u64 accumulator, const u64 input)
+{
+	accumulator += input * hash_prime2;
+	accumulator = rotate_left(accumulator, 31);
+	return accumulator * hash_prime1;
+}
+
+inline u64 hash_merge_round(u64 accumulator, const u64 value)
+{
+	accumulator ^= hash_round(0, value);
+	return accumulator * hash_prime1 + hash_prime4;
+}
+
+u64 hash_bytes(const char* data, const u64 size)
+{
+	const auto end = data + size;
+	auto c = data;
+
+	u64 result;
+	if (size >= 32)
+	{
+		u64 lanes[4] = {hash_prime1 + hash_prime2, hash_prime2, 0, 0 - hash_prime1};
+		for (; end - c >= 32; c += 32)
+		{
+			for (int i = 0; i < 4; i++)
+				lanes[i] = hash_round(lanes[i], read_u64(c + i * 8));
+		}
+
+		result = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+		for (int i = 0; i < 4; i++)
+			result = hash_merge_round(result, lanes[i]);
+	}
+	else
+		result = hash_prime5;
+
+	result += size;
+
+	for (; end - c >= 8; c += 8)
+		result = rotate_left(result ^ hash_round(0, read_u64(c)), 27) * hash_prime1 + hash_prime4;
+	if (end - c >= 4)
+	{
+		result = rotate_left(result ^ read_u32(c) * hash_prime1, 23) * hash_prime2 + hash_prime3;
+		c += 4;
+	}
+	for (; c < end; c++)
+		result = rotate_left(result ^ (u8)*c * hash_prime5, 11) * hash_prime1;
+
+	result ^= result >> 33;
+	result *= hash_prime2;
+	result ^= result >> 29;
+	result *= hash_prime3;
+	result ^= result >> 32;
+	return result;
+}
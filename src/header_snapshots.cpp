@@ -0,0 +1,724 @@
+// Snapshots of the headers the inputs start with, kept in a file across runs
+// for --header-cache. Before anything else is in an input, the state of its
+// translation unit only depends on the headers it included so far, so the
+// expansion of the next one is fully known: its output, the macros it defines
+// and undefines and the files it marks with #pragma once. Each snapshot holds
+// that for one header following a given chain of them, and is only used while
+// every file it was expanded from is unchanged.
+// A snapshot is a blob whose offsets are relative to its start, so the cache
+// file is mapped and its snapshots are spliced in from there as they are.
+
+struct SnapshotFileHeader {
+	u64 magic;
+	// Of the search directories, includes are resolved differently with others
+	u64 options_hash;
+	u64 count;
+};
+
+struct SnapshotFileEntry {
+	u64 offset;
+	u64 size;
+	// Index + 1 of the snapshot of the header included before, 0 for the first one
+	u64 parent;
+};
+
+struct SnapshotBlob {
+	u64 path_offset;
+	u64 path_size;
+	u64 output_offset;
+	u64 output_size;
+	u64 symbols_offset;
+	u64 symbols_count;
+	u64 once_offset;
+	u64 once_count;
+	u64 dependencies_offset;
+	u64 dependencies_count;
+};
+
+// A #define or #undef, in the order the header did them
+struct SnapshotSymbol {
+	u64 name_offset;
+	u64 value_offset;
+	u64 value_size;
+	// The plan of function-like macros is stored as it is
+	u64 ops_offset;
+	u32 name_size;
+	u32 ops_count;
+	u32 parameters_count;
+	bool undefine;
+	bool function_like;
+	bool variadic;
+};
+
+struct SnapshotString {
+	u64 offset;
+	u64 size;
+};
+
+struct SnapshotDependency {
+	SnapshotString path;
+	u64 size;
+	u64 last_write_time;
+	u64 hash;
+};
+
+constexpr u64 header_snapshots_magic = 0x3143484153524150; // "PARSAHC1"
+
+enum class SnapshotState : u8 {
+	Unchecked, Valid, Invalid,
+};
+
+struct HeaderSnapshot {
+	// Of the header included right before, 0 for the first one
+	const HeaderSnapshot* parent;
+	PathId path;
+	const char* blob;
+	u64 blob_size;
+	// Allocated this run, the others are in the mapped file
+	bool owned;
+	SnapshotState state;
+	// Decoded when it's checked, the rest is read from the blob
+	PathId* once_paths;
+	Dependency* dependencies;
+	// Index + 1 in the file being saved, 0 when it's dropped
+	u64 saved_index;
+};
+
+struct HeaderSnapshots {
+	Mutex mutex;
+	// In the order they were added, parents come first
+	HeaderSnapshot** items;
+	u64 count;
+	u64 capacity;
+	// Open addressing by parent and path
+	HeaderSnapshot** slots;
+	u64 slots_capacity;
+	u64 options_hash;
+	// The cache file, or what it was saved from
+	FileHandle file_handle;
+	Buffer file;
+	char* image;
+	// Snapshots were added or found stale, so the file is saved again
+	bool changed;
+	std::atomic<u64> hits;
+	std::atomic<u64> misses;
+};
+
+// What a header that is being snapshotted did to its translation unit
+struct RecordedSymbol {
+	const char* name;
+	u32 name_size;
+	bool undefine;
+	const char* value;
+	u64 value_size;
+	const MacroPlan* plan;
+};
+
+struct SnapshotRecorder {
+	bool active;
+	// Stops the header from being snapshotted, like an include that wasn't found
+	bool failed;
+	PathId path;
+	// Where its output starts
+	u64 out_start;
+	RecordedSymbol* symbols;
+	u32 symbols_count;
+	u32 symbols_capacity;
+	PathId* once_paths;
+	u32 once_count;
+	u32 once_capacity;
+	Dependencies dependencies;
+};
+
+// symbol is 0 for an #undef. Its name and value have to outlive the recording.
+bool snapshot_recorder_push_symbol(SnapshotRecorder& recorder, Arena& arena, const char* name, const u32 name_size, const Symbol* symbol)
+{
+	if (recorder.symbols_count == recorder.symbols_capacity)
+	{
+		const auto new_capacity = recorder.symbols_capacity ? recorder.symbols_capacity * 2 : 64;
+		const auto new_symbols = (RecordedSymbol*)arena_realloc(arena, recorder.symbols, recorder.symbols_count * sizeof(RecordedSymbol), new_capacity * sizeof(RecordedSymbol));
+		if (!new_symbols)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+		recorder.symbols = new_symbols;
+		recorder.symbols_capacity = new_capacity;
+	}
+
+	recorder.symbols[recorder.symbols_count++] = symbol ?
+		RecordedSymbol{.name = name, .name_size = name_size, .value = symbol->value, .value_size = symbol->value_size, .plan = symbol->plan} :
+		RecordedSymbol{.name = name, .name_size = name_size, .undefine = 1};
+	return 1;
+}
+
+bool snapshot_recorder_push_once(SnapshotRecorder& recorder, Arena& arena, const PathId path)
+{
+	if (recorder.once_count == recorder.once_capacity)
+	{
+		const auto new_capacity = recorder.once_capacity ? recorder.once_capacity * 2 : 32;
+		const auto new_paths = (PathId*)arena_realloc(arena, recorder.once_paths, recorder.once_count * sizeof(PathId), new_capacity * sizeof(PathId));
+		if (!new_paths)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+		recorder.once_paths = new_paths;
+		recorder.once_capacity = new_capacity;
+	}
+
+	recorder.once_paths[recorder.once_count++] = path;
+	return 1;
+}
+
+// The recording of the next header reuses the memory of the last one
+void snapshot_recorder_start(SnapshotRecorder& recorder, Arena& arena, const PathId path, const u64 out_start)
+{
+	recorder.active = 1;
+	recorder.failed = 0;
+	recorder.path = path;
+	recorder.out_start = out_start;
+	recorder.symbols_count = 0;
+	recorder.once_count = 0;
+	recorder.dependencies.count = 0;
+	recorder.dependencies.arena = &arena;
+}
+
+const SnapshotBlob& get_snapshot_blob(const HeaderSnapshot& snapshot)
+{
+	return *(const SnapshotBlob*)snapshot.blob;
+}
+
+const SnapshotSymbol* get_snapshot_symbols(const HeaderSnapshot& snapshot)
+{
+	return (const SnapshotSymbol*)(snapshot.blob + get_snapshot_blob(snapshot).symbols_offset);
+}
+
+u64 hash_snapshot_key(const HeaderSnapshot* parent, const PathId path)
+{
+	return get_path_hash(path) ^ (u64)parent * 11400714819323198485ull;
+}
+
+HeaderSnapshot** header_snapshots_find_slot(HeaderSnapshot** slots, const u64 capacity, const HeaderSnapshot* parent, const PathId path)
+{
+	auto index = hash_snapshot_key(parent, path) & (capacity - 1);
+	while (true)
+	{
+		const auto slot = &slots[index];
+		if (!*slot || ((*slot)->parent == parent && (*slot)->path == path))
+			return slot;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+void header_snapshot_free(HeaderSnapshot* snapshot)
+{
+	if (snapshot->owned)
+		memory_free((void*)snapshot->blob);
+	memory_free(snapshot->once_paths);
+	memory_free(snapshot->dependencies);
+	memory_free(snapshot);
+}
+
+// Replaces the snapshot with the same parent and path, if there is one
+bool header_snapshots_insert(HeaderSnapshots& snapshots, HeaderSnapshot* snapshot)
+{
+	if (snapshots.count == snapshots.capacity)
+	{
+		const auto new_capacity = snapshots.capacity ? snapshots.capacity * 2 : 256;
+		const auto new_items = (HeaderSnapshot**)memory_alloc(new_capacity * sizeof(HeaderSnapshot*));
+		const auto new_slots = (HeaderSnapshot**)memory_alloc(new_capacity * 2 * sizeof(HeaderSnapshot*));
+		if (!new_items || !new_slots)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			memory_free(new_items);
+			memory_free(new_slots);
+			return 0;
+		}
+		memset(new_slots, 0, new_capacity * 2 * sizeof(HeaderSnapshot*));
+
+		if (snapshots.items)
+			memcpy(new_items, snapshots.items, snapshots.count * sizeof(HeaderSnapshot*));
+		for (u64 i = 0; i < snapshots.slots_capacity; i++)
+		{
+			const auto item = snapshots.slots[i];
+			if (item)
+				*header_snapshots_find_slot(new_slots, new_capacity * 2, item->parent, item->path) = item;
+		}
+
+		memory_free(snapshots.items);
+		memory_free(snapshots.slots);
+		snapshots.items = new_items;
+		snapshots.capacity = new_capacity;
+		snapshots.slots = new_slots;
+		snapshots.slots_capacity = new_capacity * 2;
+	}
+
+	snapshots.items[snapshots.count++] = snapshot;
+	*header_snapshots_find_slot(snapshots.slots, snapshots.slots_capacity, snapshot->parent, snapshot->path) = snapshot;
+	return 1;
+}
+
+bool is_snapshot_range_valid(const HeaderSnapshot& snapshot, const u64 offset, const u64 count, const u64 item_size)
+{
+	return offset <= snapshot.blob_size && count <= (snapshot.blob_size - offset) / item_size;
+}
+
+PathId intern_snapshot_path(const HeaderSnapshot& snapshot, const SnapshotString& string)
+{
+	if (!string.size || !is_snapshot_range_valid(snapshot, string.offset, string.size, 1))
+		return invalid_path_id;
+	return path_pool_intern(g_paths, snapshot.blob + string.offset, string.size);
+}
+
+// Checks that the blob doesn't point out of itself and decodes its paths
+bool decode_header_snapshot(HeaderSnapshot& snapshot)
+{
+	if (snapshot.once_paths || snapshot.dependencies)
+		return 1;
+	if (snapshot.blob_size < sizeof(SnapshotBlob))
+		return 0;
+
+	const auto& blob = get_snapshot_blob(snapshot);
+	if (!is_snapshot_range_valid(snapshot, blob.output_offset, blob.output_size, 1) ||
+		!is_snapshot_range_valid(snapshot, blob.symbols_offset, blob.symbols_count, sizeof(SnapshotSymbol)) ||
+		!is_snapshot_range_valid(snapshot, blob.once_offset, blob.once_count, sizeof(SnapshotString)) ||
+		!is_snapshot_range_valid(snapshot, blob.dependencies_offset, blob.dependencies_count, sizeof(SnapshotDependency)) ||
+		(blob.symbols_offset | blob.once_offset | blob.dependencies_offset) % 8)
+		return 0;
+
+	const auto symbols = get_snapshot_symbols(snapshot);
+	for (u64 i = 0; i < blob.symbols_count; i++)
+	{
+		const auto& symbol = symbols[i];
+		if (!symbol.name_size || !is_snapshot_range_valid(snapshot, symbol.name_offset, symbol.name_size, 1) ||
+			!is_snapshot_range_valid(snapshot, symbol.value_offset, symbol.value_size, 1) ||
+			(symbol.function_like && (symbol.ops_offset % 8 || !is_snapshot_range_valid(snapshot, symbol.ops_offset, symbol.ops_count, sizeof(MacroOp)))))
+			return 0;
+	}
+
+	// Never empty, so decoding isn't done twice
+	snapshot.once_paths = (PathId*)memory_alloc((blob.once_count + 1) * sizeof(PathId));
+	snapshot.dependencies = (Dependency*)memory_alloc((blob.dependencies_count + 1) * sizeof(Dependency));
+	if (!snapshot.once_paths || !snapshot.dependencies)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	const auto once = (const SnapshotString*)(snapshot.blob + blob.once_offset);
+	for (u64 i = 0; i < blob.once_count; i++)
+	{
+		if (!(snapshot.once_paths[i] = intern_snapshot_path(snapshot, once[i])))
+			return 0;
+	}
+
+	const auto dependencies = (const SnapshotDependency*)(snapshot.blob + blob.dependencies_offset);
+	for (u64 i = 0; i < blob.dependencies_count; i++)
+	{
+		const auto& dependency = dependencies[i];
+		snapshot.dependencies[i] = {
+			.path = intern_snapshot_path(snapshot, dependency.path),
+			.size = dependency.size,
+			.last_write_time = dependency.last_write_time,
+			.hash = dependency.hash,
+		};
+		if (!snapshot.dependencies[i].path)
+			return 0;
+	}
+	return 1;
+}
+
+// Only called with the lock held, once per run
+SnapshotState check_header_snapshot(HeaderSnapshots& snapshots, HeaderSnapshot& snapshot)
+{
+	if (!decode_header_snapshot(snapshot))
+	{
+		snapshots.changed = 1;
+		return SnapshotState::Invalid;
+	}
+
+	const auto& blob = get_snapshot_blob(snapshot);
+	for (u64 i = 0; i < blob.dependencies_count; i++)
+	{
+		auto dependency = snapshot.dependencies[i];
+		if (!is_dependency_unchanged(dependency))
+		{
+			snapshots.changed = 1;
+			return SnapshotState::Invalid;
+		}
+		// Touched but the same, so it isn't hashed again
+		if (dependency.last_write_time != snapshot.dependencies[i].last_write_time)
+			snapshots.changed = 1;
+		snapshot.dependencies[i].last_write_time = dependency.last_write_time;
+	}
+	return SnapshotState::Valid;
+}
+
+// Returns the snapshot of the header at path included right after the one of
+// parent, or 0 when there is none or the files it was expanded from changed.
+// Safe to call from multiple threads.
+const HeaderSnapshot* header_snapshots_find(HeaderSnapshots& snapshots, const HeaderSnapshot* parent, const PathId path)
+{
+	mutex_lock_shared(snapshots.mutex);
+	auto snapshot = snapshots.slots_capacity ? *header_snapshots_find_slot(snapshots.slots, snapshots.slots_capacity, parent, path) : 0;
+	auto state = snapshot ? snapshot->state : SnapshotState::Invalid;
+	mutex_unlock_shared(snapshots.mutex);
+
+	if (state == SnapshotState::Unchecked)
+	{
+		mutex_lock(snapshots.mutex);
+		if (snapshot->state == SnapshotState::Unchecked)
+			snapshot->state = check_header_snapshot(snapshots, *snapshot);
+		state = snapshot->state;
+		mutex_unlock(snapshots.mutex);
+	}
+
+	if (state != SnapshotState::Valid)
+	{
+		snapshots.misses++;
+		return 0;
+	}
+	snapshots.hits++;
+	return snapshot;
+}
+
+struct SnapshotWriter {
+	char* memory;
+	u64 size;
+};
+
+// Returns where data went, memory is only written once it's there
+u64 snapshot_write(SnapshotWriter& writer, const void* data, const u64 size)
+{
+	const auto offset = writer.size;
+	if (writer.memory && size)
+		memcpy(writer.memory + offset, data, size);
+	writer.size += size;
+	return offset;
+}
+
+void snapshot_align(SnapshotWriter& writer)
+{
+	const u64 zero = 0;
+	snapshot_write(writer, &zero, (8 - writer.size % 8) % 8);
+}
+
+SnapshotString snapshot_write_path(SnapshotWriter& writer, const PathId path)
+{
+	const auto& entry = path_pool_entry(g_paths, path);
+	return {.offset = snapshot_write(writer, entry.path, entry.size), .size = entry.size};
+}
+
+void snapshot_write_recording(SnapshotWriter& writer, const SnapshotRecorder& recorder, const OutputSlice* output, const u64 output_count, const u64 output_skip)
+{
+	SnapshotBlob blob = {};
+	snapshot_write(writer, &blob, sizeof(blob));
+
+	// Fixed size records first, so they are aligned
+	blob.symbols_offset = writer.size;
+	blob.symbols_count = recorder.symbols_count;
+	writer.size += recorder.symbols_count * sizeof(SnapshotSymbol);
+	blob.once_offset = writer.size;
+	blob.once_count = recorder.once_count;
+	writer.size += recorder.once_count * sizeof(SnapshotString);
+	blob.dependencies_offset = writer.size;
+	blob.dependencies_count = recorder.dependencies.count;
+	writer.size += recorder.dependencies.count * sizeof(SnapshotDependency);
+
+	for (u32 i = 0; i < recorder.symbols_count; i++)
+	{
+		const auto& recorded = recorder.symbols[i];
+		SnapshotSymbol symbol = {.name_size = recorded.name_size, .undefine = recorded.undefine};
+		if (recorded.plan)
+		{
+			symbol.function_like = 1;
+			symbol.ops_count = recorded.plan->ops_count;
+			symbol.parameters_count = recorded.plan->parameters_count;
+			symbol.variadic = recorded.plan->variadic;
+			symbol.ops_offset = snapshot_write(writer, recorded.plan->ops, recorded.plan->ops_count * sizeof(MacroOp));
+		}
+		symbol.name_offset = snapshot_write(writer, recorded.name, recorded.name_size);
+		symbol.value_offset = snapshot_write(writer, recorded.value, recorded.value_size);
+		symbol.value_size = recorded.value_size;
+		snapshot_align(writer);
+		if (writer.memory)
+			memcpy(writer.memory + blob.symbols_offset + i * sizeof(SnapshotSymbol), &symbol, sizeof(symbol));
+	}
+
+	for (u32 i = 0; i < recorder.once_count; i++)
+	{
+		const auto once = snapshot_write_path(writer, recorder.once_paths[i]);
+		if (writer.memory)
+			memcpy(writer.memory + blob.once_offset + i * sizeof(SnapshotString), &once, sizeof(once));
+	}
+
+	for (u32 i = 0; i < recorder.dependencies.count; i++)
+	{
+		const auto& recorded = recorder.dependencies.items[i];
+		const SnapshotDependency dependency = {
+			.path = snapshot_write_path(writer, recorded.path),
+			.size = recorded.size,
+			.last_write_time = recorded.last_write_time,
+			.hash = recorded.hash,
+		};
+		if (writer.memory)
+			memcpy(writer.memory + blob.dependencies_offset + i * sizeof(SnapshotDependency), &dependency, sizeof(dependency));
+	}
+
+	const auto path = snapshot_write_path(writer, recorder.path);
+	blob.path_offset = path.offset;
+	blob.path_size = path.size;
+
+	blob.output_offset = writer.size;
+	for (u64 i = 0; i < output_count; i++)
+	{
+		const auto skip = i ? 0 : output_skip;
+		snapshot_write(writer, output[i].content + skip, output[i].size - skip);
+	}
+	blob.output_size = writer.size - blob.output_offset;
+
+	if (writer.memory)
+		memcpy(writer.memory, &blob, sizeof(blob));
+}
+
+// Adds the snapshot of what recorder saw, whose output is what out got past
+// recorder.out_start. Returns the snapshot of the same header another thread
+// added first, 0 when it can't be added. Safe to call from multiple threads.
+const HeaderSnapshot* header_snapshots_add(HeaderSnapshots& snapshots, const HeaderSnapshot* parent, const SnapshotRecorder& recorder, const OutputRope& out)
+{
+	auto first = out.count;
+	auto skip = out.size;
+	while (first && skip > recorder.out_start)
+		skip -= out.slices[--first].size;
+	skip = recorder.out_start - skip;
+
+	SnapshotWriter writer = {};
+	snapshot_write_recording(writer, recorder, out.slices + first, out.count - first, skip);
+	const auto blob_size = writer.size;
+	writer = {.memory = (char*)memory_alloc(blob_size)};
+	const auto snapshot = (HeaderSnapshot*)memory_alloc(sizeof(HeaderSnapshot));
+	if (!writer.memory || !snapshot)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		memory_free(writer.memory);
+		memory_free(snapshot);
+		return 0;
+	}
+	snapshot_write_recording(writer, recorder, out.slices + first, out.count - first, skip);
+
+	*snapshot = {.parent = parent, .path = recorder.path, .blob = writer.memory, .blob_size = blob_size, .owned = 1};
+	if (!decode_header_snapshot(*snapshot))
+	{
+		header_snapshot_free(snapshot);
+		return 0;
+	}
+	snapshot->state = SnapshotState::Valid;
+
+	mutex_lock(snapshots.mutex);
+	const auto existing = snapshots.slots_capacity ? *header_snapshots_find_slot(snapshots.slots, snapshots.slots_capacity, parent, recorder.path) : 0;
+	if (existing && existing->state == SnapshotState::Valid)
+	{
+		mutex_unlock(snapshots.mutex);
+		header_snapshot_free(snapshot);
+		return existing;
+	}
+
+	const auto inserted = header_snapshots_insert(snapshots, snapshot);
+	snapshots.changed |= inserted;
+	mutex_unlock(snapshots.mutex);
+	if (!inserted)
+	{
+		header_snapshot_free(snapshot);
+		return 0;
+	}
+	return snapshot;
+}
+
+// A missing, stale or unreadable cache leaves it empty, so every header is expanded again
+bool header_snapshots_load(HeaderSnapshots& snapshots, const char* cache_path, const u64 options_hash)
+{
+	snapshots.options_hash = options_hash;
+	snapshots.file_handle = invalid_file_handle;
+
+	FileInfo file_info;
+	if (!get_file_info(cache_path, file_info) || !file_info.size)
+		return 1;
+
+	const auto file_view = create_ro_file_view(cache_path);
+	if (!file_view.buffer.content)
+		return 1;
+	snapshots.file_handle = file_view.handle;
+	snapshots.file = file_view.buffer;
+
+	const auto file = snapshots.file.content;
+	const auto file_size = snapshots.file.size;
+	const auto header = (const SnapshotFileHeader*)file;
+	if (file_size < sizeof(SnapshotFileHeader) || header->magic != header_snapshots_magic || header->options_hash != options_hash ||
+		header->count > (file_size - sizeof(SnapshotFileHeader)) / sizeof(SnapshotFileEntry))
+	{
+		log_info(L"Header cache \"%hs\" is stale, expanding every header again\n", cache_path);
+		snapshots.changed = 1;
+		return 1;
+	}
+
+	const auto entries = (const SnapshotFileEntry*)(header + 1);
+	for (u64 i = 0; i < header->count; i++)
+	{
+		const auto& entry = entries[i];
+		if (entry.parent > i || entry.offset % 8 || entry.offset > file_size || entry.size > file_size - entry.offset || entry.size < sizeof(SnapshotBlob))
+			break;
+
+		const auto snapshot = (HeaderSnapshot*)memory_alloc(sizeof(HeaderSnapshot));
+		if (!snapshot)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+		*snapshot = {
+			.parent = entry.parent ? snapshots.items[entry.parent - 1] : 0,
+			.blob = file + entry.offset,
+			.blob_size = entry.size,
+		};
+
+		const auto& blob = get_snapshot_blob(*snapshot);
+		snapshot->path = intern_snapshot_path(*snapshot, {.offset = blob.path_offset, .size = blob.path_size});
+		if (!snapshot->path || !header_snapshots_insert(snapshots, snapshot))
+		{
+			header_snapshot_free(snapshot);
+			break;
+		}
+	}
+
+	if (snapshots.count != header->count)
+	{
+		nice_wprintf(L"Header cache \"%hs\" is invalid, expanding every header again\n", cache_path);
+		snapshots.changed = 1;
+	}
+	return 1;
+}
+
+// Dependencies may have changed since the snapshots were checked, like between two runs of --watch
+void header_snapshots_uncheck(HeaderSnapshots& snapshots)
+{
+	for (u64 i = 0; i < snapshots.count; i++)
+	{
+		if (snapshots.items[i]->state == SnapshotState::Valid)
+			snapshots.items[i]->state = SnapshotState::Unchecked;
+	}
+}
+
+void header_snapshots_close_file(HeaderSnapshots& snapshots)
+{
+	if (snapshots.file_handle != invalid_file_handle)
+		close_file_view({.handle = snapshots.file_handle, .buffer = snapshots.file});
+	snapshots.file_handle = invalid_file_handle;
+	snapshots.file = {};
+}
+
+// Only when no one reads from it, like between two runs of the jobs. Stale
+// snapshots are dropped, along with the ones that followed them. The blobs of
+// the others are moved into the image of the file, so the file isn't mapped
+// while it's replaced.
+bool header_snapshots_save(HeaderSnapshots& snapshots, const char* cache_path)
+{
+	if (!snapshots.changed)
+		return 1;
+
+	u64 kept_count = 0;
+	u64 image_size = sizeof(SnapshotFileHeader);
+	for (u64 i = 0; i < snapshots.count; i++)
+	{
+		const auto snapshot = snapshots.items[i];
+		const auto replaced = *header_snapshots_find_slot(snapshots.slots, snapshots.slots_capacity, snapshot->parent, snapshot->path) != snapshot;
+		snapshot->saved_index = 0;
+		// Parents come first, so theirs is known already
+		if (snapshot->state == SnapshotState::Invalid || replaced || (snapshot->parent && !snapshot->parent->saved_index))
+			continue;
+
+		snapshot->saved_index = ++kept_count;
+		image_size += sizeof(SnapshotFileEntry) + (snapshot->blob_size + 7) / 8 * 8;
+	}
+
+	const auto image = (char*)memory_alloc(image_size);
+	if (!image)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	const SnapshotFileHeader header = {.magic = header_snapshots_magic, .options_hash = snapshots.options_hash, .count = kept_count};
+	memcpy(image, &header, sizeof(header));
+	const auto entries = (SnapshotFileEntry*)(image + sizeof(header));
+	auto offset = sizeof(header) + kept_count * sizeof(SnapshotFileEntry);
+	for (u64 i = 0; i < snapshots.count; i++)
+	{
+		const auto snapshot = snapshots.items[i];
+		if (!snapshot->saved_index) continue;
+
+		entries[snapshot->saved_index - 1] = {.offset = offset, .size = snapshot->blob_size, .parent = snapshot->parent ? snapshot->parent->saved_index : 0};
+		memcpy(image + offset, snapshot->blob, snapshot->blob_size);
+		memset(image + offset + snapshot->blob_size, 0, (8 - snapshot->blob_size % 8) % 8);
+		offset += (snapshot->blob_size + 7) / 8 * 8;
+	}
+
+	// Every snapshot that isn't kept goes, the others now live in the image
+	u64 count = 0;
+	memset(snapshots.slots, 0, snapshots.slots_capacity * sizeof(HeaderSnapshot*));
+	for (u64 i = 0; i < snapshots.count; i++)
+	{
+		const auto snapshot = snapshots.items[i];
+		if (!snapshot->saved_index)
+		{
+			header_snapshot_free(snapshot);
+			continue;
+		}
+
+		if (snapshot->owned)
+			memory_free((void*)snapshot->blob);
+		snapshot->blob = image + entries[snapshot->saved_index - 1].offset;
+		snapshot->owned = 0;
+		snapshots.items[count++] = snapshot;
+		*header_snapshots_find_slot(snapshots.slots, snapshots.slots_capacity, snapshot->parent, snapshot->path) = snapshot;
+	}
+	snapshots.count = count;
+	header_snapshots_close_file(snapshots);
+	memory_free(snapshots.image);
+	snapshots.image = image;
+	snapshots.changed = 0;
+
+	// Written next to it first, so an interrupted run never leaves a broken cache behind
+	char temp_path[max_path_size];
+	if (strlcpy(temp_path, cache_path, sizeof(temp_path)) >= sizeof(temp_path) ||
+		strlcat(temp_path, ".tmp", sizeof(temp_path)) >= sizeof(temp_path))
+	{
+		wprintf(L"File path is too large!\n");
+		return 0;
+	}
+
+	const auto file_handle = create_wo_file(temp_path);
+	if (file_handle == invalid_file_handle)
+		return 0;
+
+	const OutputSlice slice = {.content = image, .size = image_size};
+	const auto written = write_file_slices(file_handle, temp_path, &slice, 1);
+	close_file(file_handle);
+
+	return written && replace_file(temp_path, cache_path);
+}
+
+void header_snapshots_free(HeaderSnapshots& snapshots)
+{
+	for (u64 i = 0; i < snapshots.count; i++)
+		header_snapshot_free(snapshots.items[i]);
+	memory_free(snapshots.items);
+	memory_free(snapshots.slots);
+	header_snapshots_close_file(snapshots);
+	memory_free(snapshots.image);
+	snapshots.items = 0;
+	snapshots.slots = 0;
+	snapshots.image = 0;
+	snapshots.count = 0;
+	snapshots.capacity = 0;
+	snapshots.slots_capacity = 0;
+}
@@ -0,0 +1,268 @@
+// Holds the unix buffer and directive index of every included file once per run,
+// so a header that is included by many files is only read and scanned the first time.
+struct CachedFile {
+	UnixBuffer unix_buffer;
+	DirectiveIndex directive_index;
+	IncludeGuard guard;
+	// Of the unix buffer, only with hash_contents
+	u64 hash;
+};
+
+struct IncludeCacheEntry {
+	PathId path;
+	u64 file_size;
+	u64 last_write_time;
+	CachedFile file;
+};
+
+struct IncludeCache {
+	Mutex mutex;
+	IncludeCacheEntry* entries;
+	u64 capacity;
+	u64 count;
+	// Buffers of files that changed during the run, freed with the cache
+	CachedFile* retired;
+	u64 retired_count;
+	u64 retired_capacity;
+	std::atomic<u64> hits;
+	std::atomic<u64> misses;
+	// Set for --incremental, which records the hash of every input
+	bool hash_contents;
+};
+
+IncludeCacheEntry* include_cache_find_slot(IncludeCacheEntry* entries, const u64 capacity, const PathId path)
+{
+	auto index = get_path_hash(path) & (capacity - 1);
+	while (true)
+	{
+		auto& entry = entries[index];
+		if (!entry.path || entry.path == path)
+			return &entry;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+bool include_cache_grow(IncludeCache& cache)
+{
+	const auto new_capacity = cache.capacity ? cache.capacity * 2 : 256;
+	const auto new_entries = (IncludeCacheEntry*)memory_alloc(new_capacity * sizeof(IncludeCacheEntry));
+	if (!new_entries)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	for (u64 i = 0; i < cache.capacity; i++)
+	{
+		const auto& entry = cache.entries[i];
+		if (!entry.path) continue;
+		*include_cache_find_slot(new_entries, new_capacity, entry.path) = entry;
+	}
+
+	if (cache.entries)
+		memory_free(cache.entries);
+
+	cache.entries = new_entries;
+	cache.capacity = new_capacity;
+	return 1;
+}
+
+void cached_file_free(CachedFile& file)
+{
+	free_unix_buffer(file.unix_buffer);
+	directive_index_free(file.directive_index);
+	file = {};
+}
+
+const SourceFile get_source_file(const CachedFile& file)
+{
+	return {
+		.buffer = file.unix_buffer.buffer,
+		.directives = file.directive_index.directives,
+		.directives_count = file.directive_index.count,
+		.guard = file.guard,
+	};
+}
+
+void include_cache_retire(IncludeCache& cache, const CachedFile& file)
+{
+	if (!file.unix_buffer.memory) return;
+
+	if (cache.retired_count == cache.retired_capacity)
+	{
+		const auto new_capacity = cache.retired_capacity ? cache.retired_capacity * 2 : 64;
+		const auto new_retired = (CachedFile*)memory_alloc(new_capacity * sizeof(CachedFile));
+		if (!new_retired)
+		{
+			// Leaking it is better than freeing it under a reader
+			wprintf(L"Failed to allocate memory!\n");
+			return;
+		}
+
+		if (cache.retired)
+		{
+			memcpy(new_retired, cache.retired, cache.retired_count * sizeof(CachedFile));
+			memory_free(cache.retired);
+		}
+		cache.retired = new_retired;
+		cache.retired_capacity = new_capacity;
+	}
+
+	cache.retired[cache.retired_count++] = file;
+}
+
+// Scans unix_buffer, which it takes over, and caches it as the file at the full
+// path path_id, unless another thread did so first. file_info has to be from
+// before the file was read. Safe to call from multiple threads.
+const SourceFile include_cache_add(IncludeCache& cache, const PathId path_id, const FileInfo& file_info, const UnixBuffer& unix_buffer, u64* hash, FileStats* stats)
+{
+	const auto path = get_path(path_id);
+	const auto file_size = file_info.size;
+	const auto last_write_time = file_info.last_write_time;
+
+	CachedFile file = {.unix_buffer = unix_buffer};
+	if (file.unix_buffer.buffer.content)
+	{
+		const auto scan_start = stats || t_trace ? get_time_ns() : 0;
+		if (build_directive_index(file.directive_index, file.unix_buffer.buffer))
+			file.guard = find_include_guard(file.unix_buffer.buffer, file.directive_index);
+		else
+			cached_file_free(file);
+		if (stats || t_trace)
+		{
+			const auto scan_end = get_time_ns();
+			trace_span("scan", scan_start, scan_end, path);
+			if (stats)
+				stats->phase_ns[(int)Phase::Scan] += scan_end - scan_start;
+		}
+	}
+	if (cache.hash_contents)
+		file.hash = hash_bytes(file.unix_buffer.buffer.content, file.unix_buffer.buffer.size);
+	auto source_file = get_source_file(file);
+	auto file_hash = file.hash;
+
+	mutex_lock(cache.mutex);
+	cache.misses++;
+	if (stats)
+		stats->cache_misses++;
+
+	if ((cache.count + 1) * 2 > cache.capacity && !include_cache_grow(cache))
+	{
+		mutex_unlock(cache.mutex);
+		cached_file_free(file);
+		return {};
+	}
+
+	auto& entry = *include_cache_find_slot(cache.entries, cache.capacity, path_id);
+	if (entry.path)
+	{
+		if (entry.file_size == file_size && entry.last_write_time == last_write_time)
+		{
+			// Another thread read it in the meantime
+			cached_file_free(file);
+			source_file = get_source_file(entry.file);
+			file_hash = entry.file.hash;
+		}
+		else
+		{
+			// File changed during the run, other threads may still be reading the old buffer
+			include_cache_retire(cache, entry.file);
+			entry.file_size = file_size;
+			entry.last_write_time = last_write_time;
+			entry.file = file;
+		}
+	}
+	else
+	{
+		entry.path = path_id;
+		entry.file_size = file_size;
+		entry.last_write_time = last_write_time;
+		entry.file = file;
+		cache.count++;
+	}
+
+	mutex_unlock(cache.mutex);
+
+	if (hash)
+		*hash = file_hash;
+	return source_file;
+}
+
+// Returns a read-only view of the unix buffer and directives of the file at the
+// full path path_id, which stays valid until include_cache_free.
+// The file is described in dependency when it isn't 0. Safe to call from multiple threads.
+const SourceFile include_cache_get(IncludeCache& cache, const PathId path_id, Dependency* dependency, FileStats* stats)
+{
+	const auto path = get_path(path_id);
+
+	FileInfo file_info;
+	if (!get_file_info(path, file_info))
+	{
+		// Let open_ro_file report why the file can't be opened
+		const auto file_handle = open_ro_file(path);
+		if (file_handle != invalid_file_handle)
+			close_file(file_handle);
+		return {};
+	}
+
+	if (dependency)
+	{
+		dependency->path = path_id;
+		dependency->size = file_info.size;
+		dependency->last_write_time = file_info.last_write_time;
+	}
+
+	mutex_lock_shared(cache.mutex);
+	if (cache.capacity)
+	{
+		const auto& entry = *include_cache_find_slot(cache.entries, cache.capacity, path_id);
+		if (entry.path && entry.file_size == file_info.size && entry.last_write_time == file_info.last_write_time)
+		{
+			const auto source_file = get_source_file(entry.file);
+			if (dependency)
+				dependency->hash = entry.file.hash;
+			mutex_unlock_shared(cache.mutex);
+			cache.hits++;
+			if (stats)
+				stats->cache_hits++;
+			return source_file;
+		}
+	}
+	mutex_unlock_shared(cache.mutex);
+
+	// Read outside of the lock so misses on different files don't wait on each other
+	return include_cache_add(cache, path_id, file_info, read_file_to_unix_buffer(path, stats), dependency ? &dependency->hash : 0, stats);
+}
+
+// Only when no one reads from the cache, like between two runs of the jobs
+void include_cache_release_retired(IncludeCache& cache)
+{
+	for (u64 i = 0; i < cache.retired_count; i++)
+		cached_file_free(cache.retired[i]);
+	cache.retired_count = 0;
+}
+
+void include_cache_free(IncludeCache& cache)
+{
+	for (u64 i = 0; i < cache.capacity; i++)
+	{
+		auto& entry = cache.entries[i];
+		if (entry.path)
+			cached_file_free(entry.file);
+	}
+
+	for (u64 i = 0; i < cache.retired_count; i++)
+		cached_file_free(cache.retired[i]);
+
+	if (cache.entries)
+		memory_free(cache.entries);
+	if (cache.retired)
+		memory_free(cache.retired);
+
+	cache.entries = 0;
+	cache.capacity = 0;
+	cache.count = 0;
+	cache.retired = 0;
+	cache.retired_count = 0;
+	cache.retired_capacity = 0;
+}
@@ -0,0 +1,675 @@
+struct IncludeStatement {
+	// Points into the directive, it isn't NUL terminated
+	const char* file_path;
+	u64 file_path_size;
+	// <file> instead of "file", only looked up in the search directories
+	bool angled;
+	SourceFile file;
+};
+
+// Parses the "file" or <file> argument of an #include directive
+bool process_include(IncludeStatement& include, const char* arguments, const char* line_end)
+{
+	auto statement_arg_start = arguments;
+	if (statement_arg_start == line_end || (*statement_arg_start != '"' && *statement_arg_start != '<'))
+	{
+		wprintf(L"Can't find opening \" of #include statement\n");
+		return 0;
+	}
+
+	include.angled = *statement_arg_start == '<';
+	const auto closing = include.angled ? '>' : '"';
+	auto statement_arg_end = statement_arg_start + 1;
+	for (; statement_arg_end < line_end && *statement_arg_end != closing; statement_arg_end++);
+	if (statement_arg_end == line_end)
+	{
+		if (include.angled)
+			wprintf(L"Can't find closing > of #include statement\n");
+		else
+			wprintf(L"Can't find closing \" of #include statement\n");
+		return 0;
+	}
+
+	const auto include_file_path_size = statement_arg_end - statement_arg_start - 1;
+	if (!include_file_path_size || include_file_path_size > std::numeric_limits<int>::max()) {
+		wprintf(L"Invalid file path of #include statement\n");
+		return 0;
+	}
+
+	include.file_path = statement_arg_start + 1;
+	include.file_path_size = include_file_path_size;
+	return 1;
+}
+
+// Returns the end of the comment at c, or c when there's none
+const char* skip_define_comment(const char* c, const char* line_end)
+{
+	if (*c != '/' || c + 1 == line_end) return c;
+	if (c[1] == '/') return line_end;
+	if (c[1] != '*') return c;
+
+	for (c += 2; c + 1 < line_end && !(c[0] == '*' && c[1] == '/'); c++);
+	return c + 1 < line_end ? c + 2 : line_end;
+}
+
+// Value of a #define without surrounding blanks. Continuation lines are spliced
+// and comments inside of it become a space, like cpp does.
+bool get_define_value(Buffer& value, Arena& arena, const char* value_start, const char* line_end)
+{
+	auto value_end = value_start;
+	bool after_comment = 0;
+	bool needs_copy = 0;
+	for (auto c = value_start; c < line_end; c++)
+	{
+		if (*c == '"' || *c == '\'')
+		{
+			const auto quote = *c;
+			for (c++; c < line_end && *c != quote; c++)
+			{
+				if (*c == '\\' && c + 1 < line_end)
+					c++;
+			}
+		}
+		else if (skip_define_comment(c, line_end) != c)
+		{
+			c = skip_define_comment(c, line_end) - 1;
+			after_comment = 1;
+			continue;
+		}
+		else if (*c == '\\' && c + 1 < line_end && c[1] == '\n')
+			needs_copy = 1;
+
+		// Comments after the value are left out without copying it
+		if (after_comment && !is_blank(*c))
+			needs_copy = 1;
+		value_end = c < line_end ? c + 1 : line_end;
+	}
+	for (; value_end > value_start && (is_blank(value_end[-1]) || value_end[-1] == '\n' || value_end[-1] == '\\'); value_end--);
+
+	if (!needs_copy)
+	{
+		value = {.content = (char*)value_start, .size = (u64)(value_end - value_start)};
+		return 1;
+	}
+
+	value.content = (char*)arena_alloc(arena, value_end - value_start);
+	if (!value.content)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	value.size = 0;
+	char quote = 0;
+	for (auto c = value_start; c < value_end; c++)
+	{
+		if (*c == '\\' && c + 1 < value_end && c[1] == '\n')
+		{
+			c++;
+			continue;
+		}
+
+		// Left by a comment at the start
+		if (!value.size && is_blank(*c))
+			continue;
+
+		if (quote)
+		{
+			if (*c == '\\' && c + 1 < value_end)
+				value.content[value.size++] = *c++;
+			else if (*c == quote)
+				quote = 0;
+		}
+		else if (*c == '"' || *c == '\'')
+			quote = *c;
+		else if (skip_define_comment(c, value_end) != c)
+		{
+			// The blanks around it become a single one
+			if (value.size && !is_blank(value.content[value.size - 1]))
+				value.content[value.size++] = ' ';
+			for (c = skip_define_comment(c, value_end); c < value_end && is_blank(*c); c++);
+			c--;
+			continue;
+		}
+		value.content[value.size++] = *c;
+	}
+	return 1;
+}
+
+// Parses "NAME value" or "NAME(parameters) body" of a #define directive into the symbol table
+bool process_define(SymbolTable& symbols, const char* arguments, const char* line_end)
+{
+	if (arguments == line_end || !is_identifier_start(*arguments))
+	{
+		wprintf(L"Invalid macro name of #define statement\n");
+		return 0;
+	}
+
+	auto name_end = arguments + 1;
+	for (; name_end < line_end && is_identifier_char(*name_end); name_end++);
+
+	// Only a ( right after the name makes it function-like
+	const auto function_like = name_end < line_end && *name_end == '(';
+	MacroParameters parameters;
+	auto value_start = name_end;
+	if (function_like && !parse_macro_parameters(parameters, value_start, line_end))
+		return 0;
+	for (; value_start < line_end && is_blank(*value_start); value_start++);
+
+	Buffer value;
+	if (!get_define_value(value, *symbols.arena, value_start, line_end))
+		return 0;
+
+	const MacroPlan* plan = 0;
+	if (function_like && !compile_macro_plan(plan, *symbols.arena, parameters, value.content, value.size))
+		return 0;
+
+	return symbol_table_define(symbols, arguments, (u32)(name_end - arguments), value.content, value.size, plan);
+}
+
+bool process_undef(SymbolTable& symbols, const char* arguments, const char* line_end)
+{
+	if (arguments == line_end || !is_identifier_start(*arguments))
+	{
+		wprintf(L"Invalid macro name of #undef statement\n");
+		return 0;
+	}
+
+	auto name_end = arguments + 1;
+	for (; name_end < line_end && is_identifier_char(*name_end); name_end++);
+
+	symbol_table_undefine(symbols, arguments, (u32)(name_end - arguments));
+	return 1;
+}
+
+// Headers with #pragma once that were already included, by their path
+struct IncludedFiles {
+	PathId* files;
+	u64 capacity;
+	u64 count;
+};
+
+// Where the expansion of a file is in its conditionals
+struct ConditionalState {
+	// Conditionals whose taken branch is being expanded
+	u32 depth;
+	// Going over a branch that isn't taken
+	bool skipping;
+	// A branch of the skipped conditional was taken already, so only its #endif ends the skip
+	bool skip_to_endif;
+	// Conditionals opened in the skipped branch that go on past the end of the buffer
+	u32 skip_depth;
+};
+
+// State of the translation unit being expanded, allocated from the arena of its job
+struct TranslationUnit {
+	Arena* arena;
+	SymbolTable symbols;
+	// Replacements of function-like macros, which live as long as the output that references them
+	Arena* replacements;
+	IncludedFiles included;
+	// Of the input itself, carried from one chunk of a streamed input to the next
+	ConditionalState conditionals;
+	// Every included file is recorded in it when it isn't 0
+	Dependencies* dependencies;
+	// Only with --stats
+	FileStats* stats;
+	// Only with --header-cache
+	HeaderSnapshots* snapshots;
+	// Of the last header the input included before anything else
+	const HeaderSnapshot* snapshot;
+	// The input only included headers so far, so the next one can be snapshotted
+	bool snapshot_chain;
+	SnapshotRecorder recorder;
+};
+
+PathId* included_files_find_slot(PathId* files, const u64 capacity, const PathId file)
+{
+	auto index = get_path_hash(file) & (capacity - 1);
+	while (files[index] && files[index] != file)
+		index = (index + 1) & (capacity - 1);
+	return &files[index];
+}
+
+bool is_file_included(const IncludedFiles& included, const PathId file)
+{
+	return included.count && *included_files_find_slot(included.files, included.capacity, file);
+}
+
+bool mark_file_included(TranslationUnit& unit, const PathId file)
+{
+	auto& included = unit.included;
+	if ((included.count + 1) * 2 > included.capacity)
+	{
+		const auto new_capacity = included.capacity ? included.capacity * 2 : 64;
+		const auto new_files = (PathId*)arena_alloc(*unit.arena, new_capacity * sizeof(PathId));
+		if (!new_files)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+		memset(new_files, 0, new_capacity * sizeof(PathId));
+
+		for (u64 i = 0; i < included.capacity; i++)
+		{
+			if (included.files[i])
+				*included_files_find_slot(new_files, new_capacity, included.files[i]) = included.files[i];
+		}
+		included.files = new_files;
+		included.capacity = new_capacity;
+	}
+
+	auto& slot = *included_files_find_slot(included.files, included.capacity, file);
+	if (!slot)
+	{
+		slot = file;
+		included.count++;
+	}
+	return !unit.recorder.active || snapshot_recorder_push_once(unit.recorder, *unit.arena, file);
+}
+
+// Whether the header would expand to nothing because it was already included
+bool is_include_redundant(const TranslationUnit& unit, const SourceFile& file, const PathId path)
+{
+	if (file.guard.pragma_once && is_file_included(unit.included, path))
+		return 1;
+
+	return file.guard.macro && symbol_table_find(unit.symbols, file.guard.macro, file.guard.macro_size);
+}
+
+// Keeps the #define or #undef that was just processed for the header being snapshotted
+bool record_macro_directive(TranslationUnit& unit, const char* arguments, const char* line_end, const bool undefine)
+{
+	auto name_end = arguments + 1;
+	for (; name_end < line_end && is_identifier_char(*name_end); name_end++);
+	const auto name_size = (u32)(name_end - arguments);
+	const auto symbol = undefine ? 0 : symbol_table_find(unit.symbols, arguments, name_size);
+	return snapshot_recorder_push_symbol(unit.recorder, *unit.arena, arguments, name_size, symbol);
+}
+
+// Does what the header of snapshot did to the translation unit without looking at the header
+bool apply_header_snapshot(OutputRope& out, TranslationUnit& unit, const HeaderSnapshot& snapshot)
+{
+	const auto& blob = get_snapshot_blob(snapshot);
+	if (!output_rope_append(out, snapshot.blob + blob.output_offset, blob.output_size))
+		return 0;
+
+	const auto symbols = get_snapshot_symbols(snapshot);
+	for (u64 i = 0; i < blob.symbols_count; i++)
+	{
+		const auto& symbol = symbols[i];
+		const auto name = snapshot.blob + symbol.name_offset;
+		if (symbol.undefine)
+		{
+			symbol_table_undefine(unit.symbols, name, symbol.name_size);
+			continue;
+		}
+
+		MacroPlan* plan = 0;
+		if (symbol.function_like)
+		{
+			plan = (MacroPlan*)arena_alloc(*unit.arena, sizeof(MacroPlan));
+			if (!plan)
+			{
+				wprintf(L"Failed to allocate memory!\n");
+				return 0;
+			}
+			*plan = {
+				.ops = (const MacroOp*)(snapshot.blob + symbol.ops_offset),
+				.ops_count = symbol.ops_count,
+				.parameters_count = symbol.parameters_count,
+				.variadic = symbol.variadic,
+			};
+		}
+		if (!symbol_table_define(unit.symbols, name, symbol.name_size, snapshot.blob + symbol.value_offset, symbol.value_size, plan))
+			return 0;
+	}
+
+	for (u64 i = 0; i < blob.once_count; i++)
+	{
+		if (!mark_file_included(unit, snapshot.once_paths[i]))
+			return 0;
+	}
+
+	if (unit.dependencies)
+	{
+		for (u64 i = 0; i < blob.dependencies_count; i++)
+		{
+			if (!dependencies_push(*unit.dependencies, snapshot.dependencies[i]))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+struct IncludeFrame {
+	SourceFile file;
+	const char* cursor;
+	u64 next_directive;
+	// Full path, as given for the translation unit itself
+	PathId path;
+	// Where its quoted includes are looked up first
+	PathId dir;
+	ConditionalState conditionals;
+	// Only with --trace
+	u64 start_ns;
+};
+
+// Whether the condition of an #if, #ifdef, #ifndef or #elif holds. Invalid ones don't.
+bool is_condition_true(const SymbolTable& symbols, const SourceFile& file, const Directive& directive, const PathId path)
+{
+	const auto arguments = file.buffer.content + directive.offset + directive.arguments_offset;
+	const auto line_end = file.buffer.content + directive.offset + directive.size;
+	if (directive.kind == DirectiveKind::Ifdef || directive.kind == DirectiveKind::Ifndef)
+	{
+		if (arguments == line_end || !is_identifier_start(*arguments))
+		{
+			nice_wprintf(L"Invalid macro name of #%hs statement in \"%hs\"!\n", directive.kind == DirectiveKind::Ifdef ? "ifdef" : "ifndef", get_path(path));
+			return 0;
+		}
+
+		auto name_end = arguments + 1;
+		for (; name_end < line_end && is_identifier_char(*name_end); name_end++);
+		const auto defined = symbol_table_find(symbols, arguments, (u32)(name_end - arguments)) != 0;
+		return directive.kind == DirectiveKind::Ifdef ? defined : !defined;
+	}
+
+	i64 value;
+	const wchar_t* error;
+	if (!evaluate_expression(value, error, symbols, arguments, line_end))
+	{
+		nice_wprintf(L"%ls in the condition \"%.*hs\" in \"%hs\"!\n", error, (int)(line_end - arguments), arguments, get_path(path));
+		return 0;
+	}
+	return value != 0;
+}
+
+// Goes over a branch that isn't taken up to the #elif that holds, the #else or
+// the #endif that ends it. Only its directives are looked at, never the text
+// between them, and the conditionals nested in it are jumped over at once.
+// When the file ends first the frame is left skipping, for the next chunk.
+void skip_branch(IncludeFrame& frame, const SymbolTable& symbols)
+{
+	auto& state = frame.conditionals;
+	const auto& file = frame.file;
+	state.skipping = 1;
+	while (frame.next_directive < file.directives_count)
+	{
+		const auto& directive = file.directives[frame.next_directive++];
+		switch (directive.kind)
+		{
+			case DirectiveKind::If:
+			case DirectiveKind::Ifdef:
+			case DirectiveKind::Ifndef:
+				if (directive.end && directive.end < file.directives_count)
+					frame.next_directive = directive.end + 1;
+				else
+					state.skip_depth++;
+				continue;
+			case DirectiveKind::Endif:
+				if (state.skip_depth)
+				{
+					state.skip_depth--;
+					continue;
+				}
+				break;
+			case DirectiveKind::Elif:
+			case DirectiveKind::Else:
+				if (state.skip_depth || state.skip_to_endif)
+					continue;
+				if (directive.kind == DirectiveKind::Elif && !is_condition_true(symbols, file, directive, frame.path))
+					continue;
+				state.depth++;
+				break;
+			default:
+				continue;
+		}
+
+		state.skipping = 0;
+		frame.cursor = file.buffer.content + directive.offset + directive.size;
+		return;
+	}
+
+	frame.cursor = file.buffer.content + file.buffer.size;
+}
+
+// Conditional directive lines are removed like the other handled ones
+void process_conditional(IncludeFrame& frame, const SymbolTable& symbols, const Directive& directive)
+{
+	auto& state = frame.conditionals;
+	if (is_conditional_start(directive.kind))
+	{
+		if (is_condition_true(symbols, frame.file, directive, frame.path))
+			state.depth++;
+		else
+		{
+			state.skip_to_endif = 0;
+			skip_branch(frame, symbols);
+		}
+		return;
+	}
+
+	if (!state.depth)
+	{
+		const auto keyword = directive.kind == DirectiveKind::Elif ? "elif" : directive.kind == DirectiveKind::Else ? "else" : "endif";
+		nice_wprintf(L"#%hs without #if in \"%hs\"!\n", keyword, get_path(frame.path));
+		return;
+	}
+
+	// The taken branch ends here, the ones after it are skipped
+	state.depth--;
+	if (directive.kind != DirectiveKind::Endif)
+	{
+		state.skip_to_endif = 1;
+		skip_branch(frame, symbols);
+	}
+}
+
+void check_conditionals_closed(const ConditionalState& state, const PathId path)
+{
+	if (state.depth || state.skipping)
+		nice_wprintf(L"Missing #endif in \"%hs\"!\n", get_path(path));
+}
+
+// Jobs print their messages in a batch, so the pieces still end up on one line
+void print_include_cycle(const IncludeFrame* frames, const int frames_count, const int cycle_start, const PathId path)
+{
+	nice_wprintf(L"Include cycle: ");
+	for (auto i = cycle_start; i < frames_count; i++)
+		nice_wprintf(L"\"%hs\" -> ", get_path(frames[i].path));
+	nice_wprintf(L"\"%hs\", skipping it!\n", get_path(path));
+}
+
+// Expands every #include of in_file (and of the files it includes) into out and
+// substitutes the macros defined along the way in the same pass.
+// Branches of conditionals that aren't taken are left out.
+// Each open file keeps its own cursor on an explicit stack and walks its
+// directive index, so every byte of input is referenced once and never searched
+// again, no matter how many includes there are. Headers that are guarded and
+// already included are skipped without looking at them, and with --header-cache
+// the ones the input starts with are spliced in from their snapshots.
+// in_dir is the directory of in_path, where its quoted includes are looked up first.
+bool expand_includes(OutputRope& out, IncludeCache& include_cache, IncludeResolver& include_resolver, TranslationUnit& unit, const SourceFile& in_file, const PathId in_path, const PathId in_dir)
+{
+	auto& symbols = unit.symbols;
+
+	IncludeFrame frames[64];
+	int frames_count = 0;
+	frames[frames_count++] = {.file = in_file, .cursor = in_file.buffer.content, .path = in_path, .dir = in_dir, .conditionals = unit.conditionals};
+
+	ActiveMacros active = {.replacements = unit.replacements};
+
+	while (frames_count)
+	{
+		// The header the input included last is done, it's snapshotted for the next runs
+		if (unit.recorder.active && frames_count == 1)
+		{
+			unit.recorder.active = 0;
+			unit.snapshot = unit.recorder.failed ? 0 : header_snapshots_add(*unit.snapshots, unit.snapshot, unit.recorder, out);
+			unit.snapshot_chain = unit.snapshot != 0;
+		}
+
+		auto& frame = frames[frames_count - 1];
+		const auto& file = frame.file;
+
+		// A skip that went on past the end of the last chunk
+		if (frame.conditionals.skipping)
+			skip_branch(frame, symbols);
+
+		if (frame.next_directive == file.directives_count)
+		{
+			const auto file_end = file.buffer.content + file.buffer.size;
+			auto text = frame.cursor;
+			if (frames_count == 1 && unit.snapshot_chain && next_identifier(text, file_end))
+				unit.snapshot_chain = 0;
+			if (!substitute_macros(out, symbols, active, frame.cursor, file_end - frame.cursor, 0))
+				return 0;
+
+			// The translation unit has its own span, and its conditionals may go on in the next chunk
+			if (frames_count > 1)
+			{
+				check_conditionals_closed(frame.conditionals, frame.path);
+				trace_span("include", frame.start_ns, trace_time(), get_path(frame.path));
+			}
+			else
+				unit.conditionals = frame.conditionals;
+			frames_count--;
+			continue;
+		}
+
+		const auto& directive = file.directives[frame.next_directive++];
+		const auto line_start = file.buffer.content + directive.offset;
+		const auto line_end = line_start + directive.size;
+		const auto arguments = line_start + directive.arguments_offset;
+
+		// Only the includes that come before anything else in the input are
+		// snapshotted, the chain goes on once the header is spliced in or recorded
+		bool chained = 0;
+		if (frames_count == 1 && unit.snapshot_chain)
+		{
+			auto text = frame.cursor;
+			chained = directive.kind == DirectiveKind::Include && !next_identifier(text, line_start);
+			unit.snapshot_chain = 0;
+		}
+
+		if (!substitute_macros(out, symbols, active, frame.cursor, line_start - frame.cursor, 0))
+			return 0;
+		frame.cursor = line_end;
+
+		// Directive lines are never substituted, the ones that are handled are
+		// removed and the others are left as they are
+		if (is_conditional_start(directive.kind) || directive.kind == DirectiveKind::Elif || directive.kind == DirectiveKind::Else || directive.kind == DirectiveKind::Endif)
+		{
+			process_conditional(frame, symbols, directive);
+			continue;
+		}
+
+		if (directive.kind == DirectiveKind::Define)
+		{
+			if (!process_define(symbols, arguments, line_end))
+			{
+				if (!output_rope_append(out, line_start, directive.size))
+					return 0;
+			}
+			else if (unit.recorder.active && !record_macro_directive(unit, arguments, line_end, 0))
+				return 0;
+			continue;
+		}
+
+		if (directive.kind == DirectiveKind::Undef)
+		{
+			if (!process_undef(symbols, arguments, line_end))
+			{
+				if (!output_rope_append(out, line_start, directive.size))
+					return 0;
+			}
+			else if (unit.recorder.active && !record_macro_directive(unit, arguments, line_end, 1))
+				return 0;
+			continue;
+		}
+
+		IncludeStatement include;
+		if (directive.kind != DirectiveKind::Include || !process_include(include, arguments, line_end))
+		{
+			if (!output_rope_append(out, line_start, directive.size))
+				return 0;
+			continue;
+		}
+
+		const auto resolution = resolve_include(include_resolver, include.angled ? invalid_path_id : frame.dir, include.file_path, include.file_path_size);
+		const auto include_path_id = resolution.path;
+		if (!include_path_id)
+		{
+			// Most likely a system header, which is left to the compiler
+			if (include.angled)
+			{
+				if (!output_rope_append(out, line_start, directive.size))
+					return 0;
+			}
+			else
+			{
+				nice_wprintf(L"Can't find \"%.*hs\" included from \"%hs\"!\n", (int)include.file_path_size, include.file_path, get_path(frame.path));
+				// So the message isn't lost in a snapshot
+				unit.recorder.failed = 1;
+			}
+			continue;
+		}
+
+		if (frames_count == COUNTOF(frames))
+		{
+			nice_wprintf(L"Include depth too large while including \"%hs\"!\n", get_path(include_path_id));
+			unit.recorder.failed = 1;
+			continue;
+		}
+
+		if (chained)
+		{
+			const auto snapshot = header_snapshots_find(*unit.snapshots, unit.snapshot, include_path_id);
+			if (snapshot)
+			{
+				const auto start_ns = trace_time();
+				if (!apply_header_snapshot(out, unit, *snapshot))
+					return 0;
+				trace_span("snapshot", start_ns, trace_time(), get_path(include_path_id));
+				unit.snapshot = snapshot;
+				unit.snapshot_chain = 1;
+				continue;
+			}
+			snapshot_recorder_start(unit.recorder, *unit.arena, include_path_id, out.size);
+		}
+
+		Dependency dependency = {};
+		include.file = include_cache_get(include_cache, include_path_id, unit.dependencies || unit.recorder.active ? &dependency : 0, unit.stats);
+		if (unit.stats && include.file.buffer.content)
+			unit.stats->includes_resolved++;
+		// Empty files are recorded too, so they are noticed once they aren't
+		if (unit.dependencies && dependency.path && !dependencies_push(*unit.dependencies, dependency))
+			return 0;
+		if (unit.recorder.active)
+		{
+			if (!dependency.path)
+				unit.recorder.failed = 1;
+			else if (!dependencies_push(unit.recorder.dependencies, dependency))
+				return 0;
+		}
+		if (!include.file.buffer.content || is_include_redundant(unit, include.file, include_path_id))
+			continue;
+
+		auto cycle_start = 0;
+		for (; cycle_start < frames_count && frames[cycle_start].file.buffer.content != include.file.buffer.content; cycle_start++);
+		if (cycle_start < frames_count)
+		{
+			print_include_cycle(frames, frames_count, cycle_start, include_path_id);
+			unit.recorder.failed = 1;
+			continue;
+		}
+
+		if (include.file.guard.pragma_once && !mark_file_included(unit, include_path_id))
+			return 0;
+
+		auto& include_frame = frames[frames_count++];
+		include_frame = {.file = include.file, .cursor = include.file.buffer.content, .path = include_path_id, .dir = resolution.dir, .start_ns = trace_time()};
+	}
+
+	return 1;
+}
@@ -0,0 +1,195 @@
+// Finds the file every #include refers to. Quoted names are looked up next to
+// the file that includes them and then in the -I directories, angled names only
+// in the -I directories. Every lookup is cached, misses included: the one next
+// to the including file by its directory and the name, the one in the -I
+// directories by the name alone. However many files include a header, each
+// directory is only stat'ed once for it.
+struct IncludeResolution {
+	// Full path, invalid_path_id if the file wasn't found
+	PathId path;
+	// Of path with a trailing separator, where the includes of the file are looked up
+	PathId dir;
+};
+
+struct IncludeResolverEntry {
+	// As spelled in the directive, 0 for an empty slot
+	const char* name;
+	u32 name_size;
+	// Directory of the including file, invalid_path_id for the search in the -I directories
+	PathId including_dir;
+	u64 hash;
+	IncludeResolution resolution;
+};
+
+struct IncludeResolver {
+	Mutex mutex;
+	// Absolute and with a trailing separator, in the order they were given
+	const PathId* search_dirs;
+	u32 search_dirs_count;
+	IncludeResolverEntry* entries;
+	u64 capacity;
+	u64 count;
+	// Names of the entries
+	Arena names;
+	std::atomic<u64> hits;
+	std::atomic<u64> misses;
+};
+
+IncludeResolverEntry* include_resolver_find_slot(IncludeResolverEntry* entries, const u64 capacity, const PathId including_dir, const char* name, const u64 name_size, const u64 hash)
+{
+	auto index = hash & (capacity - 1);
+	while (true)
+	{
+		auto& entry = entries[index];
+		if (!entry.name || (entry.hash == hash && entry.including_dir == including_dir && entry.name_size == name_size && memcmp(entry.name, name, name_size) == 0))
+			return &entry;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+bool include_resolver_grow(IncludeResolver& resolver)
+{
+	const auto new_capacity = resolver.capacity ? resolver.capacity * 2 : 256;
+	const auto new_entries = (IncludeResolverEntry*)memory_alloc(new_capacity * sizeof(IncludeResolverEntry));
+	if (!new_entries)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	for (u64 i = 0; i < resolver.capacity; i++)
+	{
+		const auto& entry = resolver.entries[i];
+		if (!entry.name) continue;
+		*include_resolver_find_slot(new_entries, new_capacity, entry.including_dir, entry.name, entry.name_size, entry.hash) = entry;
+	}
+
+	memory_free(resolver.entries);
+	resolver.entries = new_entries;
+	resolver.capacity = new_capacity;
+	return 1;
+}
+
+// Whether name exists in dir, without the cache. Only found files are interned.
+bool find_include_in_dir(IncludeResolution& resolution, const PathId dir, const char* name, const u64 name_size)
+{
+	const auto& dir_entry = path_pool_entry(g_paths, dir);
+	char path[max_path_size];
+	if (dir_entry.size + name_size >= sizeof(path))
+		return 0;
+	memcpy(path, dir_entry.path, dir_entry.size);
+	memcpy(path + dir_entry.size, name, name_size);
+	path[dir_entry.size + name_size] = 0;
+
+	// Resolves the "." and ".." of the name, so a header has a single id however it's reached
+	char full_path[max_path_size];
+	char* file_part;
+	const auto full_path_size = get_full_path_name(full_path, sizeof(full_path), path, &file_part);
+	FileInfo file_info;
+	if (!full_path_size || !file_part || !get_file_info(full_path, file_info))
+		return 0;
+
+	resolution.path = path_pool_intern(g_paths, full_path, full_path_size);
+	resolution.dir = path_pool_intern(g_paths, full_path, file_part - full_path);
+	return resolution.path && resolution.dir;
+}
+
+// Only in including_dir when it's set, in the -I directories otherwise
+IncludeResolution find_include(const IncludeResolver& resolver, const PathId including_dir, const char* name, const u64 name_size)
+{
+	IncludeResolution resolution = {};
+	if (including_dir)
+		return find_include_in_dir(resolution, including_dir, name, name_size) ? resolution : IncludeResolution{};
+
+	for (u32 i = 0; i < resolver.search_dirs_count; i++)
+	{
+		if (find_include_in_dir(resolution, resolver.search_dirs[i], name, name_size))
+			return resolution;
+	}
+	return {};
+}
+
+IncludeResolution lookup_include(IncludeResolver& resolver, const PathId including_dir, const char* name, const u64 name_size)
+{
+	const auto hash = hash_bytes(name, name_size) ^ (including_dir ? get_path_hash(including_dir) : 0);
+
+	mutex_lock_shared(resolver.mutex);
+	if (resolver.capacity)
+	{
+		const auto& entry = *include_resolver_find_slot(resolver.entries, resolver.capacity, including_dir, name, name_size, hash);
+		if (entry.name)
+		{
+			const auto resolution = entry.resolution;
+			mutex_unlock_shared(resolver.mutex);
+			resolver.hits++;
+			return resolution;
+		}
+	}
+	mutex_unlock_shared(resolver.mutex);
+
+	// Searched outside of the lock, another thread may do the same search in the meantime
+	const auto resolution = find_include(resolver, including_dir, name, name_size);
+
+	mutex_lock(resolver.mutex);
+	resolver.misses++;
+	if ((resolver.count + 1) * 2 > resolver.capacity && !include_resolver_grow(resolver))
+	{
+		mutex_unlock(resolver.mutex);
+		return resolution;
+	}
+
+	auto& entry = *include_resolver_find_slot(resolver.entries, resolver.capacity, including_dir, name, name_size, hash);
+	if (!entry.name)
+	{
+		const auto entry_name = (char*)arena_alloc(resolver.names, name_size);
+		if (entry_name)
+		{
+			memcpy(entry_name, name, name_size);
+			entry = {
+				.name = entry_name,
+				.name_size = (u32)name_size,
+				.including_dir = including_dir,
+				.hash = hash,
+				.resolution = resolution,
+			};
+			resolver.count++;
+		}
+	}
+	mutex_unlock(resolver.mutex);
+
+	return resolution;
+}
+
+// Quoted names are given the directory of the including file, angled ones invalid_path_id.
+// Safe to call from multiple threads.
+IncludeResolution resolve_include(IncludeResolver& resolver, const PathId including_dir, const char* name, const u64 name_size)
+{
+	if (including_dir)
+	{
+		const auto resolution = lookup_include(resolver, including_dir, name, name_size);
+		if (resolution.path)
+			return resolution;
+	}
+
+	// Nothing to search and nothing worth caching
+	if (!resolver.search_dirs_count)
+		return {};
+	return lookup_include(resolver, invalid_path_id, name, name_size);
+}
+
+// Forgets every lookup, when files may have been created or removed since.
+// Only when no one resolves includes, like between two runs of the jobs.
+void include_resolver_clear(IncludeResolver& resolver)
+{
+	memory_free(resolver.entries);
+	resolver.entries = 0;
+	resolver.capacity = 0;
+	resolver.count = 0;
+	arena_reset(resolver.names);
+}
+
+void include_resolver_free(IncludeResolver& resolver)
+{
+	include_resolver_clear(resolver);
+	arena_free(resolver.names);
+}
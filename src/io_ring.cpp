@@ -0,0 +1,281 @@
+// Batched file I/O on io_uring for --io-uring. A file is read or written whole
+// by a single chain of openat, read or write and close on a registered file
+// slot, so a worker queues many files with one syscall and keeps expanding
+// while they are in flight. Every worker has its own ring, nothing is locked.
+// Where io_uring isn't there (other platforms, old kernels, seccomp filters)
+// io_ring_init fails and the plain syscalls are used instead.
+
+struct IoFileRequest;
+typedef void (*IoFileProc)(IoFileRequest* request, void* user);
+
+// A file read or written whole. It's owned by the caller, but has to stay
+// alive until the ring reaped it.
+struct IoFileRequest {
+	// Has to outlive the request
+	const char* path;
+	char* buffer;
+	u64 size;
+	bool write;
+	// Called on the thread that reaps the request
+	IoFileProc proc;
+	// Free for the caller
+	u32 item;
+	// Bytes read or written, or -errno of the step that failed. Valid once done.
+	i64 result;
+	bool done;
+	// Results of the steps of the chain
+	int open_result;
+	i64 data_result;
+	u8 steps_done;
+	u32 slot;
+};
+
+// Outputs and inputs larger than this aren't worth a copy, they go through the plain syscalls
+constexpr u64 io_ring_max_file_size = 1 << 20;
+// Bytes a ring keeps in flight at most
+constexpr u64 io_ring_max_bytes = 8 << 20;
+
+#ifdef _WIN32
+// Never initialized, everything goes through the plain syscalls
+struct IoRing {
+	u32 in_flight;
+	u64 bytes_in_flight;
+};
+
+inline bool io_ring_init(IoRing& ring)
+{
+	ring = {};
+	return 0;
+}
+
+inline void io_ring_free(IoRing& ring) {}
+inline bool io_ring_push(IoRing& ring, IoFileRequest* request) { return 0; }
+inline void io_ring_submit(IoRing& ring) {}
+inline void io_ring_reap(IoRing& ring, const bool wait, void* user) {}
+#else
+constexpr u32 io_ring_entries = 256;
+// One registered file per chain in flight, each chain takes three entries
+constexpr u32 io_ring_slots = 64;
+
+struct IoRing {
+	int fd;
+	void* rings;
+	u64 rings_size;
+	io_uring_sqe* sqes;
+	u64 sqes_size;
+	u32* sq_head;
+	u32* sq_tail;
+	u32* sq_array;
+	u32 sq_mask;
+	u32 sq_entries;
+	// Entries written since the last io_uring_enter
+	u32 sq_queued;
+	u32* cq_head;
+	u32* cq_tail;
+	u32 cq_mask;
+	io_uring_cqe* cqes;
+	u32 free_slots[io_ring_slots];
+	u32 free_slots_count;
+	// Requests pushed and not reaped yet
+	u32 in_flight;
+	u64 bytes_in_flight;
+};
+
+void io_ring_free(IoRing& ring)
+{
+	if (ring.sqes)
+		munmap(ring.sqes, ring.sqes_size);
+	if (ring.rings)
+		munmap(ring.rings, ring.rings_size);
+	if (ring.fd >= 0)
+		close(ring.fd);
+	ring = {.fd = -1};
+}
+
+bool io_ring_supports(const int fd, const u8* ops, const u32 ops_count)
+{
+	u8 probe_memory[sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op)] = {};
+	const auto probe = (io_uring_probe*)probe_memory;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+		return 0;
+
+	for (u32 i = 0; i < ops_count; i++)
+	{
+		if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			return 0;
+	}
+	return 1;
+}
+
+// Fails without a message, the caller falls back to the plain syscalls
+bool io_ring_init(IoRing& ring)
+{
+	ring = {.fd = -1};
+	io_uring_params params = {};
+	ring.fd = (int)syscall(__NR_io_uring_setup, io_ring_entries, &params);
+	if (ring.fd < 0)
+		return 0;
+
+	// Both came with 5.4, long before the direct descriptors of openat
+	const u8 ops[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE};
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) || !io_ring_supports(ring.fd, ops, COUNTOF(ops)))
+	{
+		io_ring_free(ring);
+		return 0;
+	}
+
+	const auto sq_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+	const auto cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	ring.rings_size = sq_size > cq_size ? sq_size : cq_size;
+	ring.rings = mmap(0, ring.rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.rings == MAP_FAILED)
+	{
+		ring.rings = 0;
+		io_ring_free(ring);
+		return 0;
+	}
+
+	ring.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	ring.sqes = (io_uring_sqe*)mmap(0, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+	{
+		ring.sqes = 0;
+		io_ring_free(ring);
+		return 0;
+	}
+
+	const auto rings = (char*)ring.rings;
+	ring.sq_head = (u32*)(rings + params.sq_off.head);
+	ring.sq_tail = (u32*)(rings + params.sq_off.tail);
+	ring.sq_array = (u32*)(rings + params.sq_off.array);
+	ring.sq_mask = *(u32*)(rings + params.sq_off.ring_mask);
+	ring.sq_entries = params.sq_entries;
+	ring.cq_head = (u32*)(rings + params.cq_off.head);
+	ring.cq_tail = (u32*)(rings + params.cq_off.tail);
+	ring.cq_mask = *(u32*)(rings + params.cq_off.ring_mask);
+	ring.cqes = (io_uring_cqe*)(rings + params.cq_off.cqes);
+
+	// Empty slots, openat fills them
+	int files[io_ring_slots];
+	for (u32 i = 0; i < io_ring_slots; i++)
+	{
+		files[i] = -1;
+		ring.free_slots[i] = io_ring_slots - 1 - i;
+	}
+	ring.free_slots_count = io_ring_slots;
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, io_ring_slots) < 0)
+	{
+		io_ring_free(ring);
+		return 0;
+	}
+	return 1;
+}
+
+io_uring_sqe& io_ring_next_sqe(IoRing& ring, const u8 opcode, IoFileRequest* request, const u64 step)
+{
+	const auto index = (*ring.sq_tail + ring.sq_queued++) & ring.sq_mask;
+	auto& sqe = ring.sqes[index];
+	ring.sq_array[index] = index;
+	sqe = {};
+	sqe.opcode = opcode;
+	// Requests are aligned, the step goes in the low bits
+	sqe.user_data = (u64)request | step;
+	return sqe;
+}
+
+// Queues the chain of request, io_ring_submit sends it. Returns 0 when the ring
+// has no room for it until some requests are reaped.
+bool io_ring_push(IoRing& ring, IoFileRequest* request)
+{
+	if (!ring.free_slots_count || ring.sq_queued + 3 > ring.sq_entries)
+		return 0;
+
+	request->slot = ring.free_slots[--ring.free_slots_count];
+	request->done = 0;
+	request->steps_done = 0;
+	request->open_result = 0;
+	request->data_result = 0;
+	ring.in_flight++;
+	ring.bytes_in_flight += request->size;
+
+	auto& open_sqe = io_ring_next_sqe(ring, IORING_OP_OPENAT, request, 0);
+	open_sqe.fd = AT_FDCWD;
+	open_sqe.addr = (u64)request->path;
+	// O_CLOEXEC isn't allowed for registered files, which are never inherited anyway
+	open_sqe.open_flags = request->write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+	open_sqe.len = request->write ? 0666 : 0;
+	open_sqe.file_index = request->slot + 1;
+	open_sqe.flags = IOSQE_IO_LINK;
+
+	// Hard linked, so the file is closed even if this fails
+	auto& data_sqe = io_ring_next_sqe(ring, request->write ? IORING_OP_WRITE : IORING_OP_READ, request, 1);
+	data_sqe.fd = request->slot;
+	data_sqe.addr = (u64)request->buffer;
+	data_sqe.len = (u32)request->size;
+	data_sqe.off = 0;
+	data_sqe.flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+	auto& close_sqe = io_ring_next_sqe(ring, IORING_OP_CLOSE, request, 2);
+	close_sqe.file_index = request->slot + 1;
+	return 1;
+}
+
+int io_ring_enter(IoRing& ring, const u32 min_complete)
+{
+	if (ring.sq_queued)
+		__atomic_store_n(ring.sq_tail, *ring.sq_tail + ring.sq_queued, __ATOMIC_RELEASE);
+
+	while (true)
+	{
+		const auto result = (int)syscall(__NR_io_uring_enter, ring.fd, ring.sq_queued, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+		if (result >= 0 || errno != EINTR)
+		{
+			// Without SQPOLL everything that was queued is consumed by the call
+			if (result >= 0)
+				ring.sq_queued = 0;
+			return result;
+		}
+	}
+}
+
+// Sends what io_ring_push queued without waiting for it
+void io_ring_submit(IoRing& ring)
+{
+	if (ring.sq_queued)
+		io_ring_enter(ring, 0);
+}
+
+// Calls the proc of every request whose chain completed. With wait, blocks
+// until at least one completion arrives when nothing is ready yet.
+void io_ring_reap(IoRing& ring, const bool wait, void* user)
+{
+	auto head = *ring.cq_head;
+	if (wait && ring.in_flight && head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+		io_ring_enter(ring, 1);
+	else if (ring.sq_queued)
+		io_ring_enter(ring, 0);
+
+	const auto tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++)
+	{
+		const auto& cqe = ring.cqes[head & ring.cq_mask];
+		const auto request = (IoFileRequest*)(cqe.user_data & ~(u64)3);
+		const auto step = cqe.user_data & 3;
+		if (step == 0)
+			request->open_result = cqe.res;
+		else if (step == 1)
+			request->data_result = cqe.res;
+		if (++request->steps_done < 3) continue;
+
+		ring.free_slots[ring.free_slots_count++] = request->slot;
+		ring.in_flight--;
+		ring.bytes_in_flight -= request->size;
+		request->result = request->open_result < 0 ? request->open_result : request->data_result;
+		request->done = 1;
+		// Consumed first, the proc may push or reap again
+		__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+		request->proc(request, user);
+	}
+	__atomic_store_n(ring.cq_head, tail, __ATOMIC_RELEASE);
+}
+#endif
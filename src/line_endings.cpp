@@ -0,0 +1,210 @@
+// CRLF -> LF normalization kernels. A block is only handled byte by byte when
+// it has a "\r\n" in it, everything else is moved 16/32 bytes at a time.
+// Lone '\r' are kept as they are.
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+inline u32 count_trailing_zeros(const u32 mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// dest may be src or before it, never after
+u64 compact_dos_line_endings_block(char* dest, const char* src, const u32 size, u32 crlf_mask)
+{
+	u64 written = 0;
+	u32 start = 0;
+	while (crlf_mask)
+	{
+		const auto position = count_trailing_zeros(crlf_mask);
+		memmove(dest + written, src + start, position - start);
+		written += position - start;
+		start = position + 1;
+		crlf_mask &= crlf_mask - 1;
+	}
+
+	memmove(dest + written, src + start, size - start);
+	return written + size - start;
+}
+
+const char* find_dos_line_ending_scalar(const char* begin, const char* end)
+{
+	for (auto c = begin; c < end; c++)
+	{
+		c = (const char*)memchr(c, '\r', end - c);
+		if (!c) return 0;
+		if (c + 1 < end && c[1] == '\n')
+			return c;
+	}
+
+	return 0;
+}
+
+u64 normalize_line_endings_scalar(char* dest, const char* src, const u64 size)
+{
+	u64 written = 0;
+	for (u64 i = 0; i < size; i++)
+	{
+		if (src[i] == '\r' && i + 1 < size && src[i + 1] == '\n')
+			continue;
+		dest[written++] = src[i];
+	}
+
+	return written;
+}
+
+#ifdef SIMD_X86
+// The mask of every '\r' that is followed by a '\n', the block after src is peeked at
+inline u32 get_crlf_mask_sse2(const char* src)
+{
+	const auto block = _mm_loadu_si128((const __m128i*)src);
+	const auto next_block = _mm_loadu_si128((const __m128i*)(src + 1));
+	const auto crlf = _mm_and_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(next_block, _mm_set1_epi8('\n')));
+	return (u32)_mm_movemask_epi8(crlf);
+}
+
+const char* find_dos_line_ending_sse2(const char* begin, const char* end)
+{
+	auto c = begin;
+	for (; end - c > 16; c += 16)
+	{
+		const auto crlf_mask = get_crlf_mask_sse2(c);
+		if (crlf_mask)
+			return c + count_trailing_zeros(crlf_mask);
+	}
+
+	return find_dos_line_ending_scalar(c, end);
+}
+
+u64 normalize_line_endings_sse2(char* dest, const char* src, const u64 size)
+{
+	u64 written = 0;
+	u64 i = 0;
+	for (; size - i > 16; i += 16)
+	{
+		const auto crlf_mask = get_crlf_mask_sse2(src + i);
+		if (!crlf_mask)
+		{
+			// Already loaded, so storing over it is fine when normalizing in place
+			_mm_storeu_si128((__m128i*)(dest + written), _mm_loadu_si128((const __m128i*)(src + i)));
+			written += 16;
+			continue;
+		}
+
+		written += compact_dos_line_endings_block(dest + written, src + i, 16, crlf_mask);
+	}
+
+	return written + normalize_line_endings_scalar(dest + written, src + i, size - i);
+}
+
+TARGET_AVX2 inline u32 get_crlf_mask_avx2(const char* src)
+{
+	const auto block = _mm256_loadu_si256((const __m256i*)src);
+	const auto next_block = _mm256_loadu_si256((const __m256i*)(src + 1));
+	const auto crlf = _mm256_and_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(next_block, _mm256_set1_epi8('\n')));
+	return (u32)_mm256_movemask_epi8(crlf);
+}
+
+TARGET_AVX2 const char* find_dos_line_ending_avx2(const char* begin, const char* end)
+{
+	auto c = begin;
+	for (; end - c > 32; c += 32)
+	{
+		const auto crlf_mask = get_crlf_mask_avx2(c);
+		if (crlf_mask)
+			return c + count_trailing_zeros(crlf_mask);
+	}
+
+	return find_dos_line_ending_sse2(c, end);
+}
+
+TARGET_AVX2 u64 normalize_line_endings_avx2(char* dest, const char* src, const u64 size)
+{
+	u64 written = 0;
+	u64 i = 0;
+	for (; size - i > 32; i += 32)
+	{
+		const auto crlf_mask = get_crlf_mask_avx2(src + i);
+		if (!crlf_mask)
+		{
+			_mm256_storeu_si256((__m256i*)(dest + written), _mm256_loadu_si256((const __m256i*)(src + i)));
+			written += 32;
+			continue;
+		}
+
+		written += compact_dos_line_endings_block(dest + written, src + i, 32, crlf_mask);
+	}
+
+	return written + normalize_line_endings_sse2(dest + written, src + i, size - i);
+}
+
+bool cpu_has_avx2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return 0;
+
+	// The OS has to save the ymm registers too
+	__cpuid(info, 1);
+	const auto has_osxsave = (info[2] & 1 << 27) != 0;
+	const auto has_avx = (info[2] & 1 << 28) != 0;
+	if (!has_osxsave || !has_avx || (_xgetbv(0) & 6) != 6) return 0;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & 1 << 5) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+struct LineEndingKernels {
+	const char* (*find_dos_line_ending)(const char* begin, const char* end);
+	u64 (*normalize_line_endings)(char* dest, const char* src, u64 size);
+};
+
+const LineEndingKernels& get_line_ending_kernels()
+{
+	static const LineEndingKernels kernels = []() -> LineEndingKernels {
+#ifdef SIMD_X86
+		if (cpu_has_avx2())
+			return {find_dos_line_ending_avx2, normalize_line_endings_avx2};
+		return {find_dos_line_ending_sse2, normalize_line_endings_sse2};
+#else
+		return {find_dos_line_ending_scalar, normalize_line_endings_scalar};
+#endif
+	}();
+
+	return kernels;
+}
+
+// Views aren't NUL terminated, so strstr can't be used on them
+const char* find_dos_line_ending(const char* begin, const char* end)
+{
+	return get_line_ending_kernels().find_dos_line_ending(begin, end);
+}
+
+// Compacts every "\r\n" of src into "\n", dest may be src. Returns the new size.
+u64 normalize_line_endings(char* dest, const char* src, const u64 size)
+{
+	return get_line_ending_kernels().normalize_line_endings(dest, src, size);
+}
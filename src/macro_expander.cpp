@@ -0,0 +1,949 @@
+// Substitutes the macros of a translation unit into its text. Function-like
+// macros are compiled into a plan when they are defined, the spans of their
+// body and the slots of their arguments, so an invocation is replayed from it
+// instead of going over the body again.
+
+// Output as slices of the source buffers, so headers are referenced by every
+// file that includes them instead of being copied. The buffers have to stay
+// alive until the output is written.
+struct OutputRope {
+	OutputSlice* slices;
+	u64 count;
+	u64 capacity;
+	u64 size;
+	// Allocates from it instead of the heap when set
+	Arena* arena;
+};
+
+bool output_rope_append(OutputRope& out, const char* data, const u64 size)
+{
+	if (!size) return 1;
+
+	if (out.count)
+	{
+		auto& last = out.slices[out.count - 1];
+		if (last.content + last.size == data)
+		{
+			last.size += size;
+			out.size += size;
+			return 1;
+		}
+	}
+
+	if (out.count == out.capacity)
+	{
+		const auto new_capacity = out.capacity ? out.capacity * 2 : 64;
+		OutputSlice* new_slices;
+		if (out.arena)
+			new_slices = (OutputSlice*)arena_realloc(*out.arena, out.slices, out.count * sizeof(OutputSlice), new_capacity * sizeof(OutputSlice));
+		else
+			new_slices = (OutputSlice*)memory_alloc(new_capacity * sizeof(OutputSlice));
+		if (!new_slices)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+
+		if (out.slices && !out.arena)
+		{
+			memcpy(new_slices, out.slices, out.count * sizeof(OutputSlice));
+			memory_free(out.slices);
+		}
+		out.slices = new_slices;
+		out.capacity = new_capacity;
+	}
+
+	out.slices[out.count++] = {.content = data, .size = size};
+	out.size += size;
+	return 1;
+}
+
+void output_rope_free(OutputRope& out)
+{
+	if (out.slices && !out.arena)
+		memory_free(out.slices);
+	out = {};
+}
+
+// C asks for at least 127
+constexpr u32 macro_max_parameters = 127;
+// Nested substitutions, arguments included
+constexpr u32 macro_max_depth = 64;
+// Names kept from being substituted again while a macro is substituted
+constexpr u32 macro_max_painted = 256;
+
+enum class MacroOpKind : u8 {
+	// Span of the body, as it is
+	Text,
+	// Argument with its macros substituted
+	Argument,
+	// Argument as it was written, for the operands of ##
+	RawArgument,
+	// #parameter
+	Stringize,
+	// ", ## __VA_ARGS__", whose comma goes away with an empty argument
+	VariadicComma,
+};
+
+struct MacroOp {
+	MacroOpKind kind;
+	// Joined to what comes before it by ##, so no space is put between them
+	bool pasted;
+	u32 parameter;
+	// Of Text, into the body
+	u32 offset;
+	u32 size;
+};
+
+struct MacroPlan {
+	const MacroOp* ops;
+	u32 ops_count;
+	u32 parameters_count;
+	// The last parameter takes all the arguments that are left
+	bool variadic;
+};
+
+// Point into the #define, only needed while its body is compiled
+struct MacroParameters {
+	const char* names[macro_max_parameters];
+	u32 sizes[macro_max_parameters];
+	u32 count;
+	bool variadic;
+};
+
+struct MacroArgument {
+	const char* content;
+	u64 size;
+};
+
+// Macros being substituted, which aren't substituted again in their own replacement
+struct ActiveMacros {
+	const Symbol* symbols[macro_max_depth];
+	u32 count;
+	// Arguments being substituted before they are put in a replacement
+	u32 arguments_depth;
+	// Replacements of function-like macros, the output references them
+	Arena* replacements;
+	// Names in the arguments and replacements built for the macro being
+	// substituted that were left as they are since their macro was active.
+	// They aren't substituted when they are rescanned either.
+	const char* painted[macro_max_painted];
+	u32 painted_count;
+	// Where the names left as they are go in the output of the arguments being substituted
+	u64 skipped[macro_max_painted];
+	u32 skipped_count;
+};
+
+// The text after a replacement that is being rescanned, a function-like macro
+// named at its very end takes its arguments from there
+struct MacroTail {
+	const char** cursor;
+	const char* end;
+	const MacroTail* parent;
+};
+
+bool is_macro_active(const ActiveMacros& active, const Symbol* symbol)
+{
+	for (u32 i = 0; i < active.count; i++)
+	{
+		if (active.symbols[i] == symbol)
+			return 1;
+	}
+
+	return 0;
+}
+
+bool is_macro_painted(const ActiveMacros& active, const char* name)
+{
+	for (u32 i = 0; i < active.painted_count; i++)
+	{
+		if (active.painted[i] == name)
+			return 1;
+	}
+
+	return 0;
+}
+
+void paint_macro_name(ActiveMacros& active, const char* name)
+{
+	if (active.painted_count == macro_max_painted)
+	{
+		wprintf(L"Too many macros named in their own replacement!\n");
+		return;
+	}
+	active.painted[active.painted_count++] = name;
+}
+
+// Painted names of text stay painted in its copy, unless ## joins them into another token
+void paint_macro_copy(ActiveMacros& active, const MacroArgument& text, const char* copy, const bool pasted_before, const bool pasted_after)
+{
+	const auto text_end = text.content + text.size;
+	const auto painted_count = active.painted_count;
+	for (u32 i = 0; i < painted_count; i++)
+	{
+		const auto name = active.painted[i];
+		if (name < text.content || name >= text_end || (pasted_before && name == text.content)) continue;
+		auto name_end = name + 1;
+		for (; name_end < text_end && is_identifier_char(*name_end); name_end++);
+		if (!(pasted_after && name_end == text_end))
+			paint_macro_name(active, copy + (name - text.content));
+	}
+}
+
+// c is on the opening quote, returns what comes after the closing one
+const char* skip_literal(const char* c, const char* end)
+{
+	const auto quote = *c;
+	for (c++; c < end && *c != quote && *c != '\n'; c++)
+	{
+		if (*c == '\\' && c + 1 < end)
+			c++;
+	}
+	return c < end && *c == quote ? c + 1 : c;
+}
+
+// Returns c when it isn't on a comment
+const char* skip_comment(const char* c, const char* end)
+{
+	if (*c != '/' || c + 1 == end)
+		return c;
+
+	if (c[1] == '/')
+	{
+		c = (const char*)memchr(c, '\n', end - c);
+		return c ? c : end;
+	}
+
+	if (c[1] == '*')
+	{
+		const auto comment_start = c + 2;
+		for (c = comment_start; c < end && !(*c == '/' && c > comment_start && c[-1] == '*'); c++);
+		return c < end ? c + 1 : c;
+	}
+	return c;
+}
+
+// Numbers like 0x1F, 1e10 or 1'000 have identifier characters in them
+const char* skip_number(const char* c, const char* end)
+{
+	for (c++; c < end && (is_identifier_char(*c) || *c == '.' || ((*c == '+' || *c == '-') && (c[-1] == 'e' || c[-1] == 'E' || c[-1] == 'p' || c[-1] == 'P')) || (*c == '\'' && c + 1 < end && is_identifier_char(c[1]))); c++);
+	return c;
+}
+
+// Blanks, newlines and comments, which may go between a macro name and its arguments
+const char* skip_macro_blanks(const char* c, const char* end)
+{
+	while (c < end)
+	{
+		if (is_blank(*c) || *c == '\n' || (*c == '\\' && c + 1 < end && c[1] == '\n'))
+		{
+			c += *c == '\\' ? 2 : 1;
+			continue;
+		}
+		const auto comment_end = skip_comment(c, end);
+		if (comment_end == c) break;
+		c = comment_end;
+	}
+	return c;
+}
+
+// Returns the next identifier that isn't in a comment, a literal or a number
+// and leaves c after it, or returns 0 at the end
+const char* next_identifier(const char*& c, const char* end)
+{
+	while (c < end)
+	{
+		if (*c == '/')
+		{
+			const auto comment_end = skip_comment(c, end);
+			c = comment_end != c ? comment_end : c + 1;
+			continue;
+		}
+
+		if (*c == '"' || *c == '\'')
+		{
+			c = skip_literal(c, end);
+			continue;
+		}
+
+		if (*c >= '0' && *c <= '9')
+		{
+			c = skip_number(c, end);
+			continue;
+		}
+
+		if (!is_identifier_start(*c))
+		{
+			c++;
+			continue;
+		}
+
+		const auto name = c;
+		for (c++; c < end && is_identifier_char(*c); c++);
+		return name;
+	}
+
+	return 0;
+}
+
+const char* skip_define_blanks(const char* c, const char* end)
+{
+	for (; c < end && (is_blank(*c) || (*c == '\\' && c + 1 < end && c[1] == '\n')); c += *c == '\\' ? 2 : 1);
+	return c;
+}
+
+// Parses the parameters of a function-like #define, c is on their ( and ends up after their )
+bool parse_macro_parameters(MacroParameters& parameters, const char*& c, const char* line_end)
+{
+	parameters.count = 0;
+	parameters.variadic = 0;
+	c = skip_define_blanks(c + 1, line_end);
+	if (c < line_end && *c == ')')
+	{
+		c++;
+		return 1;
+	}
+
+	while (true)
+	{
+		if (parameters.count == macro_max_parameters)
+		{
+			wprintf(L"Too many parameters of #define statement\n");
+			return 0;
+		}
+
+		auto& name = parameters.names[parameters.count];
+		auto& name_size = parameters.sizes[parameters.count];
+		if (c + 3 <= line_end && memcmp(c, "...", 3) == 0)
+		{
+			name = "__VA_ARGS__";
+			name_size = 11;
+			parameters.variadic = 1;
+			c += 3;
+		}
+		else if (c < line_end && is_identifier_start(*c))
+		{
+			// "name..." is how GNU names the variadic arguments
+			name = c;
+			for (c++; c < line_end && is_identifier_char(*c); c++);
+			name_size = (u32)(c - name);
+			c = skip_define_blanks(c, line_end);
+			if (c + 3 <= line_end && memcmp(c, "...", 3) == 0)
+			{
+				parameters.variadic = 1;
+				c += 3;
+			}
+		}
+		else
+			break;
+		parameters.count++;
+
+		c = skip_define_blanks(c, line_end);
+		if (c < line_end && *c == ')')
+		{
+			c++;
+			return 1;
+		}
+		if (parameters.variadic || c == line_end || *c != ',')
+			break;
+		c = skip_define_blanks(c + 1, line_end);
+	}
+
+	wprintf(L"Invalid parameter list of #define statement\n");
+	return 0;
+}
+
+// parameters.count when name isn't one of them
+u32 find_macro_parameter(const MacroParameters& parameters, const char* name, const u32 name_size)
+{
+	u32 i = 0;
+	for (; i < parameters.count && !(parameters.sizes[i] == name_size && memcmp(parameters.names[i], name, name_size) == 0); i++);
+	return i;
+}
+
+// Compiles the body of a function-like macro into the ops of its plan. The
+// blanks around ## are dropped here, so invocations never look for them.
+bool compile_macro_plan(const MacroPlan*& plan, Arena& arena, const MacroParameters& parameters, const char* body, const u64 body_size)
+{
+	MacroOp* ops = 0;
+	u32 ops_count = 0;
+	u32 ops_capacity = 0;
+	// Next op is joined to the previous one by ##
+	bool paste = 0;
+	const auto push_op = [&](MacroOp op) {
+		if (ops_count == ops_capacity)
+		{
+			const auto new_capacity = ops_capacity ? ops_capacity * 2 : 8;
+			const auto new_ops = (MacroOp*)arena_realloc(arena, ops, ops_count * sizeof(MacroOp), new_capacity * sizeof(MacroOp));
+			if (!new_ops)
+			{
+				wprintf(L"Failed to allocate memory!\n");
+				return 0;
+			}
+			ops = new_ops;
+			ops_capacity = new_capacity;
+		}
+		op.pasted = paste;
+		ops[ops_count++] = op;
+		paste = 0;
+		return 1;
+	};
+
+	const auto end = body + body_size;
+	// Start of the span that isn't in an op yet
+	auto text = body;
+	const auto push_text = [&](const char* text_end) {
+		return text_end == text || push_op({.kind = MacroOpKind::Text, .offset = (u32)(text - body), .size = (u32)(text_end - text)});
+	};
+
+	auto c = body;
+	while (c < end)
+	{
+		if (*c == '"' || *c == '\'')
+		{
+			c = skip_literal(c, end);
+			continue;
+		}
+
+		if (*c >= '0' && *c <= '9')
+		{
+			c = skip_number(c, end);
+			continue;
+		}
+
+		if (*c == '#' && c + 1 < end && c[1] == '#')
+		{
+			auto text_end = c;
+			for (; text_end > text && is_blank(text_end[-1]); text_end--);
+			if (text_end == body)
+			{
+				wprintf(L"## can't be at either end of a macro\n");
+				return 0;
+			}
+			// An argument right before it is pasted as it was written
+			if (text_end == text && ops_count && ops[ops_count - 1].kind == MacroOpKind::Argument)
+				ops[ops_count - 1].kind = MacroOpKind::RawArgument;
+			if (!push_text(text_end))
+				return 0;
+
+			for (c += 2; c < end && is_blank(*c); c++);
+			text = c;
+			paste = 1;
+			if (c == end)
+			{
+				wprintf(L"## can't be at either end of a macro\n");
+				return 0;
+			}
+
+			// GNU's ", ## __VA_ARGS__"
+			auto name_end = c;
+			for (; name_end < end && is_identifier_char(*name_end); name_end++);
+			const auto parameter = find_macro_parameter(parameters, c, (u32)(name_end - c));
+			const auto last = &ops[ops_count - 1];
+			if (parameters.variadic && parameter == parameters.count - 1 && last->kind == MacroOpKind::Text && body[last->offset + last->size - 1] == ',')
+			{
+				if (!--last->size)
+					ops_count--;
+				paste = 0;
+				if (!push_op({.kind = MacroOpKind::VariadicComma, .parameter = parameter}))
+					return 0;
+				c = name_end;
+				text = c;
+			}
+			continue;
+		}
+
+		if (*c == '#')
+		{
+			const auto name = skip_define_blanks(c + 1, end);
+			auto name_end = name;
+			for (; name_end < end && is_identifier_char(*name_end); name_end++);
+			const auto parameter = find_macro_parameter(parameters, name, (u32)(name_end - name));
+			if (name == name_end || parameter == parameters.count)
+			{
+				wprintf(L"# isn't followed by a macro parameter\n");
+				return 0;
+			}
+
+			if (!push_text(c) || !push_op({.kind = MacroOpKind::Stringize, .parameter = parameter}))
+				return 0;
+			c = name_end;
+			text = c;
+			continue;
+		}
+
+		if (!is_identifier_start(*c))
+		{
+			c++;
+			continue;
+		}
+
+		const auto name = c;
+		for (c++; c < end && is_identifier_char(*c); c++);
+		const auto parameter = find_macro_parameter(parameters, name, (u32)(c - name));
+		if (parameter == parameters.count) continue;
+
+		// Operands of ## aren't substituted
+		auto next = c;
+		for (; next < end && is_blank(*next); next++);
+		const auto raw = paste || (next + 1 < end && next[0] == '#' && next[1] == '#');
+		if (!push_text(name) || !push_op({.kind = raw ? MacroOpKind::RawArgument : MacroOpKind::Argument, .parameter = parameter}))
+			return 0;
+		text = c;
+	}
+
+	if (!push_text(end))
+		return 0;
+
+	const auto new_plan = (MacroPlan*)arena_alloc(arena, sizeof(MacroPlan));
+	if (!new_plan)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+	*new_plan = {.ops = ops, .ops_count = ops_count, .parameters_count = parameters.count, .variadic = parameters.variadic};
+	plan = new_plan;
+	return 1;
+}
+
+MacroArgument trim_macro_argument(const char* begin, const char* end)
+{
+	begin = skip_macro_blanks(begin, end);
+	for (; end > begin && (is_blank(end[-1]) || end[-1] == '\n' || end[-1] == '\\'); end--);
+	return {.content = begin, .size = (u64)(end - begin)};
+}
+
+// Returns the ) that closes the arguments of an invocation, or end when they go
+// on past it. depth is how many of their ( are open, the first one included.
+const char* find_macro_arguments_end(const char* p, const char* end, u32& depth)
+{
+	while (p < end)
+	{
+		const auto comment_end = skip_comment(p, end);
+		if (comment_end != p)
+			p = comment_end;
+		else if (*p == '"' || *p == '\'')
+			p = skip_literal(p, end);
+		else if (*p >= '0' && *p <= '9')
+			p = skip_number(p, end);
+		else if (*p == '(')
+		{
+			depth++;
+			p++;
+		}
+		else if (*p == ')' && !--depth)
+			return p;
+		else
+			p++;
+	}
+	return end;
+}
+
+// Splits the arguments of an invocation, c is on their ( and ends up after
+// their ). Fails when they don't end before end or don't fit the parameters.
+bool collect_macro_arguments(MacroArgument* arguments, const Symbol& symbol, const char*& c, const char* end)
+{
+	const auto& plan = *symbol.plan;
+	u32 count = 0;
+	u32 depth = 0;
+	auto argument = c + 1;
+	auto p = c + 1;
+	while (true)
+	{
+		if (p == end)
+		{
+			wprintf(L"Unterminated arguments of macro \"%.*hs\"!\n", (int)symbol.name_size, symbol.name);
+			return 0;
+		}
+
+		const auto comment_end = skip_comment(p, end);
+		if (comment_end != p)
+		{
+			p = comment_end;
+			continue;
+		}
+		if (*p == '"' || *p == '\'')
+		{
+			p = skip_literal(p, end);
+			continue;
+		}
+		if (*p >= '0' && *p <= '9')
+		{
+			p = skip_number(p, end);
+			continue;
+		}
+
+		if (*p == '(')
+			depth++;
+		else if (*p == ')' && depth)
+			depth--;
+		// The commas that are left go in the variadic argument
+		else if (*p == ')' || (*p == ',' && !depth && !(plan.variadic && count + 1 >= plan.parameters_count)))
+		{
+			if (count < macro_max_parameters)
+				arguments[count] = trim_macro_argument(argument, p);
+			count++;
+			argument = p + 1;
+			if (*p == ')') break;
+		}
+		p++;
+	}
+
+	// "()" is an empty argument, or none at all without parameters
+	if (count == 1 && !arguments[0].size && !plan.parameters_count)
+		count = 0;
+	// The variadic argument may be left out
+	if (plan.variadic && count + 1 == plan.parameters_count)
+		arguments[count++] = {.content = p, .size = 0};
+	if (count != plan.parameters_count)
+	{
+		wprintf(L"Macro \"%.*hs\" takes %u arguments, not %u!\n", (int)symbol.name_size, symbol.name, plan.parameters_count, count);
+		return 0;
+	}
+
+	c = p + 1;
+	return 1;
+}
+
+bool substitute_macros(OutputRope& out, const SymbolTable& symbols, ActiveMacros& active, const char* text, const u64 size, const MacroTail* tail);
+
+// Whether substitute_macros would leave text as it is
+bool has_macros(const SymbolTable& symbols, const ActiveMacros& active, const char* text, const u64 size)
+{
+	const auto end = text + size;
+	auto c = text;
+	while (const auto name = next_identifier(c, end))
+	{
+		const auto symbol = symbol_table_find(symbols, name, (u32)(c - name));
+		if (symbol && !is_macro_active(active, symbol) && !is_macro_painted(active, name))
+			return 1;
+	}
+	return 0;
+}
+
+// Arguments are substituted on their own, before they are put in the replacement
+bool substitute_macro_argument(MacroArgument& expanded, const SymbolTable& symbols, ActiveMacros& active, const MacroArgument& argument)
+{
+	expanded = argument;
+	if (!symbols.defined_count || !has_macros(symbols, active, argument.content, argument.size))
+		return 1;
+	if (active.arguments_depth == macro_max_depth)
+	{
+		wprintf(L"Macro substitution too deep!\n");
+		return 1;
+	}
+
+	OutputRope rope = {};
+	const auto skipped_start = active.skipped_count;
+	active.arguments_depth++;
+	const auto substituted = substitute_macros(rope, symbols, active, argument.content, argument.size, 0);
+	active.arguments_depth--;
+	const auto content = substituted ? (char*)arena_alloc(*active.replacements, rope.size) : 0;
+	if (content)
+	{
+		auto size = 0ull;
+		for (u64 i = 0; i < rope.count; i++)
+		{
+			memcpy(content + size, rope.slices[i].content, rope.slices[i].size);
+			size += rope.slices[i].size;
+		}
+		expanded = {.content = content, .size = size};
+		for (u32 i = skipped_start; i < active.skipped_count; i++)
+			paint_macro_name(active, content + active.skipped[i]);
+	}
+	else if (substituted)
+		wprintf(L"Failed to allocate memory!\n");
+	active.skipped_count = skipped_start;
+	output_rope_free(rope);
+	return content != 0;
+}
+
+// Whether a and b next to each other would be read as one token
+bool would_merge(const char a, const char b)
+{
+	if (is_identifier_char(a))
+		return is_identifier_char(b);
+	return a && b && strchr("+-*/%<>=&|^!:#.", a) && strchr("+-*/%<>=&|^!:#.", b);
+}
+
+// #argument, with the blanks and comments between its tokens made one space
+// and the quotes and backslashes of its literals escaped
+u64 stringize_macro_argument(char* out, const MacroArgument& argument)
+{
+	auto o = out;
+	*o++ = '"';
+	const auto end = argument.content + argument.size;
+	auto c = argument.content;
+	while (c < end)
+	{
+		const auto token = skip_macro_blanks(c, end);
+		if (token != c)
+		{
+			*o++ = ' ';
+			c = token;
+			continue;
+		}
+
+		if (*c == '"' || *c == '\'')
+		{
+			for (const auto literal_end = skip_literal(c, end); c < literal_end; c++)
+			{
+				if (*c == '"' || *c == '\\')
+					*o++ = '\\';
+				*o++ = *c;
+			}
+			continue;
+		}
+		*o++ = *c++;
+	}
+	*o++ = '"';
+	return o - out;
+}
+
+// Replays the plan of a function-like macro on the arguments of an invocation
+bool build_macro_replacement(MacroArgument& replacement, const SymbolTable& symbols, ActiveMacros& active, const Symbol& symbol, const MacroArgument* arguments)
+{
+	const auto& plan = *symbol.plan;
+	MacroArgument expanded[macro_max_parameters];
+	bool is_expanded[macro_max_parameters];
+	memset(is_expanded, 0, plan.parameters_count);
+
+	// Room for the spaces that keep tokens apart too
+	u64 capacity = 0;
+	for (u32 i = 0; i < plan.ops_count; i++)
+	{
+		const auto& op = plan.ops[i];
+		const auto& argument = arguments[op.parameter];
+		switch (op.kind)
+		{
+			case MacroOpKind::Text: capacity += op.size + 1; break;
+			case MacroOpKind::Argument:
+				if (!is_expanded[op.parameter])
+				{
+					if (!substitute_macro_argument(expanded[op.parameter], symbols, active, argument))
+						return 0;
+					is_expanded[op.parameter] = 1;
+				}
+				capacity += expanded[op.parameter].size + 1;
+				break;
+			case MacroOpKind::RawArgument: capacity += argument.size + 1; break;
+			case MacroOpKind::Stringize: capacity += argument.size * 2 + 3; break;
+			case MacroOpKind::VariadicComma: capacity += argument.size + 2; break;
+		}
+	}
+
+	const auto content = (char*)arena_alloc(*active.replacements, capacity);
+	if (!content)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	u64 size = 0;
+	for (u32 i = 0; i < plan.ops_count; i++)
+	{
+		const auto& op = plan.ops[i];
+		MacroArgument piece = {};
+		switch (op.kind)
+		{
+			case MacroOpKind::Text: piece = {.content = symbol.value + op.offset, .size = op.size}; break;
+			case MacroOpKind::Argument: piece = expanded[op.parameter]; break;
+			case MacroOpKind::RawArgument: piece = arguments[op.parameter]; break;
+			case MacroOpKind::Stringize:
+				if (!op.pasted && size && would_merge(content[size - 1], '"'))
+					content[size++] = ' ';
+				size += stringize_macro_argument(content + size, arguments[op.parameter]);
+				continue;
+			case MacroOpKind::VariadicComma:
+				if (!arguments[op.parameter].size) continue;
+				content[size++] = ',';
+				piece = arguments[op.parameter];
+				break;
+		}
+		if (!piece.size) continue;
+
+		if (!op.pasted && size && would_merge(content[size - 1], piece.content[0]))
+			content[size++] = ' ';
+		memcpy(content + size, piece.content, piece.size);
+		if (active.painted_count)
+			paint_macro_copy(active, piece, content + size, op.pasted, i + 1 < plan.ops_count && plan.ops[i + 1].pasted);
+		size += piece.size;
+	}
+
+	// Gives back what the spaces didn't take
+	arena_realloc(*active.replacements, content, capacity, size);
+	replacement = {.content = content, .size = size};
+	return 1;
+}
+
+// Copies arguments that go on past the end of the text they start in into one
+// piece. tail is the text after that one, the arguments end in it or in one
+// of its parents. last is left 0 when they don't end anywhere.
+bool join_macro_arguments(MacroArgument& joined, const MacroTail*& last, const char*& last_end, ActiveMacros& active, const MacroArgument& start, const MacroTail* tail, u32 depth)
+{
+	last = tail;
+	for (; last; last = last->parent)
+	{
+		last_end = find_macro_arguments_end(*last->cursor, last->end, depth);
+		if (last_end != last->end) break;
+	}
+	if (!last)
+		return 1;
+
+	auto size = start.size;
+	for (auto outer = tail; outer != last->parent; outer = outer->parent)
+		size += (outer == last ? last_end + 1 : outer->end) - *outer->cursor;
+	const auto content = (char*)arena_alloc(*active.replacements, size);
+	if (!content)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	joined = {.content = content, .size = 0};
+	auto piece = start;
+	for (auto outer = tail; ; outer = outer->parent)
+	{
+		memcpy(content + joined.size, piece.content, piece.size);
+		if (active.painted_count)
+			paint_macro_copy(active, piece, content + joined.size, 0, 0);
+		joined.size += piece.size;
+		if (outer == last->parent) break;
+		piece = {.content = *outer->cursor, .size = (u64)((outer == last ? last_end + 1 : outer->end) - *outer->cursor)};
+	}
+	return 1;
+}
+
+// Substitutes an invocation of a function-like macro whose name ends at c.
+// Without a ( after the name, which may be after the end of the replacement
+// the name is in, it isn't one and invoked is left 0. Its arguments may go on
+// in the text of the callers after that.
+bool substitute_macro_invocation(OutputRope& out, bool& invoked, const SymbolTable& symbols, ActiveMacros& active, const Symbol& symbol, const char*& c, const char* end, const MacroTail* tail)
+{
+	invoked = 0;
+	auto cursor = &c;
+	auto arguments_end = end;
+	auto arguments_start = skip_macro_blanks(c, end);
+	auto outer = tail;
+	// Replacements the arguments come after, each one is the text of the innermost active macro
+	u32 finished = 0;
+	for (; arguments_start == arguments_end && outer; outer = outer->parent)
+	{
+		cursor = outer->cursor;
+		arguments_end = outer->end;
+		arguments_start = skip_macro_blanks(*cursor, arguments_end);
+		finished++;
+	}
+	if (arguments_start == arguments_end || *arguments_start != '(')
+		return 1;
+
+	// Unterminated ones are reported by collect_macro_arguments
+	MacroArgument joined = {};
+	const MacroTail* last = 0;
+	const char* last_end = 0;
+	u32 depth = 0;
+	if (outer && find_macro_arguments_end(arguments_start, arguments_end, depth) == arguments_end &&
+		!join_macro_arguments(joined, last, last_end, active, {.content = arguments_start, .size = (u64)(arguments_end - arguments_start)}, outer, depth))
+		return 0;
+
+	MacroArgument arguments[macro_max_parameters];
+	MacroArgument replacement;
+	auto arguments_text = last ? joined.content : arguments_start;
+	if (!collect_macro_arguments(arguments, symbol, arguments_text, last ? joined.content + joined.size : arguments_end))
+		return 1;
+	if (last)
+	{
+		*cursor = arguments_end;
+		for (finished++; outer != last; outer = outer->parent, finished++)
+			*outer->cursor = outer->end;
+		*last->cursor = last_end + 1;
+	}
+	else
+		*cursor = arguments_text;
+	invoked = 1;
+
+	// The macros of the replacements that are over can be substituted again
+	const Symbol* finished_symbols[macro_max_depth];
+	active.count -= finished;
+	memcpy(finished_symbols, active.symbols + active.count, finished * sizeof(Symbol*));
+
+	auto substituted = build_macro_replacement(replacement, symbols, active, symbol, arguments);
+	if (substituted)
+	{
+		active.symbols[active.count++] = &symbol;
+		const MacroTail rest = {.cursor = &c, .end = end, .parent = tail};
+		substituted = substitute_macros(out, symbols, active, replacement.content, replacement.size, &rest);
+		active.count--;
+	}
+	memcpy(active.symbols + active.count, finished_symbols, finished * sizeof(Symbol*));
+	active.count += finished;
+	return substituted;
+}
+
+// Appends text to out while substituting every defined identifier outside of
+// comments and literals, replacements are rescanned. Text without any macro
+// in it ends up as a single slice. tail is what comes after text when it's
+// a replacement itself.
+bool substitute_macros(OutputRope& out, const SymbolTable& symbols, ActiveMacros& active, const char* text, const u64 size, const MacroTail* tail)
+{
+	if (!symbols.defined_count)
+		return output_rope_append(out, text, size);
+
+	const auto end = text + size;
+	// Start of the text that isn't appended yet
+	auto pending = text;
+	auto c = text;
+	while (const auto name = next_identifier(c, end))
+	{
+		const auto symbol = symbol_table_find(symbols, name, (u32)(c - name));
+		if (!symbol) continue;
+		if (is_macro_active(active, symbol) || is_macro_painted(active, name))
+		{
+			// Stays as it is in the output of the argument, which is rescanned in the replacement
+			if (active.arguments_depth && active.skipped_count == macro_max_painted)
+				wprintf(L"Too many macros named in their own replacement!\n");
+			else if (active.arguments_depth)
+				active.skipped[active.skipped_count++] = out.size + (name - pending);
+			continue;
+		}
+		if (active.count == COUNTOF(active.symbols))
+		{
+			wprintf(L"Macro substitution too deep!\n");
+			continue;
+		}
+
+		if (symbol->plan)
+		{
+			// The arguments may be taken from the text of the callers, which
+			// moves their cursors, so what's before the name goes out first
+			if (!output_rope_append(out, pending, name - pending))
+				return 0;
+			pending = name;
+
+			bool invoked;
+			if (!substitute_macro_invocation(out, invoked, symbols, active, *symbol, c, end, tail))
+				return 0;
+			if (invoked)
+				pending = c;
+			// The names painted for it are behind
+			if (!active.count && !active.arguments_depth)
+				active.painted_count = 0;
+			continue;
+		}
+
+		if (!output_rope_append(out, pending, name - pending))
+			return 0;
+
+		active.symbols[active.count++] = symbol;
+		const MacroTail rest = {.cursor = &c, .end = end, .parent = tail};
+		const auto substituted = substitute_macros(out, symbols, active, symbol->value, symbol->value_size, &rest);
+		active.count--;
+		if (!substituted)
+			return 0;
+		pending = c;
+		if (!active.count && !active.arguments_depth)
+			active.painted_count = 0;
+	}
+
+	return output_rope_append(out, pending, end - pending);
+}
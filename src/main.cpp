@@ -1,24 +1,44 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <limits>
+#include <assert.h>
+#include <atomic>
+#ifdef _WIN32
 #include <io.h>
 #include <fcntl.h>
-#include <assert.h>
+#include <locale.h>
+#endif
 
 #include "wcslcpy.cpp"
 #include "wcslcat.cpp"
+#include "strlcpy.cpp"
+#include "strlcat.cpp"
 
 typedef int64_t i64;
 typedef uint64_t u64;
+typedef uint32_t u32;
+typedef uint16_t u16;
+typedef uint8_t u8;
 
 #include "utils.h"
 
+#ifdef _WIN32
 #include "windows_framework.h"
 #include <Shlwapi.h>
+#else
+#include "posix_framework.h"
+#endif
 
+#include "memory.cpp"
+#include "thread_pool.cpp"
 #include "nice_wprintf.cpp"
+#include "utf8.cpp"
+#include "stats.cpp"
+#include "trace.cpp"
 
+#ifdef _WIN32
 HANDLE g_conout;
+#endif
 
 struct Buffer {
 	char* content;
@@ -26,271 +46,1069 @@ struct Buffer {
 };
 
 #include "args_parser.cpp"
+#include "line_endings.cpp"
 #include "file_utils.cpp"
+#include "hash.cpp"
+#include "path_pool.cpp"
+#include "directive_index.cpp"
+#include "symbol_table.cpp"
+#include "macro_expander.cpp"
+#include "conditional_expression.cpp"
+#include "manifest.cpp"
+#include "watch.cpp"
+#include "include_cache.cpp"
+#include "include_resolver.cpp"
+#include "header_snapshots.cpp"
+#include "include_expander.cpp"
+#include "stream_expander.cpp"
+#include "directory_walker.cpp"
+#include "io_ring.cpp"
+
+const char* get_last_slash(const char* path)
+{
+	const char* last_slash = 0;
+	for (auto c = path; *c; c++)
+	{
+		if (*c == '\\' || *c == '/')
+			last_slash = c;
+	}
 
-struct IncludeStatement {
-	char* start_location;
-	char* end_location;
-	wchar_t file_path[64];
-	Buffer file_buffer;
-};
+	return last_slash;
+}
+
+const char* get_rel_path(const char* abs_path, const char* curr_dir)
+{
+	const char* result = abs_path;
 
-struct DefineStatement {
-	char* start_location;
-	char* end_location;
-	Buffer token;
-	Buffer replace;
+	for (auto c = curr_dir; *c; c++)
+		if (*c != *result++) return abs_path;
+
+	return result;
+}
+
+enum class CanonicalSelectorResult {
+	None, File, Directory, Files
 };
 
-const wchar_t* get_last_slash(const wchar_t* path)
+CanonicalSelectorResult get_canonical_selector(char* dest, const size_t dest_size, const char* src, const bool check_for_star)
 {
-	const wchar_t* last_slash = 0;
-	for (auto c = path; *c; c++)
+	const auto file_too_large_error = []() {
+		wprintf(L"File path is too large!\n");
+		return CanonicalSelectorResult::None;
+	};
+
+	char* abs_path_file_part;
+	char abs_path[max_path_size];
+	if (!get_full_path_name(abs_path, sizeof(abs_path), src, &abs_path_file_part))
+		return file_too_large_error();
+
+	char current_dir[max_path_size];
+	if (!get_current_directory(current_dir, sizeof(current_dir)))
+		return file_too_large_error();
+
+	if (strlcat(current_dir, PATH_SEPARATOR, sizeof(current_dir)) >= sizeof(current_dir))
+		return file_too_large_error();
+
+	const auto rel_path = get_rel_path(abs_path, current_dir);
+	if (strlcpy(dest, rel_path, dest_size) >= dest_size)
+		return file_too_large_error();
+
+	if (is_directory(dest))
 	{
-		if (*c == L'\\' || *c == L'/')
-			last_slash = c;
+		if (abs_path_file_part)
+		{
+			if (strlcat(dest, PATH_SEPARATOR, dest_size) >= dest_size)
+				return file_too_large_error();
+		}
+		if (strlcat(dest, "*", dest_size) >= dest_size)
+			return file_too_large_error();
+		return CanonicalSelectorResult::Directory;
 	}
+	else
+	{
+		if (abs_path_file_part && check_for_star && strchr(abs_path_file_part, '*'))
+			return CanonicalSelectorResult::Files;
+		return CanonicalSelectorResult::File;
+	}
+}
 
-	return last_slash;
+bool get_path_dir(char* dest, size_t dest_size, const char* src)
+{
+	const auto src_last_slash = get_last_slash(src);
+	if (src_last_slash)
+	{
+		const size_t size = src_last_slash - src + 1;
+		if (size >= dest_size)
+		{
+			wprintf(L"File path is too large!\n");
+			return 0;
+		}
+		strlcpy(dest, src, size+1);
+	}
+	else
+		dest[0] = 0;
+
+	return 1;
 }
 
-const u64 process_define(DefineStatement& define, const Buffer& in_file_buffer)
+bool get_parent_path_dir(char* dest, size_t dest_size, const char* src)
 {
-	const auto statement = "#define ";
-	const auto statement_start = strstr(in_file_buffer.content, statement);
-	if (!statement_start) return 0;
+	const auto src_last_slash = get_last_slash(src);
+	if (src_last_slash)
+	{
+		const size_t size = src_last_slash - src;
+		if (size >= dest_size)
+		{
+			wprintf(L"File path is too large!\n");
+			return 0;
+		}
+		strlcpy(dest, src, size+1);
+	}
+	else
+		dest[0] = 0;
 
-	const auto statement_end = statement_start + COUNTOF(statement) - 1;
+	return 1;
+}
+
+struct FileJob {
+	// Both relative to the current directory, as given
+	PathId in_file_path;
+	PathId out_file_path;
+	// Absolute with a trailing separator, where its quoted includes are looked up first
+	PathId in_file_dir;
+	u64 size;
+	// Its output is kept as it is in --incremental mode
+	bool up_to_date;
+};
 
-	auto statement_arg1_start = statement_end + 1;
-	for (; *statement_arg1_start == ' '; statement_arg1_start++);
-	if (!isalnum(*statement_arg1_start))
+struct FileJobs {
+	FileJob* jobs;
+	u32 count;
+	u32 capacity;
+};
+
+bool file_jobs_push(FileJobs& file_jobs, const FileJob& job)
+{
+	if (file_jobs.count == file_jobs.capacity)
 	{
-		wprintf(L"First argument of #define isn't alphanumeric\n");
-		return 0;
+		const auto new_capacity = file_jobs.capacity ? file_jobs.capacity * 2 : 256;
+		const auto new_jobs = (FileJob*)memory_alloc(new_capacity * sizeof(FileJob));
+		if (!new_jobs)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+
+		if (file_jobs.jobs)
+		{
+			memcpy(new_jobs, file_jobs.jobs, file_jobs.count * sizeof(FileJob));
+			memory_free(file_jobs.jobs);
+		}
+		file_jobs.jobs = new_jobs;
+		file_jobs.capacity = new_capacity;
 	}
 
-	auto statement_arg1_end = statement_arg1_start + 1;
-	for (; isalnum(*statement_arg1_end); statement_arg1_end++);
-	if (*statement_arg1_end != ' ')
+	file_jobs.jobs[file_jobs.count++] = job;
+	return 1;
+}
+
+void file_jobs_free(FileJobs& file_jobs)
+{
+	if (file_jobs.jobs)
+		memory_free(file_jobs.jobs);
+	file_jobs = {};
+}
+
+// Returns the job indices (u32) ordered from the largest to the smallest file
+OwnedBuffer file_jobs_sort_by_size(const FileJobs& file_jobs)
+{
+	struct SizeIndex {
+		u64 size;
+		u32 index;
+	};
+
+	if (!file_jobs.count) return {};
+
+	// An even number of items keeps the size indices after them aligned
+	const auto items_capacity = (file_jobs.count + 1) & ~1u;
+	OwnedBuffer memory((char*)memory_alloc(items_capacity * sizeof(u32) + file_jobs.count * sizeof(SizeIndex)), file_jobs.count * sizeof(u32));
+	if (!memory.content)
 	{
-		wprintf(L"Couldn't find second argument of #include statement\n");
-		return 0;
+		wprintf(L"Failed to allocate memory!\n");
+		return {};
 	}
 
-	auto statement_arg2_start = statement_arg1_end;
-	for (; *statement_arg2_start == ' '; statement_arg2_start++);
-	if (!isalnum(*statement_arg2_start))
+	const auto items = (u32*)memory.content;
+	const auto size_indices = (SizeIndex*)(items + items_capacity);
+	for (u32 i = 0; i < file_jobs.count; i++)
+		size_indices[i] = {.size = file_jobs.jobs[i].size, .index = i};
+
+	qsort(size_indices, file_jobs.count, sizeof(SizeIndex), [](const void* a, const void* b) {
+		const auto size_a = ((const SizeIndex*)a)->size;
+		const auto size_b = ((const SizeIndex*)b)->size;
+		return size_a < size_b ? 1 : size_a > size_b ? -1 : 0;
+	});
+
+	for (u32 i = 0; i < file_jobs.count; i++)
+		items[i] = size_indices[i].index;
+
+	return memory;
+}
+
+// Inputs of a written output, for the manifest
+struct JobResult {
+	Dependency* dependencies;
+	u32 dependencies_count;
+	u64 out_size;
+	bool written;
+};
+
+enum class PrefetchState : u8 {
+	None, InFlight, Done,
+	// Its job started, whoever completes the read frees the buffer
+	Taken,
+};
+
+// Input of a job read ahead by the ring of the worker that expected to take it
+struct InputPrefetch {
+	std::atomic<PrefetchState> state;
+	u32 worker_index;
+	IoFileRequest request;
+};
+
+struct ProcessContext {
+	const FileJob* jobs;
+	u32 jobs_count;
+	IncludeCache* include_cache;
+	IncludeResolver* include_resolver;
+	// Where the output "-" is written, the stdout the process started with
+	FileHandle stdout_handle;
+	// One per worker, reset after every job
+	Arena* arenas;
+	// One per job, only with --incremental or --watch
+	JobResult* results;
+	// One per job, only with --stats
+	FileStats* stats;
+	// One per worker, only with --trace
+	TraceBuffer* traces;
+	// One per worker, only with --io-uring where the kernel has it
+	IoRing* rings;
+	// One per job, along with the rings
+	InputPrefetch* prefetches;
+	std::atomic<u32> jobs_started;
+	std::atomic<u32> jobs_written;
+	// Outputs --restat left untouched, they aren't counted as written
+	std::atomic<u32> jobs_unchanged;
+	bool restat;
+	// Only with --header-cache, saved to header_cache_path after every run
+	HeaderSnapshots* snapshots;
+	const char* header_cache_path;
+};
+
+// Keeps the inputs of a job past the reset of its arena, replacing the ones of its last run
+bool save_job_result(JobResult& result, const Dependencies& dependencies, const u64 out_size)
+{
+	const auto new_dependencies = (Dependency*)memory_alloc(dependencies.count * sizeof(Dependency));
+	if (!new_dependencies)
 	{
-		wprintf(L"Second argument of #define isn't alphanumeric\n");
+		wprintf(L"Failed to allocate memory!\n");
 		return 0;
 	}
 
-	auto statement_arg2_end = statement_arg2_start + 1;
-	for (; isalnum(*statement_arg2_end); statement_arg2_end++);
+	memory_free(result.dependencies);
+	result.dependencies = new_dependencies;
+	memcpy(result.dependencies, dependencies.items, dependencies.count * sizeof(Dependency));
+	result.dependencies_count = dependencies.count;
+	result.out_size = out_size;
+	result.written = 1;
+	return 1;
+}
 
-	define.start_location = statement_start;
-	define.end_location = statement_arg2_end - 1;
+void on_input_read(IoFileRequest* request, void* user)
+{
+	auto& prefetch = ((ProcessContext*)user)->prefetches[request->item];
+	auto expected = PrefetchState::InFlight;
+	// Its job was stolen by another worker, which mapped the input itself
+	if (!prefetch.state.compare_exchange_strong(expected, PrefetchState::Done))
+		memory_free(request->buffer);
+}
 
-	define.token = {statement_arg1_start, (u64)(statement_arg1_end - statement_arg1_start)};
-	define.replace = {statement_arg2_start, (u64)(statement_arg2_end - statement_arg2_start)};
+void on_output_written(IoFileRequest* request, void* user)
+{
+	auto& context = *(ProcessContext*)user;
+	bool written = request->result == (i64)request->size;
+	if (written)
+		log_verbose(L"Successfuly wrote to file \"%hs\"\n", request->path);
+	else
+	{
+		// Written again without the ring, which also reports why it fails
+		const auto file_handle = create_wo_file(request->path);
+		if (file_handle != invalid_file_handle)
+		{
+			written = write_file(file_handle, request->path, {.content = request->buffer, .size = request->size});
+			close_file(file_handle);
+		}
+	}
 
-	return in_file_buffer.size - (statement_arg2_end - in_file_buffer.content) + (statement_start - in_file_buffer.content);
+	if (written)
+		context.jobs_written++;
+	else if (context.results)
+		context.results[request->item].written = 0;
+	memory_free(request);
 }
 
-const u64 process_include(IncludeStatement& include, const Buffer& in_file_buffer)
+// Reads the inputs of the next jobs of this worker on its ring while this one is expanded
+void prefetch_inputs(ProcessContext& context, const u32 worker_index)
 {
-	const auto statement = "#include ";
-	const auto statement_start = strstr(in_file_buffer.content, statement);
-	if (!statement_start) return 0;
+	auto& ring = context.rings[worker_index];
+	io_ring_reap(ring, 0, &context);
 
-	const auto statement_end = statement_start + COUNTOF(statement) - 1;
+	u32 items[8];
+	const auto items_count = work_queue_peek(items, COUNTOF(items));
+	for (u32 i = 0; i < items_count; i++)
+	{
+		const auto& job = context.jobs[items[i]];
+		auto& prefetch = context.prefetches[items[i]];
+		// Without a size from the directory listing the input is mapped as usual
+		if (!job.size || job.size > io_ring_max_file_size || ring.bytes_in_flight + job.size > io_ring_max_bytes || prefetch.state.load() != PrefetchState::None)
+			continue;
+
+		const auto buffer = (char*)memory_alloc(job.size);
+		if (!buffer) break;
+		prefetch.worker_index = worker_index;
+		prefetch.request = {.path = get_path(job.in_file_path), .buffer = buffer, .size = job.size, .proc = on_input_read, .item = items[i]};
+
+		// Another worker may have stolen the job in the meantime
+		auto expected = PrefetchState::None;
+		if (!prefetch.state.compare_exchange_strong(expected, PrefetchState::InFlight))
+		{
+			memory_free(buffer);
+			continue;
+		}
+		if (!io_ring_push(ring, &prefetch.request))
+		{
+			expected = PrefetchState::InFlight;
+			prefetch.state.compare_exchange_strong(expected, PrefetchState::None);
+			memory_free(buffer);
+			break;
+		}
+	}
+	io_ring_submit(ring);
+}
 
-	auto statement_arg_start = statement_end + 1;
-	for (; *statement_arg_start == ' '; statement_arg_start++);
-	if (*statement_arg_start != '"')
+// The input of the job if it was read ahead, an empty buffer when it has to be mapped as usual
+const UnixBuffer take_prefetched_input(ProcessContext& context, const u32 item, const u32 worker_index, FileStats* stats)
+{
+	auto& prefetch = context.prefetches[item];
+	if (prefetch.state.load() == PrefetchState::InFlight && prefetch.worker_index == worker_index)
 	{
-		wprintf(L"Can't find opening \" of #include statement\n");
-		return 0;
+		const auto wait_start = stats || t_trace ? get_time_ns() : 0;
+		while (prefetch.state.load() == PrefetchState::InFlight)
+			io_ring_reap(context.rings[worker_index], 1, &context);
+		if (stats || t_trace)
+		{
+			const auto wait_end = get_time_ns();
+			trace_span("read_file", wait_start, wait_end, prefetch.request.path);
+			if (stats)
+				stats->phase_ns[(int)Phase::Map] += wait_end - wait_start;
+		}
 	}
 
-	auto statement_arg_end = statement_arg_start + 1;
-	for (; *statement_arg_end != '"' && *statement_arg_end != '\n' && *statement_arg_end; statement_arg_end++);
-	if (*statement_arg_end != '"')
+	// A read still in flight on the ring of another worker is freed by that worker
+	if (prefetch.state.exchange(PrefetchState::Taken) != PrefetchState::Done)
+		return {};
+
+	// The file may have changed since it was listed
+	const auto& request = prefetch.request;
+	if (request.result != (i64)request.size)
 	{
-		wprintf(L"Can't find closing \" of #include statement\n");
+		memory_free(request.buffer);
+		return {};
+	}
+	return memory_to_unix_buffer(request.buffer, request.size, request.path, stats);
+}
+
+// Hands the output to the ring of the worker, which writes it while the next
+// jobs are expanded. Returns 0 when it has to be written as usual.
+bool write_output_async(ProcessContext& context, const u32 item, const u32 worker_index, const OutputRope& out)
+{
+	auto& ring = context.rings[worker_index];
+	const auto request = (IoFileRequest*)memory_alloc(sizeof(IoFileRequest) + out.size);
+	if (!request)
 		return 0;
+
+	// The rope points into buffers that are gone once the job ends
+	auto cursor = (char*)(request + 1);
+	for (u64 i = 0; i < out.count; i++)
+	{
+		memcpy(cursor, out.slices[i].content, out.slices[i].size);
+		cursor += out.slices[i].size;
 	}
+	*request = {.path = get_path(context.jobs[item].out_file_path), .buffer = (char*)(request + 1), .size = out.size, .write = 1, .proc = on_output_written, .item = item};
 
-	include.start_location = statement_start;
-	include.end_location = statement_arg_end;
+	// Bounds the memory the outputs in flight hold on to
+	while (ring.in_flight && ring.bytes_in_flight + out.size > io_ring_max_bytes)
+		io_ring_reap(ring, 1, &context);
+	while (!io_ring_push(ring, request))
+	{
+		if (!ring.in_flight)
+		{
+			memory_free(request);
+			return 0;
+		}
+		io_ring_reap(ring, 1, &context);
+	}
+	io_ring_submit(ring);
+	return 1;
+}
 
-	const auto include_file_path_size = statement_arg_end - statement_arg_start - 1;
-	if (!include_file_path_size || include_file_path_size > std::numeric_limits<int>::max()) {
-		wprintf(L"Invalid file path of #include statement\n");
+// Falls back to the plain syscalls without a message when io_uring isn't available
+bool io_rings_init(ProcessContext& context, const u32 rings_count, const u32 jobs_count)
+{
+	context.rings = (IoRing*)memory_alloc(rings_count * sizeof(IoRing));
+	context.prefetches = (InputPrefetch*)memory_alloc((jobs_count ? jobs_count : 1) * sizeof(InputPrefetch));
+	if (!context.rings || !context.prefetches)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		memory_free(context.rings);
+		memory_free(context.prefetches);
+		context.rings = 0;
+		context.prefetches = 0;
 		return 0;
 	}
+	for (u32 i = 0; i < jobs_count; i++)
+		context.prefetches[i].state = PrefetchState::None;
+
+	for (u32 i = 0; i < rings_count; i++)
+	{
+		if (io_ring_init(context.rings[i])) continue;
+
+		for (u32 j = 0; j < i; j++)
+			io_ring_free(context.rings[j]);
+		memory_free(context.rings);
+		memory_free(context.prefetches);
+		context.rings = 0;
+		context.prefetches = 0;
+		log_verbose(L"io_uring isn't available, files are read and written as usual\n");
+		break;
+	}
+	return 1;
+}
 
-	const auto include_file_path_size_trunc = (int)include_file_path_size;
+// Waits for the writes still in flight once the workers are done, so the jobs can run again
+void io_rings_drain(ProcessContext& context, const u32 rings_count, const u32 jobs_count)
+{
+	if (!context.rings) return;
 
-	const auto bytes_written = MultiByteToWideChar(CP_UTF8, 0, statement_arg_start+1, include_file_path_size_trunc, include.file_path, COUNTOF(include.file_path));
-	include.file_path[bytes_written] = 0;
+	for (u32 i = 0; i < rings_count; i++)
+	{
+		while (context.rings[i].in_flight)
+			io_ring_reap(context.rings[i], 1, &context);
+	}
+	// Every job that ran took its input
+	for (u32 i = 0; i < jobs_count; i++)
+		context.prefetches[i].state = PrefetchState::None;
+}
 
-	return in_file_buffer.size - (statement_arg_end - in_file_buffer.content) + (statement_start - in_file_buffer.content) - 1;
+void io_rings_free(ProcessContext& context, const u32 rings_count)
+{
+	if (!context.rings) return;
+
+	for (u32 i = 0; i < rings_count; i++)
+		io_ring_free(context.rings[i]);
+	memory_free(context.rings);
+	memory_free(context.prefetches);
+	context.rings = 0;
+	context.prefetches = 0;
 }
 
-int process_replace_include(Buffer& in_file_buffer2, const Buffer& out_file_buffer, const wchar_t in_path_dir[64])
+// Maps the whole input, expands it and writes the output at once
+bool expand_file(ProcessContext& context, const u32 item, const u32 worker_index, TranslationUnit& unit, const FileInfo& in_file_info, u64& out_size)
 {
-	IncludeStatement include;
-	const auto size1 = process_include(include, out_file_buffer);
-	if (!size1) return 0;
-	in_file_buffer2.size = size1;
+	const auto& job = context.jobs[item];
+	const auto in_file_path = get_path(job.in_file_path);
+	const auto out_file_path = get_path(job.out_file_path);
+	auto& arena = *unit.arena;
+	const auto stats = unit.stats;
+
+	auto in_file_unix_buffer = context.rings ? take_prefetched_input(context, item, worker_index, stats) : UnixBuffer{};
+	if (!in_file_unix_buffer.memory)
+		in_file_unix_buffer = read_file_to_unix_buffer(in_file_path, stats);
+	const auto in_file_buffer = in_file_unix_buffer.buffer;
+	if (!in_file_buffer.content)
+		return 0;
 
-	wchar_t include_file_path[64];
-	// generate include_file_path {{{
-	if (wcslcpy(include_file_path, in_path_dir, COUNTOF(include_file_path)) >= COUNTOF(include_file_path))
+	const auto scan_start = stats || t_trace ? get_time_ns() : 0;
+	DirectiveIndex in_file_directive_index = {.arena = &arena};
+	if (!build_directive_index(in_file_directive_index, in_file_buffer))
 	{
-		wprintf(L"File path is too large!\n");
-		return -1;
+		free_unix_buffer(in_file_unix_buffer);
+		return 0;
 	}
-	if (wcslcat(include_file_path, include.file_path, COUNTOF(include_file_path)) >= COUNTOF(include_file_path))
+	if (stats || t_trace)
 	{
-		wprintf(L"File path is too large!\n");
-		return -1;
+		const auto scan_end = get_time_ns();
+		trace_span("scan", scan_start, scan_end, in_file_path);
+		if (stats)
+			stats->phase_ns[(int)Phase::Scan] += scan_end - scan_start;
 	}
-	// }}}
 
-	include.file_buffer = read_file_to_unix_buffer(include_file_path);
-	in_file_buffer2.size += include.file_buffer.size;
+	const SourceFile in_file = {
+		.buffer = in_file_buffer,
+		.directives = in_file_directive_index.directives,
+		.directives_count = in_file_directive_index.count,
+	};
 
-	in_file_buffer2.content = (char *)VirtualAlloc(0, in_file_buffer2.size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-	if (!in_file_buffer2.content)
+	if (unit.dependencies)
 	{
-		wprintf(L"Failed to allocate memory!\n");
-		return -1;
+		const Dependency in_file_dependency = {
+			.path = job.in_file_path,
+			.size = in_file_info.size,
+			.last_write_time = in_file_info.last_write_time,
+			.hash = hash_bytes(in_file_buffer.content, in_file_buffer.size),
+		};
+		if (!dependencies_push(*unit.dependencies, in_file_dependency))
+		{
+			free_unix_buffer(in_file_unix_buffer);
+			return 0;
+		}
 	}
 
-	auto out_file_buffer_end = in_file_buffer2.content;
-	auto in_file_buffer_cursor = out_file_buffer.content;
+	const auto expand_start = stats || t_trace ? get_time_ns() : 0;
+	const auto headers_ns = stats ? stats->phase_ns[(int)Phase::Map] + stats->phase_ns[(int)Phase::Normalize] + stats->phase_ns[(int)Phase::Scan] : 0;
 
+	OutputRope out_file_rope = {.arena = &arena};
+	if (!expand_includes(out_file_rope, *context.include_cache, *context.include_resolver, unit, in_file, job.in_file_path, job.in_file_dir))
 	{
-		const auto size = include.start_location - in_file_buffer_cursor;
-		memcpy(out_file_buffer_end, in_file_buffer_cursor, size);
-		in_file_buffer_cursor = include.end_location + 1;
-		out_file_buffer_end += size;
+		free_unix_buffer(in_file_unix_buffer);
+		return 0;
+	}
+	check_conditionals_closed(unit.conditionals, job.in_file_path);
 
-		memcpy(out_file_buffer_end, include.file_buffer.content, include.file_buffer.size);
-		VirtualFree(include.file_buffer.content, include.file_buffer.size, MEM_RELEASE);
-		out_file_buffer_end += include.file_buffer.size;
+	const auto write_start = stats || t_trace ? get_time_ns() : 0;
+	trace_span("expand", expand_start, write_start, in_file_path);
+	if (stats)
+	{
+		const auto expand_headers_ns = stats->phase_ns[(int)Phase::Map] + stats->phase_ns[(int)Phase::Normalize] + stats->phase_ns[(int)Phase::Scan] - headers_ns;
+		stats->phase_ns[(int)Phase::Expand] += write_start - expand_start - expand_headers_ns;
 	}
 
+	// Its modification time is kept, so what's built from it isn't rebuilt
+	auto written = context.restat && !is_stdio_path(out_file_path) && file_equals_slices(out_file_path, out_file_rope.size, out_file_rope.slices, out_file_rope.count);
+	if (written)
 	{
-		const auto size = out_file_buffer.size - (in_file_buffer_cursor - out_file_buffer.content);
-		memcpy(out_file_buffer_end, in_file_buffer_cursor, size);
+		log_verbose(L"File \"%hs\" is unchanged\n", out_file_path);
+		context.jobs_unchanged++;
 	}
 
-	return 1;
+	// Outputs written on the ring are counted once they are
+	if (!written)
+		written = context.rings && !is_stdio_path(out_file_path) && out_file_rope.size <= io_ring_max_file_size && write_output_async(context, item, worker_index, out_file_rope);
+	if (!written)
+	{
+		const auto out_file_handle = is_stdio_path(out_file_path) ? context.stdout_handle : create_wo_file(out_file_path);
+		if (out_file_handle != invalid_file_handle)
+		{
+			written = write_file_slices(out_file_handle, out_file_path, out_file_rope.slices, out_file_rope.count);
+			if (!is_stdio_path(out_file_path))
+				close_file(out_file_handle);
+		}
+		if (written)
+			context.jobs_written++;
+	}
+	out_size = out_file_rope.size;
+
+	if (stats || t_trace)
+	{
+		const auto write_end = get_time_ns();
+		trace_span("write_file", write_start, write_end, out_file_path);
+		if (stats)
+			stats->phase_ns[(int)Phase::Write] += write_end - write_start;
+	}
+
+	// The rope points into it
+	free_unix_buffer(in_file_unix_buffer);
+	return written;
 }
 
-const wchar_t* get_rel_path(const wchar_t* abs_path, const wchar_t* curr_dir)
+// Goes through the input a chunk at a time, for stdin and inputs too large to be mapped
+bool stream_file(ProcessContext& context, const FileJob& job, TranslationUnit& unit, const FileInfo& in_file_info, u64& out_size)
 {
-	const wchar_t* result = abs_path;
+	const auto in_file_path = get_path(job.in_file_path);
+	const auto out_file_path = get_path(job.out_file_path);
+	const auto in_stdin = is_stdio_path(in_file_path);
 
-	for (auto c = curr_dir; *c; c++)
-		if (*c != *result++) return abs_path;
+	if (unit.dependencies)
+	{
+		// Hashing it would take a second pass over it, so it isn't. Once it's
+		// touched it's taken as changed, whether its content changed or not.
+		const Dependency in_file_dependency = {
+			.path = job.in_file_path,
+			.size = in_file_info.size,
+			.last_write_time = in_file_info.last_write_time,
+		};
+		if (!dependencies_push(*unit.dependencies, in_file_dependency))
+			return 0;
+	}
 
-	return result;
-}
+	const auto in_file_handle = in_stdin ? get_stdin_handle() : open_ro_file(in_file_path);
+	if (in_file_handle == invalid_file_handle)
+		return 0;
 
-enum class CanonicalSelectorResult {
-	None, File, Directory, Files
-};
+	bool written = 0;
+	const auto out_file_handle = is_stdio_path(out_file_path) ? context.stdout_handle : create_wo_file(out_file_path);
+	if (out_file_handle != invalid_file_handle)
+	{
+		written = expand_stream(out_size, out_file_handle, out_file_path, *context.include_cache, *context.include_resolver, unit, in_file_handle, job.in_file_path, job.in_file_dir);
+		if (!is_stdio_path(out_file_path))
+			close_file(out_file_handle);
+	}
+	if (written)
+		context.jobs_written++;
 
-CanonicalSelectorResult get_canonical_selector(wchar_t* dest, const size_t dest_count, const wchar_t* src, const bool check_for_star)
+	if (!in_stdin)
+		close_file(in_file_handle);
+	return written;
+}
+
+void process_file(ProcessContext& context, const u32 item, const u32 worker_index)
 {
-	const auto file_too_large_error = []() {
-		wprintf(L"File path is too large!\n");
-		return CanonicalSelectorResult::None;
+	const auto& job = context.jobs[item];
+	auto& arena = context.arenas[worker_index];
+	const auto in_file_path = get_path(job.in_file_path);
+	const auto in_stdin = is_stdio_path(in_file_path);
+
+	const auto job_number = ++context.jobs_started;
+	log_verbose(L"[%u/%u] Processing file \"%hs\"...\n", job_number, context.jobs_count, in_file_path);
+
+	// Before reading it, so a change made in between is noticed on the next run
+	FileInfo in_file_info = {};
+	if (context.results && !get_file_info(in_file_path, in_file_info))
+		in_file_info = {};
+
+	// Sizes the directory walk didn't get are looked up, huge inputs are streamed
+	auto in_file_size = job.size ? job.size : in_file_info.size;
+	FileInfo size_info;
+	if (!in_file_size && !in_stdin && get_file_info(in_file_path, size_info))
+		in_file_size = size_info.size;
+
+	const auto stats = context.stats ? &context.stats[item] : 0;
+	if (stats)
+		*stats = {};
+	t_trace = context.traces ? &context.traces[worker_index] : 0;
+	const auto job_start = trace_time();
+
+	Dependencies dependencies = {.arena = &arena};
+	// Macros and the included headers only live as long as their translation unit
+	TranslationUnit unit = {
+		.arena = &arena,
+		.symbols = {.arena = &arena},
+		.replacements = &arena,
+		.dependencies = context.results ? &dependencies : 0,
+		.stats = stats,
+		.snapshots = context.snapshots,
+		.snapshot_chain = context.snapshots != 0,
 	};
 
-	wchar_t* abs_path_file_part;
-	wchar_t abs_path[64];
-	const auto abs_path_written = GetFullPathNameW(src, COUNTOF(abs_path), abs_path, &abs_path_file_part);
-	if (!abs_path_written || abs_path_written > COUNTOF(abs_path))
-		return file_too_large_error();
+	if (context.rings)
+		prefetch_inputs(context, worker_index);
 
-	//if (dest_count > std::numeric_limits<DWORD>::max()) return CanonicalSelectorResult::None;
+	u64 out_size = 0;
+	const auto written = in_stdin || in_file_size >= stream_size_threshold ?
+		stream_file(context, job, unit, in_file_info, out_size) :
+		expand_file(context, item, worker_index, unit, in_file_info, out_size);
+	if (written && context.results)
+		save_job_result(context.results[item], dependencies, out_size);
 
-	wchar_t current_dir[64];
-	const auto current_dir_result = GetCurrentDirectoryW(COUNTOF(current_dir), current_dir);
-	if (!current_dir_result || current_dir_result > COUNTOF(current_dir))
-		return file_too_large_error();
+	trace_span("file", job_start, trace_time(), in_file_path);
+	if (stats)
+		stats->bytes_allocated = arena_used_size(arena);
+	arena_reset(arena);
+}
 
-	if (wcslcat(current_dir, L"\\", COUNTOF(current_dir)) >= COUNTOF(current_dir))
-		return file_too_large_error();
+void process_file_job(u32 item, u32 worker_index, void* user)
+{
+	// Everything the job prints is written at once
+	log_batch_begin();
+	process_file(*(ProcessContext*)user, item, worker_index);
+	log_batch_end();
+}
 
-	const auto rel_path = get_rel_path(abs_path, current_dir);
-	if (wcslcpy(dest, rel_path, dest_count) >= dest_count)
-		return file_too_large_error();
+// Outputs that failed are left out, so they are processed again on the next run
+bool save_manifest(const char* manifest_path, Manifest& manifest, const FileJobs& file_jobs, const JobResult* results)
+{
+	OwnedBuffer records_memory((char*)memory_alloc((file_jobs.count ? file_jobs.count : 1) * sizeof(ManifestRecord)), file_jobs.count * sizeof(ManifestRecord));
+	if (!records_memory.content)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
 
-	const auto file_attrs = GetFileAttributesW(dest);
-	if (file_attrs != INVALID_FILE_ATTRIBUTES && file_attrs & FILE_ATTRIBUTE_DIRECTORY)
+	const auto records = (ManifestRecord*)records_memory.content;
+	u64 records_count = 0;
+	for (u32 i = 0; i < file_jobs.count; i++)
 	{
-		if (abs_path_file_part)
+		const auto& job = file_jobs.jobs[i];
+		const auto& result = results[i];
+		if (result.written)
 		{
-			if (wcslcat(dest, L"\\", dest_count) >= dest_count)
-				return file_too_large_error();
+			auto& record = records[records_count++];
+			record.out_path = job.out_file_path;
+			record.out_size = result.out_size;
+			record.dependencies = result.dependencies;
+			record.dependencies_count = result.dependencies_count;
 		}
-		if (wcslcat(dest, L"*", dest_count) >= dest_count)
-			return file_too_large_error();
-		return CanonicalSelectorResult::Directory;
+		else if (job.up_to_date)
+			records[records_count++] = *manifest_find(manifest, job.out_file_path);
+	}
+
+	return manifest_save(manifest_path, records, records_count, manifest.options_hash);
+}
+
+void write_stats(StatsWriter& writer, const FileJobs& file_jobs, const FileStats* stats, const u32 workers_count, const u64 wall_ns)
+{
+	FileStats total = {};
+	u32 files_count = 0;
+	for (u32 i = 0; i < file_jobs.count; i++)
+	{
+		if (file_jobs.jobs[i].up_to_date) continue;
+		file_stats_add(total, stats[i]);
+		files_count++;
+	}
+
+	stats_printf(writer, "{\n\t\"workers\": %u,\n\t\"wall_ns\": %llu,\n\t\"files_count\": %u,\n\t\"total\": {", workers_count, wall_ns, files_count);
+	stats_write_file_stats(writer, total);
+	stats_printf(writer, "},\n\t\"files\": [");
+
+	bool first = 1;
+	for (u32 i = 0; i < file_jobs.count; i++)
+	{
+		if (file_jobs.jobs[i].up_to_date) continue;
+		stats_printf(writer, first ? "\n\t\t{\"path\": " : ",\n\t\t{\"path\": ");
+		stats_write_string(writer, get_path(file_jobs.jobs[i].in_file_path));
+		stats_printf(writer, ", ");
+		stats_write_file_stats(writer, stats[i]);
+		stats_printf(writer, "}");
+		first = 0;
 	}
+	stats_printf(writer, "\n\t]\n}\n");
+}
+
+// Only the jobs that ran are listed
+bool save_stats(const char* stats_path, const FileJobs& file_jobs, const FileStats* stats, const u32 workers_count, const u64 wall_ns)
+{
+	StatsWriter writer = {};
+	write_stats(writer, file_jobs, stats, workers_count, wall_ns);
+
+	OwnedBuffer buffer((char*)memory_alloc(writer.size + 1), writer.size);
+	if (!buffer.content)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	writer = {.cursor = buffer.content};
+	write_stats(writer, file_jobs, stats, workers_count, wall_ns);
+
+	const auto file_handle = create_wo_file(stats_path);
+	if (file_handle == invalid_file_handle)
+		return 0;
+
+	const OutputSlice slice = {.content = buffer.content, .size = buffer.size};
+	const auto written = write_file_slices(file_handle, stats_path, &slice, 1);
+	close_file(file_handle);
+	return written;
+}
+
+bool save_trace(const char* trace_path, const TraceBuffer* traces, const u32 workers_count, const u64 start_ns)
+{
+	StatsWriter writer = {};
+	write_trace(writer, traces, workers_count, start_ns);
+
+	OwnedBuffer buffer((char*)memory_alloc(writer.size + 1), writer.size);
+	if (!buffer.content)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	writer = {.cursor = buffer.content};
+	write_trace(writer, traces, workers_count, start_ns);
+
+	const auto file_handle = create_wo_file(trace_path);
+	if (file_handle == invalid_file_handle)
+		return 0;
+
+	const OutputSlice slice = {.content = buffer.content, .size = buffer.size};
+	const auto written = write_file_slices(file_handle, trace_path, &slice, 1);
+	close_file(file_handle);
+	return written;
+}
+
+void log_run_summary(const ProcessContext& context, const u32 up_to_date_count, const u64 elapsed_ns)
+{
+	const u32 written_count = context.jobs_written;
+	const u32 unchanged_count = context.jobs_unchanged;
+	if (context.restat)
+		log_info(L"Processed %u files in %.1f ms: %u written, %u unchanged, %u failed, %u up to date\n",
+			context.jobs_count, elapsed_ns / 1e6, written_count, unchanged_count, context.jobs_count - written_count - unchanged_count, up_to_date_count);
 	else
+		log_info(L"Processed %u files in %.1f ms: %u written, %u failed, %u up to date\n",
+			context.jobs_count, elapsed_ns / 1e6, written_count, context.jobs_count - written_count, up_to_date_count);
+}
+
+struct WatchState {
+	DependentJobs dependents;
+	// One per job
+	bool* changed;
+	u32 changed_count;
+};
+
+void on_file_changed(const char* path, const u64 path_size, void* user)
+{
+	auto& state = *(WatchState*)user;
+	// Files nothing depends on were never interned
+	const auto path_id = path_pool_find(g_paths, path, path_size);
+	if (!path_id) return;
+	const auto node = dependent_jobs_find(state.dependents, path_id);
+	if (!node) return;
+
+	for (auto edge = node->first_edge; edge != ~0u; edge = state.dependents.edges[edge].next)
 	{
-		if (abs_path_file_part && check_for_star && wcschr(abs_path_file_part, L'*'))
-			return CanonicalSelectorResult::Files;
-		return CanonicalSelectorResult::File;
+		const auto job = state.dependents.edges[edge].job;
+		if (state.changed[job]) continue;
+		state.changed[job] = 1;
+		state.changed_count++;
 	}
 }
 
-bool get_path_dir(wchar_t* dest, size_t dest_count, const wchar_t* src)
+// Maps every input to the jobs that read it during their last run and watches its directory
+bool update_dependent_jobs(DependentJobs& dependents, FileWatcher& watcher, const FileJobs& file_jobs, const JobResult* results, Manifest& manifest)
 {
-	const auto src_last_slash = get_last_slash(src);
-	if (src_last_slash)
+	dependent_jobs_free(dependents);
+
+	for (u32 i = 0; i < file_jobs.count; i++)
 	{
-		const size_t size = src_last_slash - src + 1;
-		if (size >= dest_count)
-		{
-			wprintf(L"File path is too large!\n");
+		const auto& job = file_jobs.jobs[i];
+		// Even if it couldn't be read, so fixing it is noticed
+		if (!dependent_jobs_add(dependents, job.in_file_path, i))
 			return 0;
+
+		const Dependency* dependencies = results[i].dependencies;
+		u32 dependencies_count = results[i].dependencies_count;
+		if (!results[i].written && job.up_to_date)
+		{
+			const auto record = manifest_find(manifest, job.out_file_path);
+			dependencies = record->dependencies;
+			dependencies_count = record->dependencies_count;
+		}
+
+		for (u32 j = 0; j < dependencies_count; j++)
+		{
+			if (!dependent_jobs_add(dependents, dependencies[j].path, i))
+				return 0;
 		}
-		wcslcpy(dest, src, size+1);
 	}
-	else
-		dest[0] = 0;
+
+	for (u64 i = 0; i < dependents.capacity; i++)
+	{
+		const auto& node = dependents.nodes[i];
+		if (!node.path) continue;
+
+		char directory[max_path_size];
+		if (!get_path_dir(directory, sizeof(directory), get_path(node.path)))
+			return 0;
+		const auto directory_id = path_pool_intern(g_paths, directory);
+		if (!directory_id || !file_watcher_add_directory(watcher, directory_id))
+			return 0;
+	}
 
 	return 1;
 }
 
-bool get_parent_path_dir(wchar_t* dest, size_t dest_count, const wchar_t* src)
+// Runs the jobs affected by every change until something fails, with the caches kept from the last run
+bool watch_file_jobs(const FileJobs& file_jobs, ProcessContext& context, const u32 workers_count, const u32* sorted_items, const char* manifest_path, Manifest& manifest)
 {
-	const auto src_last_slash = get_last_slash(src);
-	if (src_last_slash)
+	FileWatcher watcher;
+	if (!file_watcher_init(watcher))
+		return 0;
+
+	WatchState state = {};
+	const auto memory = (char*)memory_alloc(file_jobs.count * (sizeof(bool) + sizeof(u32)));
+	if (!memory)
 	{
-		const size_t size = src_last_slash - src;
-		if (size >= dest_count)
+		wprintf(L"Failed to allocate memory!\n");
+		file_watcher_free(watcher);
+		return 0;
+	}
+	const auto items = (u32*)memory;
+	state.changed = (bool*)(items + file_jobs.count);
+
+	while (update_dependent_jobs(state.dependents, watcher, file_jobs, context.results, manifest))
+	{
+		log_info(L"Watching %llu files for changes...\n", state.dependents.count);
+		state.changed_count = 0;
+		if (!file_watcher_wait(watcher, 50, on_file_changed, &state))
+			break;
+		if (!state.changed_count)
+			continue;
+
+		// Still largest first
+		u32 items_count = 0;
+		for (u32 i = 0; i < file_jobs.count; i++)
+		{
+			if (!state.changed[sorted_items[i]]) continue;
+			state.changed[sorted_items[i]] = 0;
+			items[items_count++] = sorted_items[i];
+		}
+
+		// No job reads from the caches now. Headers may have been created or
+		// removed, so includes are looked up again.
+		include_cache_release_retired(*context.include_cache);
+		include_resolver_clear(*context.include_resolver);
+		if (context.snapshots)
+			header_snapshots_uncheck(*context.snapshots);
+
+		context.jobs_count = items_count;
+		context.jobs_started = 0;
+		context.jobs_written = 0;
+		context.jobs_unchanged = 0;
+		const auto run_start = get_time_ns();
+		thread_pool_run(workers_count, items, items_count, process_file_job, &context);
+		t_trace = 0;
+		io_rings_drain(context, workers_count, file_jobs.count);
+		log_run_summary(context, 0, get_time_ns() - run_start);
+
+		if (context.snapshots)
+			header_snapshots_save(*context.snapshots, context.header_cache_path);
+		if (manifest_path)
+			save_manifest(manifest_path, manifest, file_jobs, context.results);
+	}
+
+	dependent_jobs_free(state.dependents);
+	memory_free(memory);
+	file_watcher_free(watcher);
+	return 0;
+}
+
+// --recursive: every file under in_path_dir that matches the file name of
+// in_path, written to the same place under out_path_dir. in_path_full_dir is
+// the absolute in_path_dir.
+bool collect_file_jobs_recursive(FileJobs& file_jobs, const char* in_path, const char* in_path_dir, const char* in_path_full_dir, const char* out_path_dir, const u32 workers_count)
+{
+	const auto last_slash = get_last_slash(in_path);
+	const auto root = path_pool_intern(g_paths, in_path_dir);
+	WalkResult walk;
+	if (!root || !walk_directory_tree(walk, root, last_slash ? last_slash + 1 : in_path, workers_count))
+		return 0;
+
+	const auto root_size = strlen(in_path_dir);
+	char out_file_path[max_path_size];
+	char out_file_dir[max_path_size];
+	char created_dir[max_path_size] = {};
+	char in_file_dir[max_path_size];
+	bool succeeded = 1;
+	for (u32 i = 0; i < walk.files_count && succeeded; i++)
+	{
+		const auto& file = walk.files[i];
+		// generate out_file_path {{{
+		if (strlcpy(out_file_path, out_path_dir, sizeof(out_file_path)) >= sizeof(out_file_path) ||
+			strlcat(out_file_path, get_path(file.path) + root_size, sizeof(out_file_path)) >= sizeof(out_file_path))
 		{
 			wprintf(L"File path is too large!\n");
-			return 0;
+			succeeded = 0;
+			break;
+		}
+		// }}}
+
+		// generate in_file_dir {{{
+		const auto relative_path = get_path(file.path) + root_size;
+		const auto relative_slash = get_last_slash(relative_path);
+		const auto relative_dir_size = relative_slash ? relative_slash + 1 - relative_path : 0;
+		const auto full_dir_size = strlcpy(in_file_dir, in_path_full_dir, sizeof(in_file_dir));
+		if (full_dir_size + relative_dir_size >= sizeof(in_file_dir))
+		{
+			wprintf(L"File path is too large!\n");
+			succeeded = 0;
+			break;
+		}
+		memcpy(in_file_dir + full_dir_size, relative_path, relative_dir_size);
+		// }}}
+
+		// Files of a directory mostly come one after the other
+		get_path_dir(out_file_dir, sizeof(out_file_dir), out_file_path);
+		if (out_file_dir[0] && strcmp(out_file_dir, created_dir) != 0)
+		{
+			if (!create_directories(out_file_dir))
+			{
+				nice_wprintf(L"Failed to create directory \"%hs\"!\n", out_file_dir);
+				succeeded = 0;
+				break;
+			}
+			strlcpy(created_dir, out_file_dir, sizeof(created_dir));
 		}
-		wcslcpy(dest, src, size+1);
+
+		const FileJob job = {
+			.in_file_path = file.path,
+			.out_file_path = path_pool_intern(g_paths, out_file_path),
+			.in_file_dir = path_pool_intern(g_paths, in_file_dir, full_dir_size + relative_dir_size),
+			.size = file.size,
+		};
+		succeeded = job.out_file_path && job.in_file_dir && file_jobs_push(file_jobs, job);
 	}
-	else
-		dest[0] = 0;
 
+	if (succeeded && !walk.files_count)
+		nice_wprintf(L"No matching files found under \"%hs\"!\n", in_path_dir[0] ? in_path_dir : "." PATH_SEPARATOR);
+
+	walk_result_free(walk);
+	return succeeded;
+}
+
+// Paths are UTF-8 from the arguments on, dest is left empty if the argument isn't given
+bool get_path_arg(char (&dest)[max_path_size], const ArgEntry* entries, const int entries_count, const wchar_t* name)
+{
+	dest[0] = 0;
+	const auto arg = get_arg_entry_value(entries, entries_count, name);
+	if (arg && arg[0] && !wide_to_utf8(dest, sizeof(dest), arg))
+	{
+		wprintf(L"File path is too large!\n");
+		return 0;
+	}
 	return 1;
 }
 
+// Absolute and with a trailing separator, like the directories of the jobs
+bool get_include_dir(PathId& dir, const wchar_t* arg)
+{
+	char path[max_path_size];
+	char full_path[max_path_size];
+	if (!wide_to_utf8(path, sizeof(path) - 1, arg))
+	{
+		wprintf(L"File path is too large!\n");
+		return 0;
+	}
+
+	if (!is_directory(path))
+	{
+		nice_wprintf(L"Include directory \"%hs\" doesn't exist!\n", path);
+		return 0;
+	}
+
+	const auto size = strlen(path);
+	if (path[size - 1] != '/' && path[size - 1] != '\\')
+		strlcat(path, PATH_SEPARATOR, sizeof(path));
+
+	const auto full_path_size = get_full_path_name(full_path, sizeof(full_path), path, 0);
+	if (!full_path_size)
+	{
+		wprintf(L"File path is too large!\n");
+		return 0;
+	}
+
+	dir = path_pool_intern(g_paths, full_path, full_path_size);
+	return dir != invalid_path_id;
+}
+
 #ifdef TEST
 #define MAIN entry
 #else
@@ -299,6 +1117,7 @@ bool get_parent_path_dir(wchar_t* dest, size_t dest_count, const wchar_t* src)
 
 int MAIN(int argc, const wchar_t** argv)
 {
+#ifdef _WIN32
 	// Enable conhost ascii escape sequences
 	g_conout = GetStdHandle(STD_OUTPUT_HANDLE);
 	if (!g_conout || g_conout == INVALID_HANDLE_VALUE) return 0;
@@ -306,11 +1125,26 @@ int MAIN(int argc, const wchar_t** argv)
 	GetConsoleMode(g_conout, &mode);
 	SetConsoleMode(g_conout, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
 	_setmode(_fileno(stdout), _O_U16TEXT);
+	// Paths are UTF-8, so %hs has to decode them as such
+	setlocale(LC_CTYPE, ".UTF8");
+#endif
 
 	ArgEntry arg_entries[] = {
 		{L"h", L"help", L"Display this message"},
-		{L"o", L"out", L"Output directory/file", 1, L"gen/"},
-		{0, L"path", L"Directory or file(s) to preprocess", -1},
+		{L"o", L"out", L"Output directory/file, - for stdout", 1, L"gen/"},
+		{L"j", L"jobs", L"Number of files processed in parallel (default: number of cores)", 1},
+		{L"r", L"recursive", L"Also process the files in every subdirectory of the input directory"},
+		{L"I", L"include", L"Directory searched for includes, after the one of the including file (can be repeated)", 1},
+		{L"i", L"incremental", L"Only process the files whose inputs changed since the last incremental run"},
+		{L"w", L"watch", L"Keep running and process files again when their inputs change (Linux only)"},
+		{L"s", L"stats", L"Write counters and timings of every file to this JSON file", 1},
+		{L"t", L"trace", L"Write a Chrome trace of every phase of every file to this JSON file", 1},
+		{L"u", L"io-uring", L"Read and write files in batches through io_uring (Linux only)"},
+		{L"c", L"restat", L"Leave the outputs whose content didn't change untouched, so their modification time is kept"},
+		{L"H", L"header-cache", L"Keep the expansion of the headers every input starts with in this file, for the next runs", 1},
+		{L"q", L"quiet", L"Only print errors"},
+		{L"v", L"verbose", L"Print every file as it's processed"},
+		{0, L"path", L"Directory or file(s) to preprocess, - for stdin", -1},
 	};
 
 	const auto parse_args_result = parse_args(arg_entries, COUNTOF(arg_entries), argc, argv, L"parsa");
@@ -319,9 +1153,14 @@ int MAIN(int argc, const wchar_t** argv)
 	else if (parse_args_result == ParseArgsResult::Help)
 		return 0;
 
+	if (get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"quiet"))
+		g_log_level = LogLevel::Quiet;
+	else if (get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"verbose"))
+		g_log_level = LogLevel::Verbose;
+
 #ifdef DEBUG
 	wprintf(L"--------ARGS--------\n");
-	for (int i = 0; i < COUNTOF(arg_entries); i++)
+	for (u32 i = 0; i < COUNTOF(arg_entries); i++)
 	{
 		nice_wprintf(L"--%ls: ", arg_entries[i].long_name);
 		auto value = arg_entries[i].value;
@@ -340,15 +1179,60 @@ int MAIN(int argc, const wchar_t** argv)
 	wprintf(L"--------------------\n\n");
 #endif
 
-	const auto in_path_arg = get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"path");
-	wchar_t in_path[64];
-	const auto in_canonical_selector_result = get_canonical_selector(in_path, COUNTOF(in_path), in_path_arg, 1);
+	char in_path_arg[max_path_size];
+	if (!get_path_arg(in_path_arg, arg_entries, COUNTOF(arg_entries), L"path"))
+		return 1;
+	// stdin is a single file in the current directory, as far as its includes are concerned
+	const auto in_stdin = is_stdio_path(in_path_arg);
+	char in_path[max_path_size];
+	const auto in_canonical_selector_result = in_stdin ? CanonicalSelectorResult::File : get_canonical_selector(in_path, sizeof(in_path), in_path_arg, 1);
 	if (in_canonical_selector_result == CanonicalSelectorResult::None) return 1;
+	if (in_stdin)
+		strlcpy(in_path, stdio_path, sizeof(in_path));
 
-	const auto out_path_arg = get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"out");
-	wchar_t out_path[64];
-	const auto out_canonical_selector_result = get_canonical_selector(out_path, COUNTOF(out_path), out_path_arg, 0);
+	char out_path_arg[max_path_size];
+	if (!get_path_arg(out_path_arg, arg_entries, COUNTOF(arg_entries), L"out"))
+		return 1;
+	const auto out_stdout = is_stdio_path(out_path_arg);
+	char out_path[max_path_size];
+	const auto out_canonical_selector_result = out_stdout ? CanonicalSelectorResult::File : get_canonical_selector(out_path, sizeof(out_path), out_path_arg, 0);
 	if (out_canonical_selector_result == CanonicalSelectorResult::None) return 1;
+	if (out_stdout)
+		strlcpy(out_path, stdio_path, sizeof(out_path));
+
+	if (out_stdout && in_canonical_selector_result >= CanonicalSelectorResult::Directory)
+	{
+		wprintf(L"Only a single file can be written to stdout!\n");
+		return 1;
+	}
+
+	if (in_stdin && out_canonical_selector_result >= CanonicalSelectorResult::Directory)
+	{
+		wprintf(L"Please specify an output file or - for stdout!\n");
+		return 1;
+	}
+
+#ifdef _WIN32
+	if (get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"watch"))
+	{
+		wprintf(L"--watch is only supported on Linux!\n");
+		return 1;
+	}
+#endif
+
+	if ((in_stdin || out_stdout) && (get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"incremental") || get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"watch")))
+	{
+		wprintf(L"--incremental and --watch can't be used with stdin or stdout!\n");
+		return 1;
+	}
+
+	// Messages go to stderr from here on, so they don't end up in the output
+	const auto stdout_handle = out_stdout ? take_stdout_handle() : invalid_file_handle;
+	if (out_stdout && stdout_handle == invalid_file_handle)
+	{
+		wprintf(L"Failed to write to stdout!\n");
+		return 1;
+	}
 
 	if (in_canonical_selector_result >= CanonicalSelectorResult::Directory && out_canonical_selector_result == CanonicalSelectorResult::File)
 	{
@@ -356,40 +1240,98 @@ int MAIN(int argc, const wchar_t** argv)
 		return 1;
 	}
 
-	wchar_t in_path_dir[64];
-	if (!get_path_dir(in_path_dir, COUNTOF(in_path_dir), in_path))
+	char in_path_dir[max_path_size];
+	if (!get_path_dir(in_path_dir, sizeof(in_path_dir), in_path))
 		return 1;
 
-	wchar_t out_path_dir[64];
-	if (!get_path_dir(out_path_dir, COUNTOF(out_path_dir), out_path))
+	// So includes are resolved without looking up the current directory every time
+	char in_path_full_dir[max_path_size];
+	const auto in_path_full_dir_size = get_full_path_name(in_path_full_dir, sizeof(in_path_full_dir), in_path_dir[0] ? in_path_dir : "." PATH_SEPARATOR, 0);
+	if (!in_path_full_dir_size)
+	{
+		wprintf(L"File path is too large!\n");
+		return 1;
+	}
+	const auto in_path_dir_id = path_pool_intern(g_paths, in_path_full_dir, in_path_full_dir_size);
+	if (!in_path_dir_id)
+		return 1;
+
+	OwnedBuffer include_dirs_memory((char*)memory_alloc(argc * (sizeof(wchar_t*) + sizeof(PathId))), argc * (sizeof(wchar_t*) + sizeof(PathId)));
+	if (!include_dirs_memory.content)
+	{
+		wprintf(L"Failed to allocate memory!\n");
 		return 1;
+	}
+	const auto include_dir_args = (const wchar_t**)include_dirs_memory.content;
+	const auto include_dirs = (PathId*)(include_dir_args + argc);
+	const auto include_dirs_count = get_arg_entry_values(include_dir_args, arg_entries, COUNTOF(arg_entries), L"include", argc, argv);
+	for (int i = 0; i < include_dirs_count; i++)
+	{
+		if (!get_include_dir(include_dirs[i], include_dir_args[i]))
+			return 1;
+	}
 
-	if (!PathFileExistsW(out_path_dir))
+	char out_path_dir[max_path_size];
+	if (!get_path_dir(out_path_dir, sizeof(out_path_dir), out_path))
+		return 1;
+
+	if (out_path_dir[0] && !path_exists(out_path_dir))
 	{
-		nice_wprintf(L"Output directory \"%ls\" doesn't exist!\n", out_path_dir);
-		wchar_t create_out_path_dir[64];
-		memcpy(create_out_path_dir, out_path_dir, sizeof(out_path_dir));
-		while (true)
+		nice_wprintf(L"Output directory \"%hs\" doesn't exist!\n", out_path_dir);
+		log_info(L"Creating directory \"%hs\"...\n", out_path_dir);
+		if (!create_directories(out_path_dir))
 		{
-			nice_wprintf(L"Creating directory \"%ls\"...\n", create_out_path_dir);
-			if (CreateDirectoryW(create_out_path_dir, 0) != ERROR_PATH_NOT_FOUND)
-				break;
-			if (!get_parent_path_dir(create_out_path_dir, COUNTOF(create_out_path_dir), create_out_path_dir))
-				break;
+			nice_wprintf(L"Failed to create directory \"%hs\"!\n", out_path_dir);
+			return 1;
+		}
+	}
+
+	u32 jobs_count = get_hardware_concurrency();
+	if (const auto jobs_arg = get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"jobs"))
+	{
+		const auto jobs = wcstol(jobs_arg, 0, 10);
+		if (jobs <= 0)
+		{
+			nice_wprintf(L"Invalid number of jobs \"%ls\"!\n", jobs_arg);
+			return 1;
 		}
+		jobs_count = (u32)jobs;
 	}
 
+	FileJobs file_jobs = {};
+	const auto recursive = get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"recursive") != 0;
+	if (in_stdin)
+	{
+		const FileJob job = {
+			.in_file_path = path_pool_intern(g_paths, in_path),
+			.out_file_path = path_pool_intern(g_paths, out_path),
+			.in_file_dir = in_path_dir_id,
+		};
+		if (!job.in_file_path || !job.out_file_path || !file_jobs_push(file_jobs, job))
+		{
+			file_jobs_free(file_jobs);
+			return 1;
+		}
+	}
+	else if (recursive && in_canonical_selector_result >= CanonicalSelectorResult::Directory)
+	{
+		if (!collect_file_jobs_recursive(file_jobs, in_path, in_path_dir, in_path_full_dir, out_path_dir, jobs_count))
+		{
+			file_jobs_free(file_jobs);
+			return 1;
+		}
+	}
+	else
 	{
-		WIN32_FIND_DATAW ffd;
-		auto search_handle = FindFirstFileW(in_path, &ffd);
-		if (INVALID_HANDLE_VALUE == search_handle) {
+		DirectorySearch search;
+		if (!directory_search_first(search, in_path)) {
 			switch (in_canonical_selector_result)
 			{
 				case CanonicalSelectorResult::File:
-					nice_wprintf(L"File \"%ls\" not found!\n", in_path);
+					nice_wprintf(L"File \"%hs\" not found!\n", in_path);
 					break;
 				case CanonicalSelectorResult::Files:
-					nice_wprintf(L"No matching files found for \"%ls\"!\n", in_path);
+					nice_wprintf(L"No matching files found for \"%hs\"!\n", in_path);
 					break;
 			}
 			return 1;
@@ -397,122 +1339,272 @@ int MAIN(int argc, const wchar_t** argv)
 		int items_found = 0;
 		do {
 			items_found++;
-			if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			if (search.is_directory)
 				continue;
 
-			const auto in_file_name = ffd.cFileName;
-			wchar_t in_file_path[64];
+			const auto in_file_name = search.file_name;
+			FileJob job = {.in_file_dir = in_path_dir_id, .size = search.file_size};
+			char file_path[max_path_size];
 			// generate in_file_path {{{
-			if (wcslcpy(in_file_path, in_path_dir, COUNTOF(in_file_path)) >= COUNTOF(in_file_path))
-			{
-				wprintf(L"File path is too large!\n");
-				continue;
-			}
-			if (wcslcat(in_file_path, in_file_name, COUNTOF(in_file_path)) >= COUNTOF(in_file_path))
+			if (strlcpy(file_path, in_path_dir, sizeof(file_path)) >= sizeof(file_path) ||
+				strlcat(file_path, in_file_name, sizeof(file_path)) >= sizeof(file_path))
 			{
 				wprintf(L"File path is too large!\n");
 				continue;
 			}
+			job.in_file_path = path_pool_intern(g_paths, file_path);
 			// }}}
 
-			wchar_t out_file_path[64];
 			// generate out_file_path {{{
 			if (out_canonical_selector_result >= CanonicalSelectorResult::Directory)
 			{
-				if (wcslcpy(out_file_path, out_path_dir, COUNTOF(out_file_path)) >= COUNTOF(out_file_path))
-				{
-					wprintf(L"File path is too large!\n");
-					continue;
-				}
-				if (wcslcat(out_file_path, in_file_name, COUNTOF(out_file_path)) >= COUNTOF(out_file_path))
+				if (strlcpy(file_path, out_path_dir, sizeof(file_path)) >= sizeof(file_path) ||
+					strlcat(file_path, in_file_name, sizeof(file_path)) >= sizeof(file_path))
 				{
 					wprintf(L"File path is too large!\n");
 					continue;
 				}
 			}
 			else
-			{
-				if (wcslcpy(out_file_path, out_path, COUNTOF(out_file_path)) >= COUNTOF(out_file_path))
-				{
-					wprintf(L"File path is too large!\n");
-					continue;
-				}
-			}
+				strlcpy(file_path, out_path, sizeof(file_path));
+			job.out_file_path = path_pool_intern(g_paths, file_path);
 			// }}}
 
-			nice_wprintf(L"Processing file \"%ls\"...\n", in_file_path);
+			if (!job.in_file_path || !job.out_file_path || !file_jobs_push(file_jobs, job))
+				break;
+		}
+		while (directory_search_next(search));
 
-			const auto in_file_buffer = read_file_to_unix_buffer(in_file_path);
-			if (!in_file_buffer.content)
-				continue;
+		directory_search_close(search);
 
-			int out_file_buffer_index = 0;
-			Buffer out_file_buffers[] = {in_file_buffer, {}};
-			while (true)
-			{
-				auto next_out_file_buffer_index = (out_file_buffer_index + 1) % 2;
-				auto ret = process_replace_include(out_file_buffers[next_out_file_buffer_index], out_file_buffers[out_file_buffer_index], in_path_dir);
-				if (ret == 0)
-					break;
-				else if (ret == -1)
-					continue;
+		if (in_canonical_selector_result == CanonicalSelectorResult::Directory && items_found == 2)
+			nice_wprintf(L"Directory \"%hs\" is empty!\n", in_path_dir);
 
-				out_file_buffer_index = next_out_file_buffer_index;
-			}
-				
-/*
-				{
-					DefineStatement define;
-					out_file_buffer = in_file_buffer2;
-					const auto size1 = process_define(define, in_file_buffer2);
-					if (!size1) break;
-					out_file_buffer.size = size1;
-
-					out_file_buffer.content = (char*)VirtualAlloc(0, out_file_buffer.size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-					if (!out_file_buffer.content)
-					{
-						wprintf(L"Failed to allocate memory!\n");
-						continue;
-					}
-
-					auto out_file_buffer_end = out_file_buffer.content;
-					auto in_file_buffer_cursor = in_file_buffer2.content;
-
-					while (true)
-					{
-						const auto size = define.start_location - in_file_buffer_cursor;
-						memcpy(out_file_buffer_end, in_file_buffer_cursor, size);
-						in_file_buffer_cursor = define.end_location + 1;
-						out_file_buffer_end += size;
-					}
-
-					{
-						const auto size = in_file_buffer2.size - (in_file_buffer_cursor - in_file_buffer2.content);
-						memcpy(out_file_buffer_end, in_file_buffer_cursor, size);
-					}
-				}
-				*/
+		if (search.failed)
+		{
+			file_jobs_free(file_jobs);
+			return 1;
+		}
+	}
 
-			const auto out_file_handle = create_wo_file(out_file_path);
-			if (!out_file_handle) continue;
+	// Includes resolve differently with other search directories, so the
+	// manifest and the header cache of a run with others are stale
+	u64 options_hash = include_dirs_count;
+	for (int i = 0; i < include_dirs_count; i++)
+		options_hash = hash_merge_round(options_hash, get_path_hash(include_dirs[i]));
+
+	const auto incremental = get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"incremental") != 0;
+	char manifest_path[max_path_size];
+	Manifest manifest = {};
+	u32 up_to_date_count = 0;
+	if (incremental)
+	{
+		// generate manifest_path next to the output directory or file {{{
+		strlcpy(manifest_path, out_canonical_selector_result >= CanonicalSelectorResult::Directory ? out_path_dir : out_path, sizeof(manifest_path));
+		for (auto size = strlen(manifest_path); size && (manifest_path[size - 1] == '/' || manifest_path[size - 1] == '\\'); size--)
+			manifest_path[size - 1] = 0;
+		if (strlcat(manifest_path, ".parsa_manifest", sizeof(manifest_path)) >= sizeof(manifest_path))
+		{
+			wprintf(L"File path is too large!\n");
+			file_jobs_free(file_jobs);
+			return 1;
+		}
+		// }}}
 
-			const auto out_file_buffer = out_file_buffers[out_file_buffer_index];
-			if (!write_file(out_file_handle, out_file_path, out_file_buffer))
-				continue;
+		if (!manifest_load(manifest, manifest_path, options_hash))
+		{
+			file_jobs_free(file_jobs);
+			return 1;
+		}
 
+		DependencyStates dependency_states = {};
+		for (u32 i = 0; i < file_jobs.count; i++)
+		{
+			auto& job = file_jobs.jobs[i];
+			const auto record = manifest_find(manifest, job.out_file_path);
+			job.up_to_date = record && is_manifest_record_up_to_date(*record, dependency_states);
+			up_to_date_count += job.up_to_date;
 		}
-		while (FindNextFileW(search_handle, &ffd));
+		dependency_states_free(dependency_states);
 
-		FindClose(search_handle);
+		log_info(L"%u of %u files are up to date\n", up_to_date_count, file_jobs.count);
+	}
 
-		if (in_canonical_selector_result == CanonicalSelectorResult::Directory && items_found == 2)
-			nice_wprintf(L"Directory \"%ls\" is empty!\n", in_path_dir);
+	const auto watch = get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"watch") != 0;
+	char stats_path_arg[max_path_size];
+	char trace_path_arg[max_path_size];
+	char header_cache_path_arg[max_path_size];
+	if (!get_path_arg(stats_path_arg, arg_entries, COUNTOF(arg_entries), L"stats") || !get_path_arg(trace_path_arg, arg_entries, COUNTOF(arg_entries), L"trace") ||
+		!get_path_arg(header_cache_path_arg, arg_entries, COUNTOF(arg_entries), L"header-cache"))
+	{
+		manifest_free(manifest);
+		file_jobs_free(file_jobs);
+		return 1;
+	}
+	const auto stats_path = stats_path_arg[0] ? stats_path_arg : 0;
+	const auto trace_path = trace_path_arg[0] ? trace_path_arg : 0;
+	const auto header_cache_path = header_cache_path_arg[0] ? header_cache_path_arg : 0;
 
-		const auto error = GetLastError();
-		if (ERROR_NO_MORE_FILES != error)
-			return 1;
+	HeaderSnapshots header_snapshots = {};
+	if (header_cache_path && !header_snapshots_load(header_snapshots, header_cache_path, options_hash))
+	{
+		header_snapshots_free(header_snapshots);
+		manifest_free(manifest);
+		file_jobs_free(file_jobs);
+		return 1;
+	}
+
+	// Snapshots are only used while the files they were expanded from have the same hash
+	IncludeCache include_cache = {.hash_contents = incremental || header_cache_path};
+	IncludeResolver include_resolver = {.search_dirs = include_dirs, .search_dirs_count = (u32)include_dirs_count};
+	ProcessContext context = {
+		.jobs = file_jobs.jobs,
+		.jobs_count = file_jobs.count - up_to_date_count,
+		.include_cache = &include_cache,
+		.include_resolver = &include_resolver,
+		.stdout_handle = stdout_handle,
+		.arenas = (Arena*)memory_alloc(jobs_count * sizeof(Arena)),
+		// Both need to know what every output was expanded from
+		.results = incremental || watch ? (JobResult*)memory_alloc((file_jobs.count ? file_jobs.count : 1) * sizeof(JobResult)) : 0,
+		.stats = stats_path ? (FileStats*)memory_alloc((file_jobs.count ? file_jobs.count : 1) * sizeof(FileStats)) : 0,
+		.traces = trace_path ? (TraceBuffer*)memory_alloc(jobs_count * sizeof(TraceBuffer)) : 0,
+		.restat = get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"restat") != 0,
+		.snapshots = header_cache_path ? &header_snapshots : 0,
+		.header_cache_path = header_cache_path,
+	};
+	if (!context.arenas || ((incremental || watch) && !context.results) || (stats_path && !context.stats) || (trace_path && !context.traces))
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		memory_free(context.arenas);
+		memory_free(context.results);
+		memory_free(context.stats);
+		memory_free(context.traces);
+		header_snapshots_free(header_snapshots);
+		manifest_free(manifest);
+		file_jobs_free(file_jobs);
+		return 1;
+	}
+
+	if (get_arg_entry_value(arg_entries, COUNTOF(arg_entries), L"io-uring") && !io_rings_init(context, jobs_count, file_jobs.count))
+	{
+		memory_free(context.arenas);
+		memory_free(context.results);
+		memory_free(context.stats);
+		memory_free(context.traces);
+		header_snapshots_free(header_snapshots);
+		manifest_free(manifest);
+		file_jobs_free(file_jobs);
+		return 1;
+	}
+
+	// Largest files first, so the run doesn't end waiting on one huge file
+	const auto items = file_jobs_sort_by_size(file_jobs);
+	if (items.content)
+	{
+		const auto sorted_items = (const u32*)items.content;
+		OwnedBuffer pending_memory((char*)memory_alloc(file_jobs.count * sizeof(u32)), file_jobs.count * sizeof(u32));
+		if (pending_memory.content)
+		{
+			const auto pending_items = (u32*)pending_memory.content;
+			u32 pending_count = 0;
+			for (u32 i = 0; i < file_jobs.count; i++)
+			{
+				if (!file_jobs.jobs[sorted_items[i]].up_to_date)
+					pending_items[pending_count++] = sorted_items[i];
+			}
+
+			const auto run_start = get_time_ns();
+			if (!trace_path || trace_buffers_init(context.traces, jobs_count))
+				thread_pool_run(jobs_count, pending_items, pending_count, process_file_job, &context);
+			// The calling thread is one of the workers
+			t_trace = 0;
+			io_rings_drain(context, jobs_count, file_jobs.count);
+			log_run_summary(context, up_to_date_count, get_time_ns() - run_start);
+
+			if (stats_path)
+				save_stats(stats_path, file_jobs, context.stats, jobs_count, get_time_ns() - run_start);
+			if (trace_path)
+				save_trace(trace_path, context.traces, jobs_count, run_start);
+			if (header_cache_path)
+				header_snapshots_save(header_snapshots, header_cache_path);
+		}
+		else
+			wprintf(L"Failed to allocate memory!\n");
+
+		if (incremental)
+			save_manifest(manifest_path, manifest, file_jobs, context.results);
+
+		if (watch)
+			watch_file_jobs(file_jobs, context, jobs_count, sorted_items, incremental ? manifest_path : 0, manifest);
+	}
+
+	io_rings_free(context, jobs_count);
+	for (u32 i = 0; i < jobs_count; i++)
+		arena_free(context.arenas[i]);
+	memory_free(context.arenas);
+
+	if (context.results)
+	{
+		for (u32 i = 0; i < file_jobs.count; i++)
+			memory_free(context.results[i].dependencies);
+		memory_free(context.results);
+	}
+	memory_free(context.stats);
+	if (context.traces)
+	{
+		trace_buffers_free(context.traces, jobs_count);
+		memory_free(context.traces);
 	}
+	manifest_free(manifest);
+
+	log_verbose(L"Include cache: %llu hits, %llu misses\n", include_cache.hits.load(), include_cache.misses.load());
+	log_verbose(L"Include resolution cache: %llu hits, %llu misses\n", include_resolver.hits.load(), include_resolver.misses.load());
+	if (header_cache_path)
+		log_verbose(L"Header snapshots: %llu hits, %llu misses\n", header_snapshots.hits.load(), header_snapshots.misses.load());
+	header_snapshots_free(header_snapshots);
+	include_cache_free(include_cache);
+	include_resolver_free(include_resolver);
+	file_jobs_free(file_jobs);
+	path_pool_free(g_paths);
 
 	return 0;
 }
 
+#ifndef _WIN32
+int wmain(int argc, const wchar_t** argv);
+
+int main(int argc, char** argv)
+{
+	// Wide characters can only be printed with a UTF-8 locale
+	setlocale(LC_ALL, "");
+	setlocale(LC_CTYPE, "C.UTF-8");
+
+	u64 wide_argv_size = argc * sizeof(wchar_t*);
+	for (int i = 0; i < argc; i++)
+		wide_argv_size += (strlen(argv[i]) + 1) * sizeof(wchar_t);
+
+	const auto wide_argv = (const wchar_t**)memory_alloc(wide_argv_size);
+	if (!wide_argv)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 1;
+	}
+
+	auto wide_arg = (wchar_t*)(wide_argv + argc);
+	for (int i = 0; i < argc; i++)
+	{
+		const auto arg_size = strlen(argv[i]);
+		if (arg_size && !utf8_to_wide(wide_arg, arg_size + 1, argv[i], arg_size))
+		{
+			wprintf(L"Argument %d isn't valid UTF-8!\n", i);
+			return 1;
+		}
+		wide_argv[i] = wide_arg;
+		wide_arg += arg_size + 1;
+	}
+
+	const auto result = wmain(argc, wide_argv);
+	memory_free(wide_argv);
+	return result;
+}
+#endif
@@ -0,0 +1,411 @@
+// Inputs every output was expanded from during the last --incremental run,
+// with their content hashes. Kept in a single file next to the output, along
+// with a hash of the options that change how inputs expand.
+
+struct Dependency {
+	PathId path;
+	// Of the file itself, the hash is of its unix buffer
+	u64 size;
+	u64 last_write_time;
+	u64 hash;
+};
+
+struct Dependencies {
+	Dependency* items;
+	u32 count;
+	u32 capacity;
+	Arena* arena;
+};
+
+struct ManifestRecord {
+	PathId out_path;
+	u64 out_size;
+	Dependency* dependencies;
+	u32 dependencies_count;
+};
+
+struct Manifest {
+	// Open addressing by out_path
+	ManifestRecord* records;
+	u64 capacity;
+	u64 count;
+	// Every record points into it
+	Dependency* dependencies;
+	// Of the options of the run, the manifest of a run with others is stale
+	u64 options_hash;
+};
+
+constexpr u64 manifest_magic = 0x32464d4153524150; // "PARSAMF2"
+
+// Headers included more than once are only recorded the first time
+bool dependencies_push(Dependencies& dependencies, const Dependency& dependency)
+{
+	for (u32 i = 0; i < dependencies.count; i++)
+	{
+		if (dependencies.items[i].path == dependency.path)
+			return 1;
+	}
+
+	if (dependencies.count == dependencies.capacity)
+	{
+		const auto new_capacity = dependencies.capacity ? dependencies.capacity * 2 : 32;
+		const auto new_items = (Dependency*)arena_realloc(*dependencies.arena, dependencies.items, dependencies.count * sizeof(Dependency), new_capacity * sizeof(Dependency));
+		if (!new_items)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+		dependencies.items = new_items;
+		dependencies.capacity = new_capacity;
+	}
+
+	dependencies.items[dependencies.count++] = dependency;
+	return 1;
+}
+
+ManifestRecord* manifest_find_slot(ManifestRecord* records, const u64 capacity, const PathId out_path)
+{
+	auto index = get_path_hash(out_path) & (capacity - 1);
+	while (true)
+	{
+		auto& record = records[index];
+		if (!record.out_path || record.out_path == out_path)
+			return &record;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+ManifestRecord* manifest_find(Manifest& manifest, const PathId out_path)
+{
+	if (!manifest.count) return 0;
+
+	auto& record = *manifest_find_slot(manifest.records, manifest.capacity, out_path);
+	return record.out_path ? &record : 0;
+}
+
+void manifest_free(Manifest& manifest)
+{
+	memory_free(manifest.records);
+	memory_free(manifest.dependencies);
+	manifest = {};
+}
+
+struct ManifestReader {
+	const char* cursor;
+	const char* end;
+	bool failed;
+};
+
+void manifest_read(ManifestReader& reader, void* dest, const u64 size)
+{
+	if (reader.failed || (u64)(reader.end - reader.cursor) < size)
+	{
+		reader.failed = 1;
+		memset(dest, 0, size);
+		return;
+	}
+
+	memcpy(dest, reader.cursor, size);
+	reader.cursor += size;
+}
+
+void manifest_read_path(ManifestReader& reader, PathId& path)
+{
+	u16 path_size;
+	manifest_read(reader, &path_size, sizeof(path_size));
+	if (reader.failed || !path_size || (u64)(reader.end - reader.cursor) < path_size || !(path = path_pool_intern(g_paths, reader.cursor, path_size)))
+	{
+		reader.failed = 1;
+		return;
+	}
+	reader.cursor += path_size;
+}
+
+// A missing or unreadable manifest, or one written with other options, leaves
+// it empty, so everything is rebuilt
+bool manifest_load(Manifest& manifest, const char* manifest_path, const u64 options_hash)
+{
+	manifest = {.options_hash = options_hash};
+
+	FileInfo file_info;
+	if (!get_file_info(manifest_path, file_info) || !file_info.size)
+		return 1;
+
+	const auto file_view = create_ro_file_view(manifest_path);
+	if (!file_view.buffer.content)
+		return 1;
+
+	ManifestReader reader = {.cursor = file_view.buffer.content, .end = file_view.buffer.content + file_view.buffer.size};
+
+	u64 magic;
+	u64 manifest_options_hash;
+	u32 records_count;
+	u32 dependencies_count;
+	manifest_read(reader, &magic, sizeof(magic));
+	manifest_read(reader, &manifest_options_hash, sizeof(manifest_options_hash));
+	manifest_read(reader, &records_count, sizeof(records_count));
+	manifest_read(reader, &dependencies_count, sizeof(dependencies_count));
+	// Every record and dependency takes more than one byte, so this bounds the allocations
+	if (reader.failed || magic != manifest_magic || records_count > file_view.buffer.size || dependencies_count > file_view.buffer.size)
+	{
+		nice_wprintf(L"Manifest \"%hs\" is invalid, rebuilding everything\n", manifest_path);
+		close_file_view(file_view);
+		return 1;
+	}
+	if (manifest_options_hash != options_hash)
+	{
+		nice_wprintf(L"Options changed since manifest \"%hs\" was written, rebuilding everything\n", manifest_path);
+		close_file_view(file_view);
+		return 1;
+	}
+
+	auto capacity = 256ull;
+	while (capacity < (u64)records_count * 2)
+		capacity *= 2;
+
+	manifest.records = (ManifestRecord*)memory_alloc(capacity * sizeof(ManifestRecord));
+	manifest.dependencies = (Dependency*)memory_alloc((dependencies_count ? dependencies_count : 1) * sizeof(Dependency));
+	if (!manifest.records || !manifest.dependencies)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		manifest_free(manifest);
+		close_file_view(file_view);
+		return 0;
+	}
+	manifest.capacity = capacity;
+
+	u32 dependencies_read = 0;
+	for (u32 i = 0; i < records_count && !reader.failed; i++)
+	{
+		ManifestRecord record = {};
+		manifest_read_path(reader, record.out_path);
+		manifest_read(reader, &record.out_size, sizeof(record.out_size));
+		manifest_read(reader, &record.dependencies_count, sizeof(record.dependencies_count));
+		if (reader.failed || record.dependencies_count > dependencies_count - dependencies_read)
+		{
+			reader.failed = 1;
+			break;
+		}
+
+		record.dependencies = manifest.dependencies + dependencies_read;
+		for (u32 j = 0; j < record.dependencies_count; j++)
+		{
+			auto& dependency = record.dependencies[j];
+			manifest_read_path(reader, dependency.path);
+			manifest_read(reader, &dependency.size, sizeof(dependency.size));
+			manifest_read(reader, &dependency.last_write_time, sizeof(dependency.last_write_time));
+			manifest_read(reader, &dependency.hash, sizeof(dependency.hash));
+		}
+		dependencies_read += record.dependencies_count;
+
+		if (reader.failed)
+			break;
+		auto& slot = *manifest_find_slot(manifest.records, manifest.capacity, record.out_path);
+		if (!slot.out_path)
+			manifest.count++;
+		slot = record;
+	}
+
+	close_file_view(file_view);
+
+	if (reader.failed)
+	{
+		nice_wprintf(L"Manifest \"%hs\" is invalid, rebuilding everything\n", manifest_path);
+		manifest_free(manifest);
+		manifest.options_hash = options_hash;
+	}
+	return 1;
+}
+
+struct ManifestWriter {
+	char* cursor;
+	// Only measures when there is no buffer yet
+	u64 size;
+};
+
+void manifest_write(ManifestWriter& writer, const void* data, const u64 size)
+{
+	if (writer.cursor)
+	{
+		memcpy(writer.cursor, data, size);
+		writer.cursor += size;
+	}
+	writer.size += size;
+}
+
+void manifest_write_path(ManifestWriter& writer, const PathId path)
+{
+	// Paths are shorter than max_path_size, so the size always fits
+	const auto& entry = path_pool_entry(g_paths, path);
+	const auto path_size = (u16)entry.size;
+	manifest_write(writer, &path_size, sizeof(path_size));
+	manifest_write(writer, entry.path, path_size);
+}
+
+void manifest_write_records(ManifestWriter& writer, const ManifestRecord* records, const u64 records_count, const u64 options_hash)
+{
+	u32 dependencies_count = 0;
+	for (u64 i = 0; i < records_count; i++)
+		dependencies_count += records[i].dependencies_count;
+
+	const auto records_count_u32 = (u32)records_count;
+	manifest_write(writer, &manifest_magic, sizeof(manifest_magic));
+	manifest_write(writer, &options_hash, sizeof(options_hash));
+	manifest_write(writer, &records_count_u32, sizeof(records_count_u32));
+	manifest_write(writer, &dependencies_count, sizeof(dependencies_count));
+
+	for (u64 i = 0; i < records_count; i++)
+	{
+		const auto& record = records[i];
+		manifest_write_path(writer, record.out_path);
+		manifest_write(writer, &record.out_size, sizeof(record.out_size));
+		manifest_write(writer, &record.dependencies_count, sizeof(record.dependencies_count));
+		for (u32 j = 0; j < record.dependencies_count; j++)
+		{
+			const auto& dependency = record.dependencies[j];
+			manifest_write_path(writer, dependency.path);
+			manifest_write(writer, &dependency.size, sizeof(dependency.size));
+			manifest_write(writer, &dependency.last_write_time, sizeof(dependency.last_write_time));
+			manifest_write(writer, &dependency.hash, sizeof(dependency.hash));
+		}
+	}
+}
+
+// Written next to it first, so an interrupted run never leaves a broken manifest behind
+bool manifest_save(const char* manifest_path, const ManifestRecord* records, const u64 records_count, const u64 options_hash)
+{
+	char temp_path[max_path_size];
+	if (strlcpy(temp_path, manifest_path, sizeof(temp_path)) >= sizeof(temp_path) ||
+		strlcat(temp_path, ".tmp", sizeof(temp_path)) >= sizeof(temp_path))
+	{
+		wprintf(L"File path is too large!\n");
+		return 0;
+	}
+
+	ManifestWriter writer = {};
+	manifest_write_records(writer, records, records_count, options_hash);
+
+	OwnedBuffer buffer((char*)memory_alloc(writer.size), writer.size);
+	if (!buffer.content)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	writer = {.cursor = buffer.content};
+	manifest_write_records(writer, records, records_count, options_hash);
+
+	const auto file_handle = create_wo_file(temp_path);
+	if (file_handle == invalid_file_handle)
+		return 0;
+
+	const OutputSlice slice = {.content = buffer.content, .size = buffer.size};
+	const auto written = write_file_slices(file_handle, temp_path, &slice, 1);
+	close_file(file_handle);
+
+	return written && replace_file(temp_path, manifest_path);
+}
+
+// States of the dependencies checked so far, since most headers are shared by many outputs
+struct DependencyStates {
+	struct Entry {
+		PathId path;
+		bool unchanged;
+	};
+
+	Entry* entries;
+	u64 capacity;
+	u64 count;
+};
+
+DependencyStates::Entry* dependency_states_find_slot(DependencyStates::Entry* entries, const u64 capacity, const PathId path)
+{
+	auto index = get_path_hash(path) & (capacity - 1);
+	while (true)
+	{
+		auto& entry = entries[index];
+		if (!entry.path || entry.path == path)
+			return &entry;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+bool dependency_states_grow(DependencyStates& states)
+{
+	const auto new_capacity = states.capacity ? states.capacity * 2 : 256;
+	const auto new_entries = (DependencyStates::Entry*)memory_alloc(new_capacity * sizeof(DependencyStates::Entry));
+	if (!new_entries)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	for (u64 i = 0; i < states.capacity; i++)
+	{
+		const auto& entry = states.entries[i];
+		if (!entry.path) continue;
+		*dependency_states_find_slot(new_entries, new_capacity, entry.path) = entry;
+	}
+
+	memory_free(states.entries);
+	states.entries = new_entries;
+	states.capacity = new_capacity;
+	return 1;
+}
+
+void dependency_states_free(DependencyStates& states)
+{
+	memory_free(states.entries);
+	states = {};
+}
+
+// Files whose size and write time didn't change are trusted, touched ones are hashed again
+bool is_dependency_unchanged(Dependency& dependency)
+{
+	FileInfo file_info;
+	if (!get_file_info(get_path(dependency.path), file_info) || file_info.size != dependency.size)
+		return 0;
+	if (file_info.last_write_time == dependency.last_write_time || !file_info.size)
+		return 1;
+
+	const auto unix_buffer = read_file_to_unix_buffer(get_path(dependency.path));
+	if (!unix_buffer.buffer.content)
+		return 0;
+
+	const auto unchanged = hash_bytes(unix_buffer.buffer.content, unix_buffer.buffer.size) == dependency.hash;
+	free_unix_buffer(unix_buffer);
+
+	// So it isn't hashed again on the next run
+	if (unchanged)
+		dependency.last_write_time = file_info.last_write_time;
+	return unchanged;
+}
+
+// Whether the output of record can be kept as it is
+bool is_manifest_record_up_to_date(ManifestRecord& record, DependencyStates& states)
+{
+	FileInfo out_file_info;
+	if (!get_file_info(get_path(record.out_path), out_file_info) || out_file_info.size != record.out_size)
+		return 0;
+
+	for (u32 i = 0; i < record.dependencies_count; i++)
+	{
+		auto& dependency = record.dependencies[i];
+
+		if ((states.count + 1) * 2 > states.capacity && !dependency_states_grow(states))
+			return 0;
+
+		auto& entry = *dependency_states_find_slot(states.entries, states.capacity, dependency.path);
+		if (!entry.path)
+		{
+			entry.path = dependency.path;
+			entry.unchanged = is_dependency_unchanged(dependency);
+			states.count++;
+		}
+
+		if (!entry.unchanged)
+			return 0;
+	}
+
+	return 1;
+}
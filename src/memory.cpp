@@ -0,0 +1,163 @@
+// Zero initialized memory, like VirtualAlloc gives us on Windows
+void* memory_alloc(const u64 size)
+{
+#ifdef _WIN32
+	return VirtualAlloc(0, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	return calloc(1, size);
+#endif
+}
+
+void memory_free(void* memory)
+{
+	if (!memory) return;
+#ifdef _WIN32
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	free(memory);
+#endif
+}
+
+// Owns memory_alloc'd memory that has to outlive a job, freed when it goes out of scope
+struct OwnedBuffer {
+	char* content = 0;
+	u64 size = 0;
+
+	OwnedBuffer() = default;
+	OwnedBuffer(char* content, const u64 size) : content(content), size(size) {}
+	OwnedBuffer(const OwnedBuffer&) = delete;
+	OwnedBuffer& operator=(const OwnedBuffer&) = delete;
+	OwnedBuffer(OwnedBuffer&& other) : content(other.content), size(other.size)
+	{
+		other.content = 0;
+		other.size = 0;
+	}
+	OwnedBuffer& operator=(OwnedBuffer&& other)
+	{
+		if (this != &other)
+		{
+			memory_free(content);
+			content = other.content;
+			size = other.size;
+			other.content = 0;
+			other.size = 0;
+		}
+		return *this;
+	}
+	~OwnedBuffer()
+	{
+		memory_free(content);
+	}
+};
+
+// Bump allocator for everything that only lives as long as one job. Blocks are
+// kept when it's reset, so after the first few jobs a worker stops allocating.
+struct alignas(16) ArenaBlock {
+	ArenaBlock* next;
+	u64 capacity;
+	u64 used;
+};
+
+struct Arena {
+	ArenaBlock* first;
+	ArenaBlock* current;
+	// Last allocation, so it can be grown in place
+	char* last;
+};
+
+constexpr u64 arena_block_size = 1 << 20;
+constexpr u64 arena_alignment = 16;
+
+inline char* arena_block_data(ArenaBlock* block)
+{
+	return (char*)(block + 1);
+}
+
+// Not zero initialized once the arena has been reset
+void* arena_alloc(Arena& arena, u64 size)
+{
+	size = (size + arena_alignment - 1) & ~(arena_alignment - 1);
+
+	auto block = arena.current;
+	while (block && block->used + size > block->capacity)
+	{
+		// Reuse the blocks left by the last reset, unless they are too small
+		block = block->next;
+		if (block) block->used = 0;
+	}
+
+	if (!block)
+	{
+		const auto capacity = size > arena_block_size ? size : arena_block_size;
+		block = (ArenaBlock*)memory_alloc(sizeof(ArenaBlock) + capacity);
+		if (!block) return 0;
+		block->capacity = capacity;
+
+		// Goes right after current so the blocks skipped above are reused on the next reset
+		if (arena.current)
+		{
+			block->next = arena.current->next;
+			arena.current->next = block;
+		}
+		else
+			arena.first = block;
+	}
+
+	arena.current = block;
+	arena.last = arena_block_data(block) + block->used;
+	block->used += size;
+	return arena.last;
+}
+
+// Grows memory in place when it is the last allocation, or moves it to a new one
+void* arena_realloc(Arena& arena, void* memory, const u64 size, const u64 new_size)
+{
+	if (memory && memory == arena.last)
+	{
+		const auto block = arena.current;
+		const auto offset = (u64)((char*)memory - arena_block_data(block));
+		const auto aligned_size = (new_size + arena_alignment - 1) & ~(arena_alignment - 1);
+		if (offset + aligned_size <= block->capacity)
+		{
+			block->used = offset + aligned_size;
+			return memory;
+		}
+	}
+
+	const auto new_memory = arena_alloc(arena, new_size);
+	if (new_memory && memory)
+		memcpy(new_memory, memory, size < new_size ? size : new_size);
+	return new_memory;
+}
+
+// Frees every allocation at once in O(1), the blocks are kept for the next job
+void arena_reset(Arena& arena)
+{
+	arena.current = arena.first;
+	arena.last = 0;
+	if (arena.first)
+		arena.first->used = 0;
+}
+
+// Bytes allocated since the last reset, padding included
+u64 arena_used_size(const Arena& arena)
+{
+	u64 result = 0;
+	for (auto block = arena.first; block; block = block->next)
+	{
+		result += block->used;
+		if (block == arena.current) break;
+	}
+	return result;
+}
+
+void arena_free(Arena& arena)
+{
+	for (auto block = arena.first; block;)
+	{
+		const auto next = block->next;
+		memory_free(block);
+		block = next;
+	}
+	arena = {};
+}
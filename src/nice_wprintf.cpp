@@ -1,28 +1,123 @@
 #include <stdio.h>
 #include <assert.h>
+#ifdef _WIN32
 #include "windows_framework.h"
 
 extern HANDLE g_conout;
+#endif
 
-int nice_wprintf(const wchar_t* fmt, ...)
+// Keeps messages of different threads from interleaving
+Mutex g_conout_mutex;
+
+enum class LogLevel {
+	// Errors only
+	Quiet,
+	// Errors and a summary of the run
+	Normal,
+	// Every file as it's processed
+	Verbose,
+};
+
+LogLevel g_log_level = LogLevel::Normal;
+
+// Messages are formatted here. Inside a batch they are only written once the
+// batch ends or the buffer fills up, so a job costs at most one console write.
+struct LogBuffer {
+	wchar_t text[8 * 1024];
+	u32 size;
+	bool batched;
+};
+
+thread_local LogBuffer t_log;
+
+void log_flush()
 {
-	wchar_t buffer[256];
-	va_list args;
-	va_start(args, fmt);
-	const auto chars_to_write = vswprintf(buffer, COUNTOF(buffer), fmt, args);
-	if (chars_to_write < 0)
+	if (!t_log.size) return;
+
+#ifdef _WIN32
+	DWORD chars_written;
+	mutex_lock(g_conout_mutex);
+	if (!WriteConsoleW(g_conout, t_log.text, t_log.size, &chars_written, 0))
+		wprintf(L"%.*ls", (int)t_log.size, t_log.text);
+	mutex_unlock(g_conout_mutex);
+#else
+	// Goes through the same stream as wprintf, so messages stay in order
+	t_log.text[t_log.size] = 0;
+	mutex_lock(g_conout_mutex);
+	fputws(t_log.text, stdout);
+	mutex_unlock(g_conout_mutex);
+#endif
+
+	t_log.size = 0;
+}
+
+int log_vprintf(const wchar_t* fmt, va_list args)
+{
+	// Room for the NUL of vswprintf
+	const auto available = COUNTOF(t_log.text) - 1 - t_log.size;
+
+	va_list retry_args;
+	va_copy(retry_args, args);
+	auto chars_written = vswprintf(t_log.text + t_log.size, available, fmt, args);
+	if (chars_written < 0 && t_log.size)
 	{
-		assert(false && "Buffer not sufficient!");
-		return 0;
+		log_flush();
+		chars_written = vswprintf(t_log.text, COUNTOF(t_log.text) - 1, fmt, retry_args);
 	}
-	va_end(args);
+	va_end(retry_args);
 
-	DWORD chars_written;
-	if (!WriteConsoleW(g_conout, buffer, (DWORD)chars_to_write, &chars_written, 0))
+	if (chars_written < 0)
 	{
-		wprintf(buffer);
+		assert(false && "Buffer not sufficient!");
 		return 0;
 	}
 
+	t_log.size += chars_written;
+	if (!t_log.batched)
+		log_flush();
 	return chars_written;
 }
+
+// Always written, whatever the log level
+int nice_wprintf(const wchar_t* fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	const auto result = log_vprintf(fmt, args);
+	va_end(args);
+	return result;
+}
+
+int log_info(const wchar_t* fmt, ...)
+{
+	if (g_log_level < LogLevel::Normal) return 0;
+
+	va_list args;
+	va_start(args, fmt);
+	const auto result = log_vprintf(fmt, args);
+	va_end(args);
+	return result;
+}
+
+int log_verbose(const wchar_t* fmt, ...)
+{
+	if (g_log_level < LogLevel::Verbose) return 0;
+
+	va_list args;
+	va_start(args, fmt);
+	const auto result = log_vprintf(fmt, args);
+	va_end(args);
+	return result;
+}
+
+// Messages of the calling thread are held until log_batch_end
+void log_batch_begin()
+{
+	t_log.batched = 1;
+}
+
+void log_batch_end()
+{
+	t_log.batched = 0;
+	log_flush();
+}
@@ -0,0 +1,180 @@
+// Every path is interned once, as UTF-8, and referred to by its id from then
+// on, so caches and dependency graphs hash and compare integers instead of
+// strings. Strings never move: ids and pointers stay valid as long as the pool.
+typedef u32 PathId;
+
+// Never handed out, stands for no path
+constexpr PathId invalid_path_id = 0;
+
+struct PathEntry {
+	// NUL terminated, so it can be given to the OS as it is
+	const char* path;
+	u32 size;
+	u64 hash;
+};
+
+constexpr u32 path_pool_page_size = 4096;
+constexpr u32 path_pool_pages_count = 4096;
+
+struct PathPool {
+	Mutex mutex;
+	// Pages are never moved, so entries are read without the lock
+	PathEntry* pages[path_pool_pages_count];
+	// The first id is 1
+	u32 count;
+	// Open addressing over ids, 0 is an empty slot
+	PathId* slots;
+	u64 capacity;
+	Arena strings;
+};
+
+// Every path of the run, shared by all the workers
+PathPool g_paths;
+
+inline const PathEntry& path_pool_entry(const PathPool& pool, const PathId id)
+{
+	return pool.pages[id / path_pool_page_size][id % path_pool_page_size];
+}
+
+inline const char* path_pool_get(const PathPool& pool, const PathId id)
+{
+	return path_pool_entry(pool, id).path;
+}
+
+// Shorthands for the paths of g_paths
+inline const char* get_path(const PathId id)
+{
+	return path_pool_get(g_paths, id);
+}
+
+// Of the string, for the tables keyed by id
+inline u64 get_path_hash(const PathId id)
+{
+	return path_pool_entry(g_paths, id).hash;
+}
+
+PathId* path_pool_find_slot(const PathPool& pool, PathId* slots, const u64 capacity, const char* path, const u32 size, const u64 hash)
+{
+	auto index = hash & (capacity - 1);
+	while (true)
+	{
+		auto& slot = slots[index];
+		if (!slot)
+			return &slot;
+
+		const auto& entry = path_pool_entry(pool, slot);
+		if (entry.hash == hash && entry.size == size && memcmp(entry.path, path, size) == 0)
+			return &slot;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+bool path_pool_grow(PathPool& pool)
+{
+	const auto new_capacity = pool.capacity ? pool.capacity * 2 : 1024;
+	const auto new_slots = (PathId*)memory_alloc(new_capacity * sizeof(PathId));
+	if (!new_slots)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	for (u64 i = 0; i < pool.capacity; i++)
+	{
+		const auto id = pool.slots[i];
+		if (!id) continue;
+		const auto& entry = path_pool_entry(pool, id);
+		*path_pool_find_slot(pool, new_slots, new_capacity, entry.path, entry.size, entry.hash) = id;
+	}
+
+	memory_free(pool.slots);
+	pool.slots = new_slots;
+	pool.capacity = new_capacity;
+	return 1;
+}
+
+// Returns invalid_path_id if the path was never interned
+PathId path_pool_find(PathPool& pool, const char* path, const u64 size)
+{
+	const auto hash = hash_bytes(path, size);
+	mutex_lock_shared(pool.mutex);
+	const auto id = pool.capacity ? *path_pool_find_slot(pool, pool.slots, pool.capacity, path, (u32)size, hash) : invalid_path_id;
+	mutex_unlock_shared(pool.mutex);
+	return id;
+}
+
+// Safe to call from any thread. Returns invalid_path_id if it's out of memory.
+PathId path_pool_intern(PathPool& pool, const char* path, const u64 size)
+{
+	if (size >= max_path_size)
+	{
+		wprintf(L"File path is too large!\n");
+		return invalid_path_id;
+	}
+
+	const auto hash = hash_bytes(path, size);
+	mutex_lock_shared(pool.mutex);
+	auto id = pool.capacity ? *path_pool_find_slot(pool, pool.slots, pool.capacity, path, (u32)size, hash) : invalid_path_id;
+	mutex_unlock_shared(pool.mutex);
+	if (id)
+		return id;
+
+	mutex_lock(pool.mutex);
+	if ((pool.count + 2) * 2 > pool.capacity && !path_pool_grow(pool))
+	{
+		mutex_unlock(pool.mutex);
+		return invalid_path_id;
+	}
+
+	// Another thread may have added it in the meantime
+	auto& slot = *path_pool_find_slot(pool, pool.slots, pool.capacity, path, (u32)size, hash);
+	if (!slot)
+	{
+		const auto new_id = pool.count + 1;
+		if (new_id / path_pool_page_size >= path_pool_pages_count)
+		{
+			mutex_unlock(pool.mutex);
+			wprintf(L"Too many file paths!\n");
+			return invalid_path_id;
+		}
+		auto& page = pool.pages[new_id / path_pool_page_size];
+		if (!page)
+			page = (PathEntry*)memory_alloc(path_pool_page_size * sizeof(PathEntry));
+
+		const auto string = (char*)arena_alloc(pool.strings, size + 1);
+		if (!page || !string)
+		{
+			mutex_unlock(pool.mutex);
+			wprintf(L"Failed to allocate memory!\n");
+			return invalid_path_id;
+		}
+		memcpy(string, path, size);
+		string[size] = 0;
+
+		page[new_id % path_pool_page_size] = {.path = string, .size = (u32)size, .hash = hash};
+		pool.count = new_id;
+		slot = new_id;
+	}
+	id = slot;
+	mutex_unlock(pool.mutex);
+	return id;
+}
+
+inline PathId path_pool_intern(PathPool& pool, const char* path)
+{
+	return path_pool_intern(pool, path, strlen(path));
+}
+
+void path_pool_free(PathPool& pool)
+{
+	for (u32 i = 0; i < path_pool_pages_count; i++)
+	{
+		memory_free(pool.pages[i]);
+		pool.pages[i] = 0;
+	}
+	memory_free(pool.slots);
+	arena_free(pool.strings);
+	pool.count = 0;
+	pool.slots = 0;
+	pool.capacity = 0;
+}
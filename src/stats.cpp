@@ -0,0 +1,100 @@
+// Counters of --stats. Everything that updates them takes a FileStats* that is
+// 0 when --stats isn't given, so the clock is only read when they're collected.
+enum class Phase {
+	Map,
+	Normalize,
+	Scan,
+	// Without the headers read and scanned during the expansion
+	Expand,
+	Write,
+	Count,
+};
+
+const char* phase_names[(int)Phase::Count] = {"map", "normalize", "scan", "expand", "write"};
+
+struct FileStats {
+	u64 bytes_mapped;
+	// Bytes that went through the CRLF conversion
+	u64 bytes_normalized;
+	u64 includes_resolved;
+	u64 cache_hits;
+	u64 cache_misses;
+	u64 bytes_allocated;
+	u64 phase_ns[(int)Phase::Count];
+};
+
+u64 get_time_ns()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (u64)(counter.QuadPart / frequency.QuadPart * 1000000000 + counter.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
+#else
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (u64)time.tv_sec * 1000000000 + time.tv_nsec;
+#endif
+}
+
+void file_stats_add(FileStats& total, const FileStats& stats)
+{
+	total.bytes_mapped += stats.bytes_mapped;
+	total.bytes_normalized += stats.bytes_normalized;
+	total.includes_resolved += stats.includes_resolved;
+	total.cache_hits += stats.cache_hits;
+	total.cache_misses += stats.cache_misses;
+	total.bytes_allocated += stats.bytes_allocated;
+	for (int i = 0; i < (int)Phase::Count; i++)
+		total.phase_ns[i] += stats.phase_ns[i];
+}
+
+// Same as ManifestWriter, a first pass with no cursor only measures the size
+struct StatsWriter {
+	char* cursor;
+	u64 size;
+};
+
+void stats_printf(StatsWriter& writer, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	// Room for the NUL vsnprintf always writes, the buffer has one more byte
+	const auto size = vsnprintf(writer.cursor, writer.cursor ? 1 << 30 : 0, format, args);
+	va_end(args);
+
+	if (size <= 0) return;
+	if (writer.cursor)
+		writer.cursor += size;
+	writer.size += size;
+}
+
+// JSON string of UTF-8 text
+void stats_write_string(StatsWriter& writer, const char* string)
+{
+	stats_printf(writer, "\"");
+	auto run_start = string;
+	for (auto c = string; *c; c++)
+	{
+		if (*c != '"' && *c != '\\' && (u8)*c >= 0x20) continue;
+
+		stats_printf(writer, "%.*s", (int)(c - run_start), run_start);
+		if ((u8)*c < 0x20)
+			stats_printf(writer, "\\u%04x", *c);
+		else
+			stats_printf(writer, "\\%c", *c);
+		run_start = c + 1;
+	}
+	stats_printf(writer, "%s\"", run_start);
+}
+
+void stats_write_file_stats(StatsWriter& writer, const FileStats& stats)
+{
+	stats_printf(writer, "\"bytes_mapped\": %llu, \"bytes_normalized\": %llu, \"includes_resolved\": %llu, \"cache_hits\": %llu, \"cache_misses\": %llu, \"bytes_allocated\": %llu, \"phases_ns\": {",
+		stats.bytes_mapped, stats.bytes_normalized, stats.includes_resolved, stats.cache_hits, stats.cache_misses, stats.bytes_allocated);
+	for (int i = 0; i < (int)Phase::Count; i++)
+		stats_printf(writer, "%s\"%s\": %llu", i ? ", " : "", phase_names[i], stats.phase_ns[i]);
+	stats_printf(writer, "}");
+}
@@ -0,0 +1,249 @@
+// Expands inputs that don't have to fit in memory, like stdin or huge generated
+// files. They are read a chunk at a time and every chunk is cut after its last
+// line that isn't inside a comment or the arguments of a macro, so directives,
+// comments and invocations are never split.
+// What comes after the cut is carried over to the next chunk, and the output of
+// a chunk is written before its buffer is reused.
+
+// Larger inputs are streamed instead of being mapped whole
+constexpr u64 stream_size_threshold = 64ull << 20;
+// Grows when a single line or comment doesn't fit in it
+constexpr u64 stream_chunk_size = 1 << 20;
+
+// Ends a phase of a chunk, only called with --stats or --trace
+u64 end_stream_phase(FileStats* stats, const Phase phase, const char* name, const u64 start_ns, const char* detail)
+{
+	const auto end_ns = get_time_ns();
+	trace_span(name, start_ns, end_ns, detail);
+	if (stats)
+		stats->phase_ns[(int)phase] += end_ns - start_ns;
+	return end_ns;
+}
+
+// Moves the cut of a chunk back so it doesn't split an invocation of a
+// function-like macro: the text before it has to close every ( it opens and
+// can't end with a name, whose arguments may come after. Directives don't
+// count. Returns 0 when no line end is like that.
+u64 find_invocation_cut(const char* text, const u64 cut, const DirectiveIndex& index)
+{
+	const auto end = text + cut;
+	u64 safe_cut = 0;
+	u64 next_directive = 0;
+	u32 depth = 0;
+	bool after_name = 0;
+	auto c = text;
+	while (c < end)
+	{
+		// c is at the start of a line
+		for (; next_directive < index.count && index.directives[next_directive].offset < (u64)(c - text); next_directive++);
+		if (next_directive < index.count && index.directives[next_directive].offset == (u64)(c - text))
+		{
+			c += index.directives[next_directive++].size;
+			continue;
+		}
+
+		for (; c < end && *c != '\n'; )
+		{
+			const auto comment_end = skip_comment(c, end);
+			if (comment_end != c)
+				c = comment_end;
+			else if (*c == '"' || *c == '\'')
+			{
+				c = skip_literal(c, end);
+				after_name = 0;
+			}
+			else if (*c >= '0' && *c <= '9')
+			{
+				c = skip_number(c, end);
+				after_name = 0;
+			}
+			else if (is_identifier_start(*c))
+			{
+				for (c++; c < end && is_identifier_char(*c); c++);
+				after_name = 1;
+			}
+			else
+			{
+				if (*c == '(')
+					depth++;
+				else if (*c == ')' && depth)
+					depth--;
+				if (!is_blank(*c) && !(*c == '\\' && c + 1 < end && c[1] == '\n'))
+					after_name = 0;
+				c++;
+			}
+		}
+		if (c == end) break;
+
+		if (!depth && !after_name && !(c > text && c[-1] == '\\'))
+			safe_cut = c + 1 - text;
+		c++;
+	}
+	return safe_cut;
+}
+
+// Fills chunk from in_handle until it's full or the input ends. [0, normalized)
+// is unix text, the bytes after it still have to be normalized.
+bool fill_stream_chunk(Buffer& chunk, u64& size, u64& normalized, bool& at_end, const FileHandle in_handle, const char* in_file_path, FileStats* stats)
+{
+	const auto timed = stats || t_trace;
+	auto start_ns = timed ? get_time_ns() : 0;
+	while (size < chunk.size)
+	{
+		u64 bytes_read;
+		if (!read_file_data(in_handle, in_file_path, chunk.content + size, chunk.size - size, bytes_read))
+			return 0;
+		if (!bytes_read)
+		{
+			at_end = 1;
+			break;
+		}
+		size += bytes_read;
+		if (stats)
+			stats->bytes_mapped += bytes_read;
+	}
+	if (timed)
+		start_ns = end_stream_phase(stats, Phase::Map, "read_file", start_ns, in_file_path);
+
+	// A '\r' at the end may be the first half of a "\r\n", it waits for the next read
+	const auto raw_end = !at_end && size > normalized && chunk.content[size - 1] == '\r' ? size - 1 : size;
+	const auto dos_le = find_dos_line_ending(chunk.content + normalized, chunk.content + raw_end);
+	if (dos_le)
+	{
+		const auto dos_offset = dos_le - chunk.content;
+		const auto unix_end = dos_offset + normalize_line_endings(chunk.content + dos_offset, dos_le, raw_end - dos_offset);
+		memmove(chunk.content + unix_end, chunk.content + raw_end, size - raw_end);
+		if (stats)
+			stats->bytes_normalized += raw_end - normalized;
+		size -= raw_end - unix_end;
+		normalized = unix_end;
+	}
+	else
+		normalized = raw_end;
+
+	if (timed)
+		end_stream_phase(stats, Phase::Normalize, "normalize", start_ns, in_file_path);
+	return 1;
+}
+
+// Same output as expand_includes on the whole input, written to out_handle as it's expanded
+bool expand_stream(u64& out_size, const FileHandle out_handle, const char* out_file_path, IncludeCache& include_cache, IncludeResolver& include_resolver, TranslationUnit& unit, const FileHandle in_handle, const PathId in_path, const PathId in_dir)
+{
+	const auto in_file_path = get_path(in_path);
+	const auto stats = unit.stats;
+	const auto timed = stats || t_trace;
+
+	Buffer chunk = {.content = (char*)memory_alloc(stream_chunk_size), .size = stream_chunk_size};
+	if (!chunk.content)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	DirectiveIndex index = {};
+	OutputRope out = {};
+	// Replacements of function-like macros only have to outlive the chunk they are in
+	const auto unit_replacements = unit.replacements;
+	Arena replacements = {};
+	unit.replacements = &replacements;
+	u64 size = 0;
+	u64 normalized = 0;
+	bool at_end = 0;
+	bool succeeded = 1;
+	out_size = 0;
+	while (true)
+	{
+		if (size == chunk.size)
+		{
+			const auto new_content = (char*)memory_alloc(chunk.size * 2);
+			if (!new_content)
+			{
+				wprintf(L"Failed to allocate memory!\n");
+				succeeded = 0;
+				break;
+			}
+			memcpy(new_content, chunk.content, size);
+			memory_free(chunk.content);
+			chunk = {.content = new_content, .size = chunk.size * 2};
+		}
+
+		if (!at_end && !fill_stream_chunk(chunk, size, normalized, at_end, in_handle, in_file_path, stats))
+		{
+			succeeded = 0;
+			break;
+		}
+
+		// The last byte is held back until the end, so a line ending there isn't
+		// taken for the last one of the input, which isn't part of the output
+		auto text_size = at_end ? normalized : normalized - (normalized != 0);
+		if (at_end && text_size && chunk.content[text_size - 1] == '\n')
+			text_size--;
+
+		auto start_ns = timed ? get_time_ns() : 0;
+		if (!build_directive_index(index, {.content = chunk.content, .size = text_size}))
+		{
+			succeeded = 0;
+			break;
+		}
+		if (timed)
+			start_ns = end_stream_phase(stats, Phase::Scan, "scan", start_ns, in_file_path);
+
+		const auto cut = at_end ? text_size : find_invocation_cut(chunk.content, index.cut_offset, index);
+		if (!cut && !at_end)
+			continue;
+
+		auto directives_count = index.count;
+		for (; directives_count && index.directives[directives_count - 1].offset >= cut; directives_count--);
+		const SourceFile file = {
+			.buffer = {.content = chunk.content, .size = cut},
+			.directives = index.directives,
+			.directives_count = directives_count,
+		};
+
+		const auto headers_ns = stats ? stats->phase_ns[(int)Phase::Map] + stats->phase_ns[(int)Phase::Normalize] + stats->phase_ns[(int)Phase::Scan] : 0;
+		if (!expand_includes(out, include_cache, include_resolver, unit, file, in_path, in_dir))
+		{
+			succeeded = 0;
+			break;
+		}
+		if (timed)
+		{
+			const auto expand_end = get_time_ns();
+			trace_span("expand", start_ns, expand_end, in_file_path);
+			if (stats)
+				stats->phase_ns[(int)Phase::Expand] += expand_end - start_ns - (stats->phase_ns[(int)Phase::Map] + stats->phase_ns[(int)Phase::Normalize] + stats->phase_ns[(int)Phase::Scan] - headers_ns);
+			start_ns = expand_end;
+		}
+
+		succeeded = write_slices(out_handle, out.slices, out.count);
+		if (!succeeded)
+			nice_wprintf(L"Failed to write to file \"%hs\"!\n", out_file_path);
+		if (timed)
+			end_stream_phase(stats, Phase::Write, "write_file", start_ns, out_file_path);
+		out_size += out.size;
+		out.count = 0;
+		out.size = 0;
+		arena_reset(replacements);
+
+		// Macros defined in the chunk outlive it
+		succeeded = succeeded && symbol_table_pin(unit.symbols, chunk.content, chunk.content + cut);
+		if (!succeeded || at_end)
+			break;
+		memmove(chunk.content, chunk.content + cut, size - cut);
+		size -= cut;
+		normalized -= cut;
+	}
+
+	if (succeeded)
+	{
+		check_conditionals_closed(unit.conditionals, in_path);
+		log_verbose(L"Successfuly wrote to file \"%hs\"\n", out_file_path);
+	}
+
+	memory_free(chunk.content);
+	directive_index_free(index);
+	output_rope_free(out);
+	arena_free(replacements);
+	unit.replacements = unit_replacements;
+	return succeeded;
+}
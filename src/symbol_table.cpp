@@ -0,0 +1,157 @@
+struct MacroPlan;
+
+// Macros of the translation unit being expanded. Names and values aren't
+// copied, they point into the source buffers, which outlive the job.
+// Streamed inputs reuse their buffer, so theirs are pinned chunk by chunk.
+struct Symbol {
+	const char* name;
+	u64 hash;
+	u32 name_size;
+	// #undef keeps the slot, so the probe sequences going through it stay intact
+	bool defined;
+	const char* value;
+	u64 value_size;
+	// Only function-like macros have one, value is their body
+	const MacroPlan* plan;
+};
+
+struct SymbolTable {
+	Symbol* symbols;
+	u64 capacity;
+	// Slots in use, undefined symbols included
+	u64 count;
+	u64 defined_count;
+	// Everything is allocated from it, so the table goes away with the job
+	Arena* arena;
+};
+
+inline bool is_identifier_start(const char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+u64 hash_identifier(const char* name, const u32 name_size)
+{
+	// FNV-1a
+	u64 result = 14695981039346656037ull;
+	for (u32 i = 0; i < name_size; i++)
+	{
+		result ^= (u8)name[i];
+		result *= 1099511628211ull;
+	}
+	return result;
+}
+
+Symbol* symbol_table_find_slot(Symbol* symbols, const u64 capacity, const char* name, const u32 name_size, const u64 hash)
+{
+	auto index = hash & (capacity - 1);
+	while (true)
+	{
+		auto& symbol = symbols[index];
+		if (!symbol.name || (symbol.hash == hash && symbol.name_size == name_size && memcmp(symbol.name, name, name_size) == 0))
+			return &symbol;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+bool symbol_table_grow(SymbolTable& table)
+{
+	const auto new_capacity = table.capacity ? table.capacity * 2 : 256;
+	const auto new_symbols = (Symbol*)arena_alloc(*table.arena, new_capacity * sizeof(Symbol));
+	if (!new_symbols)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+	// Arena memory is reused between jobs
+	memset(new_symbols, 0, new_capacity * sizeof(Symbol));
+
+	// Undefined symbols are dropped on the way
+	u64 count = 0;
+	for (u64 i = 0; i < table.capacity; i++)
+	{
+		const auto& symbol = table.symbols[i];
+		if (!symbol.defined) continue;
+		*symbol_table_find_slot(new_symbols, new_capacity, symbol.name, symbol.name_size, symbol.hash) = symbol;
+		count++;
+	}
+
+	table.symbols = new_symbols;
+	table.capacity = new_capacity;
+	table.count = count;
+	return 1;
+}
+
+// Returns the symbol if it is defined
+const Symbol* symbol_table_find(const SymbolTable& table, const char* name, const u32 name_size)
+{
+	if (!table.defined_count) return 0;
+
+	const auto& symbol = *symbol_table_find_slot(table.symbols, table.capacity, name, name_size, hash_identifier(name, name_size));
+	return symbol.defined ? &symbol : 0;
+}
+
+bool symbol_table_define(SymbolTable& table, const char* name, const u32 name_size, const char* value, const u64 value_size, const MacroPlan* plan = 0)
+{
+	if ((table.count + 1) * 2 > table.capacity && !symbol_table_grow(table))
+		return 0;
+
+	const auto hash = hash_identifier(name, name_size);
+	auto& symbol = *symbol_table_find_slot(table.symbols, table.capacity, name, name_size, hash);
+	if (!symbol.name)
+	{
+		symbol.name = name;
+		symbol.name_size = name_size;
+		symbol.hash = hash;
+		table.count++;
+	}
+	if (!symbol.defined)
+		table.defined_count++;
+
+	symbol.defined = 1;
+	symbol.value = value;
+	symbol.value_size = value_size;
+	symbol.plan = plan;
+	return 1;
+}
+
+void symbol_table_undefine(SymbolTable& table, const char* name, const u32 name_size)
+{
+	if (!table.capacity) return;
+
+	auto& symbol = *symbol_table_find_slot(table.symbols, table.capacity, name, name_size, hash_identifier(name, name_size));
+	if (!symbol.defined) return;
+
+	symbol.defined = 0;
+	table.defined_count--;
+}
+
+// Copies the names and values that point into [begin, end) to the arena of the
+// table, for buffers that are reused before the translation unit ends
+bool symbol_table_pin(SymbolTable& table, const char* begin, const char* end)
+{
+	const auto pin = [&](const char*& text, const u64 size) {
+		if (text < begin || text >= end) return 1;
+
+		const auto copy = (char*)arena_alloc(*table.arena, size);
+		if (!copy)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+		memcpy(copy, text, size);
+		text = copy;
+		return 1;
+	};
+
+	for (u64 i = 0; i < table.capacity; i++)
+	{
+		auto& symbol = table.symbols[i];
+		// Undefined names are still compared against while probing
+		if (symbol.name && !pin(symbol.name, symbol.name_size))
+			return 0;
+		if (symbol.defined && symbol.value_size && !pin(symbol.value, symbol.value_size))
+			return 0;
+	}
+	return 1;
+}
@@ -1,12 +1,676 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <sys/utime.h>
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
 #include "../utils.h"
 #include "../nice_wprintf.h"
 
 int entry(int argc, const wchar_t** argv);
 
+// Behaviour tests run parsa on files written to the current directory and check its outputs
+int g_failures = 0;
+
+void test_failed(const char* name)
+{
+    nice_wprintf(L"Test \"%hs\" failed!\n", name);
+    g_failures++;
+}
+
+bool write_test_file(const char* path, const char* content, size_t size)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file) return 0;
+    const bool written = fwrite(content, 1, size, file) == size;
+    fclose(file);
+    return written;
+}
+
+// Returns the content of the file at path, which the caller frees, or 0 when it can't be read
+char* read_test_file(const char* path, size_t& size)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    fseek(file, 0, SEEK_END);
+    size = (size_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* content = (char*)malloc(size + 1);
+    if (content && fread(content, 1, size, file) != size)
+    {
+        free(content);
+        content = 0;
+    }
+    fclose(file);
+    return content;
+}
+
+bool test_files_equal(const char* a_path, const char* b_path)
+{
+    size_t a_size;
+    size_t b_size;
+    char* a = read_test_file(a_path, a_size);
+    char* b = read_test_file(b_path, b_size);
+    const bool equal = a && b && a_size == b_size && memcmp(a, b, a_size) == 0;
+    free(a);
+    free(b);
+    return equal;
+}
+
+bool make_test_dir(const char* path)
+{
+#ifdef _WIN32
+    return _mkdir(path) == 0;
+#else
+    return mkdir(path, 0755) == 0;
+#endif
+}
+
+void remove_test_dir(const char* path)
+{
+#ifdef _WIN32
+    _rmdir(path);
+#else
+    rmdir(path);
+#endif
+}
+
+// A write time no run of the tests happens at
+const time_t old_test_time = 1000000000;
+
+bool age_test_file(const char* path)
+{
+    struct utimbuf times = {old_test_time, old_test_time};
+    return utime(path, &times) == 0;
+}
+
+// Whether the file was written since age_test_file
+bool is_test_file_aged(const char* path)
+{
+    struct stat info;
+    return stat(path, &info) == 0 && info.st_mtime == old_test_time;
+}
+
+// Whether the file at path holds content and only it
+bool test_file_is(const char* path, const char* content)
+{
+    size_t size;
+    char* file = read_test_file(path, size);
+    const bool equal = file && size == strlen(content) && memcmp(file, content, size) == 0;
+    free(file);
+    return equal;
+}
+
+bool is_test_blank(const char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+// Outputs are compared without their blanks, which don't change what they mean
+bool equal_without_blanks(const char* a, size_t a_size, const char* b, size_t b_size)
+{
+    size_t i = 0;
+    size_t j = 0;
+    while (true)
+    {
+        for (; i < a_size && is_test_blank(a[i]); i++);
+        for (; j < b_size && is_test_blank(b[j]); j++);
+        if (i == a_size || j == b_size)
+            return i == a_size && j == b_size;
+        if (a[i++] != b[j++])
+            return 0;
+    }
+}
+
+// Preprocesses input on its own and checks its output is expected
+void expect_expansion(const char* name, const char* input, const char* expected)
+{
+    const wchar_t* test_argv[] = {L"parsa", L"test_in.c", L"-o", L"test_out.c", L"-q"};
+    size_t out_size = 0;
+    char* out = 0;
+    if (write_test_file("test_in.c", input, strlen(input)) && !entry(COUNTOF(test_argv), test_argv))
+        out = read_test_file("test_out.c", out_size);
+    if (!out || !equal_without_blanks(out, out_size, expected, strlen(expected)))
+        test_failed(name);
+
+    free(out);
+    remove("test_in.c");
+    remove("test_out.c");
+}
+
+void test_conditional_expressions()
+{
+    // The operands that aren't evaluated can't fail
+    expect_expansion("if_short_circuit",
+        "#if 0 && (1 / 0)\n"
+        "a\n"
+        "#elif 1 || 1 % 0\n"
+        "b\n"
+        "#endif\n"
+        "#if 1 ? 2 : 1 / 0\n"
+        "c\n"
+        "#endif\n",
+        "b c");
+
+    expect_expansion("elif",
+        "#define V 2\n"
+        "#if V == 1\n"
+        "a\n"
+        "#elif V == 2\n"
+        "b\n"
+        "#elif V == 2\n"
+        "c\n"
+        "#else\n"
+        "d\n"
+        "#endif\n"
+        "#if 0\n"
+        "#if 1 / 0\n"
+        "#endif\n"
+        "#elif defined(V) && !defined W\n"
+        "e\n"
+        "#endif\n",
+        "b e");
+
+    // Unsigned when either operand is, like in C
+    expect_expansion("if_unsigned",
+        "#if -1 < 0u\n"
+        "a\n"
+        "#endif\n"
+        "#if -1 > 0u\n"
+        "b\n"
+        "#endif\n"
+        "#if 0xFFFFFFFFFFFFFFFF > 0 && -1 / 2u > 1 && (-2 >> 1) == -1 && (-2u >> 63) == 1\n"
+        "c\n"
+        "#endif\n"
+        "#if (1 ? -1 : 0u) > 0 && (0u < 1) - 2 < 0\n"
+        "d\n"
+        "#endif\n",
+        "b c d");
+}
+
+void test_macro_recursion()
+{
+    // A name left as it is in an argument isn't substituted when the replacement is rescanned
+    expect_expansion("painted_argument",
+        "#define self self.x\n"
+        "#define id(a) a\n"
+        "#define k(a) a k\n"
+        "id(self) id(id(self)) id(k(1))(2)\n",
+        "self.x self.x 1 k(2)");
+
+    // The example of the C standard
+    expect_expansion("standard_example",
+        "#define x 3\n"
+        "#define f(a) f(x * (a))\n"
+        "#undef x\n"
+        "#define x 2\n"
+        "#define g f\n"
+        "#define z z[0]\n"
+        "#define h g(~\n"
+        "#define m(a) a(w)\n"
+        "#define w 0,1\n"
+        "#define t(a) a\n"
+        "f(y+1) + f(f(z)) % t(t(g)(0) + t)(1);\n"
+        "g(x+(3,4)-w) | h 5) & m\n"
+        "(f)^m(m);\n",
+        "f(2 * (y+1)) + f(2 * (f(2 * (z[0])))) % f(2 * (0)) + t(1);\n"
+        "f(2 * (2+(3,4)-0,1)) | f(2 * (~ 5)) & f(2 * (0,1))^m(0,1);");
+}
+
+void test_macro_arguments()
+{
+    // The arguments go on past the end of the replacements of h and g
+    expect_expansion("arguments_after_callers",
+        "#define h g(~\n"
+        "#define g f\n"
+        "h 5)\n",
+        "f(~ 5)");
+
+    expect_expansion("arguments_across_callers",
+        "#define f(a, b) [a|b]\n"
+        "#define g f(1,\n"
+        "#define h g (2\n"
+        "h + 3))\n",
+        "[1|(2 + 3)]");
+}
+
+// A #pragma once in a branch that isn't taken doesn't keep the header from being included again
+void test_pragma_once()
+{
+    const char header[] = "#if 0\n#pragma once\n#endif\nint x;\n";
+    if (!write_test_file("test_once.h", header, sizeof(header) - 1))
+        test_failed("pragma_once_skipped");
+    else
+        expect_expansion("pragma_once_skipped", "#include \"test_once.h\"\n#include \"test_once.h\"\n", "int x; int x;");
+    remove("test_once.h");
+}
+
+// The output of a run with --header-cache is the same as without it, with
+// snapshots recorded, spliced in, or dropped since the header changed
+void test_header_cache()
+{
+    const char input[] = "#include \"test_header.h\"\nint b = A + B(1);\n";
+    const wchar_t* plain_argv[] = {L"parsa", L"test_in.c", L"-o", L"test_plain_out.c", L"-q"};
+    const wchar_t* cached_argv[] = {L"parsa", L"test_in.c", L"-o", L"test_out.c", L"-q", L"-H", L"test_header.cache"};
+    const char* headers[] = {
+        "#pragma once\n#define A 1\n#define B(x) (x + A)\nint a;\n",
+        "#pragma once\n#define A 20\n#define B(x) (x * A)\nint a, c;\n",
+    };
+
+    bool passed = write_test_file("test_in.c", input, sizeof(input) - 1);
+    for (size_t i = 0; i < COUNTOF(headers) && passed; i++)
+    {
+        passed = write_test_file("test_header.h", headers[i], strlen(headers[i])) && !entry(COUNTOF(plain_argv), plain_argv);
+        for (int run = 0; run < 2 && passed; run++)
+            passed = !entry(COUNTOF(cached_argv), cached_argv) && test_files_equal("test_out.c", "test_plain_out.c");
+    }
+    if (!passed)
+        test_failed("header_cache");
+
+    remove("test_in.c");
+    remove("test_header.h");
+    remove("test_header.cache");
+    remove("test_out.c");
+    remove("test_plain_out.c");
+}
+
+// Runs parsa and checks the output it wrote to test_out.c has expected in it
+bool expect_output(int argc, const wchar_t** argv, const char* expected)
+{
+    size_t out_size;
+    char* out = !entry(argc, argv) ? read_test_file("test_out.c", out_size) : 0;
+    if (out)
+        out[out_size] = 0;
+    const bool found = out && strstr(out, expected);
+    free(out);
+    return found;
+}
+
+// A second --incremental run leaves the output alone, and it's written again when
+// a dependency or the include directories change
+void test_incremental()
+{
+    const char input[] = "#include \"test_inc.h\"\n#include <test_inc_dir.h>\nint a = V + W;\n";
+    const wchar_t* first_argv[] = {L"parsa", L"test_in.c", L"-o", L"test_out.c", L"-q", L"-i", L"-I", L"test_inc_1"};
+    const wchar_t* second_argv[] = {L"parsa", L"test_in.c", L"-o", L"test_out.c", L"-q", L"-i", L"-I", L"test_inc_2"};
+
+    bool passed = make_test_dir("test_inc_1") && make_test_dir("test_inc_2") &&
+        write_test_file("test_in.c", input, sizeof(input) - 1) &&
+        write_test_file("test_inc.h", "#define V 1\n", 12) &&
+        write_test_file("test_inc_1/test_inc_dir.h", "#define W 2\n", 12) &&
+        write_test_file("test_inc_2/test_inc_dir.h", "#define W 3\n", 12) &&
+        expect_output(COUNTOF(first_argv), first_argv, "int a = 1 + 2;");
+
+    // Something else of the same size in the output still looks up to date, so it stays
+    size_t out_size = 0;
+    char* sentinel = passed ? read_test_file("test_out.c", out_size) : 0;
+    if (sentinel)
+    {
+        memset(sentinel, 'x', out_size);
+        sentinel[out_size] = 0;
+    }
+    if (!sentinel || !write_test_file("test_out.c", sentinel, out_size) ||
+        entry(COUNTOF(first_argv), first_argv) || !test_file_is("test_out.c", sentinel))
+        test_failed("incremental_up_to_date");
+
+    // A header of another size, so its write time doesn't matter
+    if (!write_test_file("test_inc.h", "#define V 10\n", 13) || !expect_output(COUNTOF(first_argv), first_argv, "int a = 10 + 2;"))
+        test_failed("incremental_dependency_changed");
+
+    // The header found in the other directory is as old as the rest
+    if (!expect_output(COUNTOF(second_argv), second_argv, "int a = 10 + 3;"))
+        test_failed("incremental_include_dirs_changed");
+
+    free(sentinel);
+    remove("test_in.c");
+    remove("test_inc.h");
+    remove("test_inc_1/test_inc_dir.h");
+    remove("test_inc_2/test_inc_dir.h");
+    remove_test_dir("test_inc_1");
+    remove_test_dir("test_inc_2");
+    remove("test_out.c");
+    remove("test_out.c.parsa_manifest");
+}
+
+// With --restat the output of an input touched without changing it isn't written,
+// but one whose content changed is, even when its size didn't
+void test_restat()
+{
+    const char input[] = "int a = 1;\n";
+    const char changed_input[] = "int a = 2;\n";
+    const wchar_t* restat_argv[] = {L"parsa", L"test_in.c", L"-o", L"test_out.c", L"-q", L"-c"};
+
+    if (!write_test_file("test_in.c", input, sizeof(input) - 1) || !expect_output(COUNTOF(restat_argv), restat_argv, "int a = 1;") ||
+        !age_test_file("test_out.c") || !write_test_file("test_in.c", input, sizeof(input) - 1) ||
+        !expect_output(COUNTOF(restat_argv), restat_argv, "int a = 1;") || !is_test_file_aged("test_out.c"))
+        test_failed("restat_unchanged");
+
+    if (!age_test_file("test_out.c") || !write_test_file("test_in.c", changed_input, sizeof(changed_input) - 1) ||
+        !expect_output(COUNTOF(restat_argv), restat_argv, "int a = 2;") || is_test_file_aged("test_out.c"))
+        test_failed("restat_changed");
+
+    remove("test_in.c");
+    remove("test_out.c");
+}
+
+// Whether the file holds a single JSON object whose brackets match, with key in it.
+// Its strings are skipped, but the values themselves aren't checked.
+bool is_test_json_object(const char* path, const char* key)
+{
+    size_t size;
+    char* json = read_test_file(path, size);
+    if (!json) return 0;
+    json[size] = 0;
+
+    char closers[64];
+    size_t depth = 0;
+    size_t i = 0;
+    for (; i < size && is_test_blank(json[i]); i++);
+    bool valid = i < size && json[i] == '{';
+    for (; i < size && valid; i++)
+    {
+        const char c = json[i];
+        if (c == '"')
+        {
+            for (i++; i < size && json[i] != '"'; i++)
+                i += json[i] == '\\';
+            valid = i < size;
+        }
+        else if (c == '{' || c == '[')
+        {
+            valid = depth < sizeof(closers);
+            if (valid)
+                closers[depth++] = c == '{' ? '}' : ']';
+        }
+        else if (c == '}' || c == ']')
+        {
+            valid = depth && closers[--depth] == c;
+            if (!depth)
+                break;
+        }
+    }
+    for (i++; i < size && is_test_blank(json[i]); i++);
+    valid = valid && !depth && i >= size && strstr(json, key);
+    free(json);
+    return valid;
+}
+
+// The --stats run succeeds, writes its JSON and gives the same output as a plain run
+void test_stats()
+{
+    const char input[] = "#define A(x) x + 1\nint a = A(2);\n";
+    const wchar_t* plain_argv[] = {L"parsa", L"test_in.c", L"-o", L"test_plain_out.c", L"-q"};
+    const wchar_t* stats_argv[] = {L"parsa", L"test_in.c", L"-o", L"test_out.c", L"-q", L"-s", L"test_stats.json"};
+
+    if (!write_test_file("test_in.c", input, sizeof(input) - 1) || entry(COUNTOF(plain_argv), plain_argv) ||
+        entry(COUNTOF(stats_argv), stats_argv) || !test_files_equal("test_out.c", "test_plain_out.c") ||
+        !is_test_json_object("test_stats.json", "\"files_count\": 1"))
+        test_failed("stats");
+
+    remove("test_in.c");
+    remove("test_out.c");
+    remove("test_plain_out.c");
+    remove("test_stats.json");
+}
+
+// The --trace run succeeds, writes its events and gives the same output as a plain run
+void test_trace()
+{
+    const char input[] = "#define A(x) x + 1\nint a = A(2);\n";
+    const wchar_t* plain_argv[] = {L"parsa", L"test_in.c", L"-o", L"test_plain_out.c", L"-q"};
+    const wchar_t* trace_argv[] = {L"parsa", L"test_in.c", L"-o", L"test_out.c", L"-q", L"-t", L"test_trace.json"};
+
+    if (!write_test_file("test_in.c", input, sizeof(input) - 1) || entry(COUNTOF(plain_argv), plain_argv) ||
+        entry(COUNTOF(trace_argv), trace_argv) || !test_files_equal("test_out.c", "test_plain_out.c") ||
+        !is_test_json_object("test_trace.json", "\"ph\": \"X\""))
+        test_failed("trace");
+
+    remove("test_in.c");
+    remove("test_out.c");
+    remove("test_plain_out.c");
+    remove("test_trace.json");
+}
+
+// Inputs of the --recursive runs, by their path under test_tree/, after the directories they're in
+const char* test_tree_dirs[] = {"", "sub/", "sub/deep/"};
+const char* test_tree_files[][2] = {
+    {"a.c", "#include \"h.h\"\nint a = H;\n"},
+    {"h.h", "#define H 1\n"},
+    {"sub/b.c", "#include \"../h.h\"\n#define B(x) x * H\nint b = B(2);\n"},
+    {"sub/deep/c.c", "#include \"../../h.h\"\nint c = H + 2;\n"},
+};
+
+// The paths of the tests are ASCII
+void widen_test_path(wchar_t (&dest)[256], const char* path)
+{
+    size_t i = 0;
+    for (; path[i] && i < COUNTOF(dest) - 1; i++)
+        dest[i] = (wchar_t)path[i];
+    dest[i] = 0;
+}
+
+bool make_test_tree(const char* root)
+{
+    char path[256];
+    bool made = 1;
+    for (size_t i = 0; i < COUNTOF(test_tree_dirs) && made; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", root, test_tree_dirs[i]);
+        made = make_test_dir(path);
+    }
+    return made;
+}
+
+void remove_test_tree(const char* root)
+{
+    char path[256];
+    for (size_t i = 0; i < COUNTOF(test_tree_files); i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", root, test_tree_files[i][0]);
+        remove(path);
+    }
+    for (size_t i = COUNTOF(test_tree_dirs); i--;)
+    {
+        snprintf(path, sizeof(path), "%s/%s", root, test_tree_dirs[i]);
+        remove_test_dir(path);
+    }
+}
+
+// Whether every input of the tree has the same output under both directories
+bool test_tree_outputs_equal(const char* a_root, const char* b_root)
+{
+    char a_path[256];
+    char b_path[256];
+    bool equal = 1;
+    for (size_t i = 0; i < COUNTOF(test_tree_files) && equal; i++)
+    {
+        snprintf(a_path, sizeof(a_path), "%s/%s", a_root, test_tree_files[i][0]);
+        snprintf(b_path, sizeof(b_path), "%s/%s", b_root, test_tree_files[i][0]);
+        equal = test_files_equal(a_path, b_path);
+    }
+    return equal;
+}
+
+// A --recursive run over a tree gives every file the same output as a run on it alone,
+// in the same place under the output directory
+void test_recursive()
+{
+    bool passed = make_test_tree("test_tree") && make_test_tree("test_tree_ref") && make_test_dir("test_tree_out");
+    char path[256];
+    char ref_path[256];
+    for (size_t i = 0; i < COUNTOF(test_tree_files) && passed; i++)
+    {
+        snprintf(path, sizeof(path), "test_tree/%s", test_tree_files[i][0]);
+        passed = write_test_file(path, test_tree_files[i][1], strlen(test_tree_files[i][1]));
+    }
+
+    // The outputs of each input on its own go in the same places under test_tree_ref
+    wchar_t in_arg[256];
+    wchar_t out_arg[256];
+    for (size_t i = 0; i < COUNTOF(test_tree_files) && passed; i++)
+    {
+        snprintf(path, sizeof(path), "test_tree/%s", test_tree_files[i][0]);
+        snprintf(ref_path, sizeof(ref_path), "test_tree_ref/%s", test_tree_files[i][0]);
+        widen_test_path(in_arg, path);
+        widen_test_path(out_arg, ref_path);
+        const wchar_t* single_argv[] = {L"parsa", in_arg, L"-o", out_arg, L"-q"};
+        passed = !entry(COUNTOF(single_argv), single_argv);
+    }
+
+    const wchar_t* recursive_argv[] = {L"parsa", L"test_tree", L"-o", L"test_tree_out/", L"-q", L"-r"};
+    if (!passed || entry(COUNTOF(recursive_argv), recursive_argv) || !test_tree_outputs_equal("test_tree_out", "test_tree_ref"))
+        test_failed("recursive");
+
+    remove_test_tree("test_tree");
+    remove_test_tree("test_tree_ref");
+    remove_test_tree("test_tree_out");
+}
+
+// Reading and writing through --io-uring, or without it where it isn't available,
+// gives the same outputs as the plain syscalls
+void test_io_uring()
+{
+    bool passed = make_test_tree("test_tree") && make_test_dir("test_tree_out") && make_test_dir("test_tree_ring_out");
+    char path[256];
+    for (size_t i = 0; i < COUNTOF(test_tree_files) && passed; i++)
+    {
+        snprintf(path, sizeof(path), "test_tree/%s", test_tree_files[i][0]);
+        passed = write_test_file(path, test_tree_files[i][1], strlen(test_tree_files[i][1]));
+    }
+
+    const wchar_t* plain_argv[] = {L"parsa", L"test_tree", L"-o", L"test_tree_out/", L"-q", L"-r"};
+    const wchar_t* ring_argv[] = {L"parsa", L"test_tree", L"-o", L"test_tree_ring_out/", L"-q", L"-r", L"-u"};
+    if (!passed || entry(COUNTOF(plain_argv), plain_argv) || entry(COUNTOF(ring_argv), ring_argv) ||
+        !test_tree_outputs_equal("test_tree_ring_out", "test_tree_out"))
+        test_failed("io_uring");
+
+    remove_test_tree("test_tree");
+    remove_test_tree("test_tree_out");
+    remove_test_tree("test_tree_ring_out");
+}
+
+// Streams input through stdin and checks its output is the same as when it's
+// mapped whole, without unexpected in it and with expected, when they're set
+void expect_stream_output(const char* name, const char* input, size_t size, const char* unexpected, const char* expected)
+{
+    const wchar_t* stream_argv[] = {L"parsa", L"-", L"-o", L"test_stream_out.c", L"-q"};
+    const wchar_t* map_argv[] = {L"parsa", L"test_stream_in.c", L"-o", L"test_map_out.c", L"-q"};
+    bool passed = write_test_file("test_stream_in.c", input, size) && freopen("test_stream_in.c", "rb", stdin);
+    passed = passed && !entry(COUNTOF(stream_argv), stream_argv) && !entry(COUNTOF(map_argv), map_argv);
+
+    size_t out_size;
+    char* out = passed ? read_test_file("test_stream_out.c", out_size) : 0;
+    if (out)
+        out[out_size] = 0;
+    passed = out && test_files_equal("test_stream_out.c", "test_map_out.c") &&
+        (!unexpected || !strstr(out, unexpected)) && (!expected || strstr(out, expected));
+
+    free(out);
+    remove("test_stream_in.c");
+    remove("test_stream_out.c");
+    remove("test_map_out.c");
+    if (!passed)
+        test_failed(name);
+}
+
+// A "\r\n" split by the end of a chunk of a streamed input is one line ending
+void test_stream_chunk_boundary()
+{
+    // The size of a chunk of parsa's streams
+    const size_t chunk_size = 1 << 20;
+    const size_t capacity = chunk_size + 4096;
+    char* input = (char*)malloc(capacity);
+    if (!input)
+    {
+        test_failed("stream_chunk_boundary");
+        return;
+    }
+
+    size_t size = 0;
+    const char header[] = "#define V 7\r\n";
+    memcpy(input, header, sizeof(header) - 1);
+    size += sizeof(header) - 1;
+    const char line[] = "int a = V;\r\n";
+    for (; size + sizeof(line) - 1 + 8 < chunk_size; size += sizeof(line) - 1)
+        memcpy(input + size, line, sizeof(line) - 1);
+
+    // A comment that puts the '\r' of its line ending last in the chunk
+    input[size++] = '/';
+    input[size++] = '/';
+    for (; size < chunk_size - 1; size++)
+        input[size] = 'x';
+    input[size++] = '\r';
+    input[size++] = '\n';
+    for (int i = 0; i < 64; i++, size += sizeof(line) - 1)
+        memcpy(input + size, line, sizeof(line) - 1);
+
+    // Without any '\r' left
+    expect_stream_output("stream_chunk_boundary", input, size, "\r", 0);
+    free(input);
+}
+
+// An invocation whose arguments go on past the end of a chunk is expanded whole
+void test_stream_split_invocation()
+{
+    const size_t chunk_size = 1 << 20;
+    const size_t capacity = chunk_size + 4096;
+    char* input = (char*)malloc(capacity);
+    if (!input)
+    {
+        test_failed("stream_split_invocation");
+        return;
+    }
+
+    size_t size = 0;
+    const char header[] = "#define F(a, b) [a|b]\n#define G F\n";
+    memcpy(input, header, sizeof(header) - 1);
+    size += sizeof(header) - 1;
+    const char line[] = "int a;\n";
+    for (; size + sizeof(line) - 1 + 32 < chunk_size; size += sizeof(line) - 1)
+        memcpy(input + size, line, sizeof(line) - 1);
+
+    // A comment that puts the end of the first line of the invocation right before the end of the chunk
+    const char call[] = "int x = F(1,\n";
+    input[size++] = '/';
+    input[size++] = '/';
+    for (; size < chunk_size - 4 - (sizeof(call) - 1); size++)
+        input[size] = 'x';
+    input[size++] = '\n';
+    memcpy(input + size, call, sizeof(call) - 1);
+    size += sizeof(call) - 1;
+    const char rest[] = "  2) + G\n(3, 4);\nint y = F(5, 6);\n";
+    memcpy(input + size, rest, sizeof(rest) - 1);
+    size += sizeof(rest) - 1;
+
+    expect_stream_output("stream_split_invocation", input, size, 0, "[1|2] + [3|4]");
+    free(input);
+}
+
 int wmain(int argc, const wchar_t** argv)
 {
     const wchar_t* in_argv[] = {L"arroz", L"main.cpp", L"-h"};
     entry(COUNTOF(in_argv), in_argv);
 
-    nice_wprintf(L"olaaa");
-}
\ No newline at end of file
+    test_stream_chunk_boundary();
+    test_stream_split_invocation();
+    test_conditional_expressions();
+    test_macro_recursion();
+    test_macro_arguments();
+    test_pragma_once();
+    test_header_cache();
+    test_incremental();
+    test_restat();
+    test_stats();
+    test_trace();
+    test_recursive();
+    test_io_uring();
+
+    if (g_failures)
+        nice_wprintf(L"%d tests failed!\n", g_failures);
+    return g_failures != 0;
+}
@@ -0,0 +1,231 @@
+#ifdef _WIN32
+struct Mutex {
+	SRWLOCK srw_lock = SRWLOCK_INIT;
+};
+
+void mutex_lock(Mutex& mutex)
+{
+	AcquireSRWLockExclusive(&mutex.srw_lock);
+}
+
+void mutex_unlock(Mutex& mutex)
+{
+	ReleaseSRWLockExclusive(&mutex.srw_lock);
+}
+
+void mutex_lock_shared(Mutex& mutex)
+{
+	AcquireSRWLockShared(&mutex.srw_lock);
+}
+
+void mutex_unlock_shared(Mutex& mutex)
+{
+	ReleaseSRWLockShared(&mutex.srw_lock);
+}
+
+u32 get_hardware_concurrency()
+{
+	const auto count = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+	return count ? count : 1;
+}
+#else
+struct Mutex {
+	pthread_rwlock_t rw_lock = PTHREAD_RWLOCK_INITIALIZER;
+};
+
+void mutex_lock(Mutex& mutex)
+{
+	pthread_rwlock_wrlock(&mutex.rw_lock);
+}
+
+void mutex_unlock(Mutex& mutex)
+{
+	pthread_rwlock_unlock(&mutex.rw_lock);
+}
+
+void mutex_lock_shared(Mutex& mutex)
+{
+	pthread_rwlock_rdlock(&mutex.rw_lock);
+}
+
+void mutex_unlock_shared(Mutex& mutex)
+{
+	pthread_rwlock_unlock(&mutex.rw_lock);
+}
+
+u32 get_hardware_concurrency()
+{
+	const auto count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (u32)count : 1;
+}
+#endif
+
+typedef void (*WorkProc)(u32 item, u32 worker_index, void* user);
+
+// Every worker owns a slice of the items: it takes its own items from the
+// head and, once it runs out, steals from the tail of the other workers.
+struct WorkQueue {
+	Mutex mutex;
+	u32* items;
+	u32 head;
+	u32 tail;
+};
+
+struct ThreadPool {
+	WorkQueue* queues;
+	u32 workers_count;
+	WorkProc proc;
+	void* user;
+};
+
+struct Worker {
+	ThreadPool* pool;
+	u32 index;
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+	bool started;
+};
+
+bool work_queue_pop(WorkQueue& queue, u32& item)
+{
+	mutex_lock(queue.mutex);
+	const auto has_item = queue.head < queue.tail;
+	if (has_item)
+		item = queue.items[queue.head++];
+	mutex_unlock(queue.mutex);
+	return has_item;
+}
+
+// Queue of the worker running on this thread, 0 outside of thread_pool_run
+thread_local WorkQueue* t_work_queue;
+
+// Copies up to max of the items this worker takes next, some may still be stolen before it gets to them
+u32 work_queue_peek(u32* items, const u32 max)
+{
+	if (!t_work_queue) return 0;
+
+	auto& queue = *t_work_queue;
+	mutex_lock_shared(queue.mutex);
+	u32 count = 0;
+	for (auto i = queue.head; i < queue.tail && count < max; i++)
+		items[count++] = queue.items[i];
+	mutex_unlock_shared(queue.mutex);
+	return count;
+}
+
+bool work_queue_steal(WorkQueue& queue, u32& item)
+{
+	mutex_lock(queue.mutex);
+	const auto has_item = queue.head < queue.tail;
+	if (has_item)
+		item = queue.items[--queue.tail];
+	mutex_unlock(queue.mutex);
+	return has_item;
+}
+
+void worker_run(Worker& worker)
+{
+	auto& pool = *worker.pool;
+	t_work_queue = &pool.queues[worker.index];
+	while (true)
+	{
+		u32 item;
+		auto found = work_queue_pop(pool.queues[worker.index], item);
+		for (u32 i = 1; !found && i < pool.workers_count; i++)
+			found = work_queue_steal(pool.queues[(worker.index + i) % pool.workers_count], item);
+
+		// Items are only handed out up front, so empty queues mean we are done
+		if (!found) break;
+
+		pool.proc(item, worker.index, pool.user);
+	}
+	t_work_queue = 0;
+}
+
+#ifdef _WIN32
+DWORD WINAPI worker_thread_proc(void* param)
+{
+	worker_run(*(Worker*)param);
+	return 0;
+}
+#else
+void* worker_thread_proc(void* param)
+{
+	worker_run(*(Worker*)param);
+	return 0;
+}
+#endif
+
+// Runs proc over items on workers_count threads (including the calling one).
+// Items are expected to be sorted by descending cost: they are dealt round
+// robin so every worker starts with its most expensive items.
+bool thread_pool_run(u32 workers_count, const u32* items, const u32 items_count, WorkProc proc, void* user)
+{
+	if (workers_count > items_count)
+		workers_count = items_count;
+	if (!workers_count)
+		return 1;
+
+	const auto memory_size = workers_count * (sizeof(WorkQueue) + sizeof(Worker)) + items_count * sizeof(u32);
+	const auto memory = (char*)memory_alloc(memory_size);
+	if (!memory)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	ThreadPool pool = {
+		.queues = (WorkQueue*)memory,
+		.workers_count = workers_count,
+		.proc = proc,
+		.user = user,
+	};
+	const auto workers = (Worker*)(pool.queues + workers_count);
+	auto slots = (u32*)(workers + workers_count);
+
+	for (u32 w = 0; w < workers_count; w++)
+	{
+		auto& queue = pool.queues[w];
+		queue = {};
+		queue.items = slots;
+		for (auto i = w; i < items_count; i += workers_count)
+			queue.items[queue.tail++] = items[i];
+		slots += queue.tail;
+	}
+
+	for (u32 w = 0; w < workers_count; w++)
+	{
+		auto& worker = workers[w];
+		worker = {.pool = &pool, .index = w};
+		if (w == 0) continue;
+
+#ifdef _WIN32
+		worker.thread = CreateThread(0, 0, worker_thread_proc, &worker, 0, 0);
+		worker.started = worker.thread != 0;
+#else
+		worker.started = pthread_create(&worker.thread, 0, worker_thread_proc, &worker) == 0;
+#endif
+		// Its items will be stolen by the remaining workers
+		if (!worker.started)
+			wprintf(L"Failed to create worker thread!\n");
+	}
+
+	worker_run(workers[0]);
+
+	for (u32 w = 1; w < workers_count; w++)
+	{
+		if (!workers[w].started) continue;
+#ifdef _WIN32
+		WaitForSingleObject(workers[w].thread, INFINITE);
+		CloseHandle(workers[w].thread);
+#else
+		pthread_join(workers[w].thread, 0);
+#endif
+	}
+
+	memory_free(memory);
+	return 1;
+}
@@ -0,0 +1,89 @@
+// Spans of --trace, written as Chrome trace events that Perfetto and
+// chrome://tracing open. Every worker records into its own ring buffer without
+// any locking; once a buffer is full the oldest spans are overwritten.
+struct TraceEvent {
+	const char* name;
+	u64 start_ns;
+	u64 duration_ns;
+	// Usually the file the span is about, cut to fit
+	char detail[48];
+};
+
+constexpr u64 trace_buffer_capacity = 1 << 16;
+
+struct TraceBuffer {
+	TraceEvent* events;
+	// Spans recorded so far, only the last trace_buffer_capacity are kept
+	u64 count;
+};
+
+// Buffer of the worker running on this thread, 0 when not tracing
+thread_local TraceBuffer* t_trace;
+
+inline u64 trace_time()
+{
+	return t_trace ? get_time_ns() : 0;
+}
+
+void trace_span(const char* name, const u64 start_ns, const u64 end_ns, const char* detail = 0)
+{
+	if (!t_trace) return;
+
+	auto& event = t_trace->events[t_trace->count++ & (trace_buffer_capacity - 1)];
+	event.name = name;
+	event.start_ns = start_ns;
+	event.duration_ns = end_ns - start_ns;
+	event.detail[0] = 0;
+	if (!detail) return;
+
+	// Paths too long for the detail keep their end, which is the file name.
+	// It starts on a whole character, so it stays valid UTF-8.
+	const auto detail_size = strlen(detail);
+	auto skipped = detail_size >= sizeof(event.detail) ? detail_size - sizeof(event.detail) + 1 : 0;
+	for (; ((u8)detail[skipped] & 0xc0) == 0x80; skipped++);
+	strlcpy(event.detail, detail + skipped, sizeof(event.detail));
+}
+
+bool trace_buffers_init(TraceBuffer* buffers, const u32 buffers_count)
+{
+	for (u32 i = 0; i < buffers_count; i++)
+	{
+		buffers[i] = {.events = (TraceEvent*)memory_alloc(trace_buffer_capacity * sizeof(TraceEvent))};
+		if (!buffers[i].events)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void trace_buffers_free(TraceBuffer* buffers, const u32 buffers_count)
+{
+	for (u32 i = 0; i < buffers_count; i++)
+		memory_free(buffers[i].events);
+}
+
+// Timestamps are in microseconds since start_ns, one thread per worker
+void write_trace(StatsWriter& writer, const TraceBuffer* buffers, const u32 buffers_count, const u64 start_ns)
+{
+	stats_printf(writer, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	for (u32 i = 0; i < buffers_count; i++)
+		stats_printf(writer, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"worker %u\"}}", i ? ",\n" : "", i, i);
+
+	for (u32 i = 0; i < buffers_count; i++)
+	{
+		const auto& buffer = buffers[i];
+		const auto first = buffer.count > trace_buffer_capacity ? buffer.count - trace_buffer_capacity : 0;
+		for (auto j = first; j < buffer.count; j++)
+		{
+			const auto& event = buffer.events[j & (trace_buffer_capacity - 1)];
+			const auto ts_ns = event.start_ns - start_ns;
+			stats_printf(writer, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %llu.%03llu, \"dur\": %llu.%03llu, \"args\": {\"detail\": ",
+				event.name, i, ts_ns / 1000, ts_ns % 1000, event.duration_ns / 1000, event.duration_ns % 1000);
+			stats_write_string(writer, event.detail);
+			stats_printf(writer, "}}");
+		}
+	}
+	stats_printf(writer, "\n]}\n");
+}
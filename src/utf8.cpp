@@ -0,0 +1,92 @@
+// Both return the number of characters written without the NUL terminator,
+// or 0 if src isn't valid or dest is too small
+
+u64 utf8_to_wide(wchar_t* dest, const u64 dest_count, const char* src, const u64 src_size)
+{
+	if (!dest_count) return 0;
+#ifdef _WIN32
+	if (src_size > (u64)std::numeric_limits<int>::max()) return 0;
+	const auto chars_written = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, src, (int)src_size, dest, (int)dest_count - 1);
+	if (chars_written <= 0) return 0;
+	dest[chars_written] = 0;
+	return chars_written;
+#else
+	u64 chars_written = 0;
+	for (u64 i = 0; i < src_size;)
+	{
+		const auto c = (unsigned char)src[i];
+		u32 code_point;
+		int continuation_count;
+		if (c < 0x80) { code_point = c; continuation_count = 0; }
+		else if ((c & 0xe0) == 0xc0) { code_point = c & 0x1f; continuation_count = 1; }
+		else if ((c & 0xf0) == 0xe0) { code_point = c & 0x0f; continuation_count = 2; }
+		else if ((c & 0xf8) == 0xf0) { code_point = c & 0x07; continuation_count = 3; }
+		else return 0;
+
+		if (i + continuation_count >= src_size) return 0;
+		for (int j = 1; j <= continuation_count; j++)
+		{
+			const auto continuation = (unsigned char)src[i + j];
+			if ((continuation & 0xc0) != 0x80) return 0;
+			code_point = code_point << 6 | (continuation & 0x3f);
+		}
+		i += continuation_count + 1;
+
+		if (chars_written + 1 >= dest_count) return 0;
+		dest[chars_written++] = (wchar_t)code_point;
+	}
+	dest[chars_written] = 0;
+	return chars_written;
+#endif
+}
+
+u64 wide_to_utf8(char* dest, const u64 dest_size, const wchar_t* src)
+{
+	if (!dest_size) return 0;
+#ifdef _WIN32
+	const auto bytes_written = WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, src, -1, dest, (int)dest_size, 0, 0);
+	if (bytes_written <= 0) return 0;
+	return bytes_written - 1;
+#else
+	u64 bytes_written = 0;
+	for (auto c = src; *c; c++)
+	{
+		const auto code_point = (u32)*c;
+		char encoded[4];
+		int encoded_size;
+		if (code_point < 0x80)
+		{
+			encoded[0] = (char)code_point;
+			encoded_size = 1;
+		}
+		else if (code_point < 0x800)
+		{
+			encoded[0] = (char)(0xc0 | code_point >> 6);
+			encoded[1] = (char)(0x80 | (code_point & 0x3f));
+			encoded_size = 2;
+		}
+		else if (code_point < 0x10000)
+		{
+			encoded[0] = (char)(0xe0 | code_point >> 12);
+			encoded[1] = (char)(0x80 | (code_point >> 6 & 0x3f));
+			encoded[2] = (char)(0x80 | (code_point & 0x3f));
+			encoded_size = 3;
+		}
+		else if (code_point < 0x110000)
+		{
+			encoded[0] = (char)(0xf0 | code_point >> 18);
+			encoded[1] = (char)(0x80 | (code_point >> 12 & 0x3f));
+			encoded[2] = (char)(0x80 | (code_point >> 6 & 0x3f));
+			encoded[3] = (char)(0x80 | (code_point & 0x3f));
+			encoded_size = 4;
+		}
+		else return 0;
+
+		if (bytes_written + encoded_size >= dest_size) return 0;
+		memcpy(dest + bytes_written, encoded, encoded_size);
+		bytes_written += encoded_size;
+	}
+	dest[bytes_written] = 0;
+	return bytes_written;
+#endif
+}
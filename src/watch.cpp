@@ -0,0 +1,287 @@
+// Jobs to run again when one of their inputs changes, built from the
+// dependencies every job recorded the last time it ran.
+struct DependentJobs {
+	struct Node {
+		// Full path
+		PathId path;
+		// Into edges, ~0u ends the list
+		u32 first_edge;
+	};
+
+	struct Edge {
+		u32 job;
+		u32 next;
+	};
+
+	Node* nodes;
+	u64 capacity;
+	u64 count;
+	Edge* edges;
+	u32 edges_count;
+	u32 edges_capacity;
+};
+
+DependentJobs::Node* dependent_jobs_find_slot(DependentJobs::Node* nodes, const u64 capacity, const PathId path)
+{
+	auto index = get_path_hash(path) & (capacity - 1);
+	while (true)
+	{
+		auto& node = nodes[index];
+		if (!node.path || node.path == path)
+			return &node;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+bool dependent_jobs_grow(DependentJobs& dependents)
+{
+	const auto new_capacity = dependents.capacity ? dependents.capacity * 2 : 256;
+	const auto new_nodes = (DependentJobs::Node*)memory_alloc(new_capacity * sizeof(DependentJobs::Node));
+	if (!new_nodes)
+	{
+		wprintf(L"Failed to allocate memory!\n");
+		return 0;
+	}
+
+	for (u64 i = 0; i < dependents.capacity; i++)
+	{
+		const auto& node = dependents.nodes[i];
+		if (!node.path) continue;
+		*dependent_jobs_find_slot(new_nodes, new_capacity, node.path) = node;
+	}
+
+	memory_free(dependents.nodes);
+	dependents.nodes = new_nodes;
+	dependents.capacity = new_capacity;
+	return 1;
+}
+
+// Paths are made absolute, so they can be compared with the ones of the watcher
+bool dependent_jobs_add(DependentJobs& dependents, const PathId file_path, const u32 job)
+{
+	char full_path[max_path_size];
+	const auto full_path_size = get_full_path_name(full_path, sizeof(full_path), get_path(file_path), 0);
+	if (!full_path_size)
+	{
+		wprintf(L"File path is too large!\n");
+		return 0;
+	}
+
+	const auto path = path_pool_intern(g_paths, full_path, full_path_size);
+	if (!path)
+		return 0;
+
+	if ((dependents.count + 1) * 2 > dependents.capacity && !dependent_jobs_grow(dependents))
+		return 0;
+
+	if (dependents.edges_count == dependents.edges_capacity)
+	{
+		const auto new_capacity = dependents.edges_capacity ? dependents.edges_capacity * 2 : 1024;
+		const auto new_edges = (DependentJobs::Edge*)memory_alloc(new_capacity * sizeof(DependentJobs::Edge));
+		if (!new_edges)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+
+		if (dependents.edges)
+		{
+			memcpy(new_edges, dependents.edges, dependents.edges_count * sizeof(DependentJobs::Edge));
+			memory_free(dependents.edges);
+		}
+		dependents.edges = new_edges;
+		dependents.edges_capacity = new_capacity;
+	}
+
+	auto& node = *dependent_jobs_find_slot(dependents.nodes, dependents.capacity, path);
+	if (!node.path)
+	{
+		node.path = path;
+		node.first_edge = ~0u;
+		dependents.count++;
+	}
+
+	dependents.edges[dependents.edges_count] = {.job = job, .next = node.first_edge};
+	node.first_edge = dependents.edges_count++;
+	return 1;
+}
+
+const DependentJobs::Node* dependent_jobs_find(const DependentJobs& dependents, const PathId path)
+{
+	if (!dependents.count) return 0;
+
+	const auto& node = *dependent_jobs_find_slot(dependents.nodes, dependents.capacity, path);
+	return node.path ? &node : 0;
+}
+
+void dependent_jobs_free(DependentJobs& dependents)
+{
+	memory_free(dependents.nodes);
+	memory_free(dependents.edges);
+	dependents = {};
+}
+
+// The path isn't NUL terminated
+typedef void (*ChangeProc)(const char* path, u64 path_size, void* user);
+
+#ifdef _WIN32
+// Never used, --watch is rejected on Windows when the arguments are parsed
+struct FileWatcher {
+};
+
+bool file_watcher_init(FileWatcher& watcher)
+{
+	return 0;
+}
+
+bool file_watcher_add_directory(FileWatcher& watcher, const PathId directory)
+{
+	return 0;
+}
+
+bool file_watcher_wait(FileWatcher& watcher, const u32 debounce_ms, ChangeProc proc, void* user)
+{
+	return 0;
+}
+
+void file_watcher_free(FileWatcher& watcher)
+{
+}
+#else
+struct FileWatcher {
+	int fd;
+	struct Directory {
+		int wd;
+		// With a trailing separator
+		PathId path;
+	};
+	Directory* directories;
+	u32 count;
+	u32 capacity;
+};
+
+bool file_watcher_init(FileWatcher& watcher)
+{
+	watcher = {};
+	watcher.fd = inotify_init1(IN_CLOEXEC);
+	if (watcher.fd < 0)
+	{
+		wprintf(L"Failed to initialize inotify!\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+// Watching the same directory again does nothing
+bool file_watcher_add_directory(FileWatcher& watcher, const PathId directory)
+{
+	for (u32 i = 0; i < watcher.count; i++)
+	{
+		if (watcher.directories[i].path == directory)
+			return 1;
+	}
+
+	// Editors often save by renaming a new file over the old one
+	const auto wd = inotify_add_watch(watcher.fd, get_path(directory), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+	if (wd < 0)
+	{
+		nice_wprintf(L"Failed to watch directory \"%hs\"!\n", get_path(directory));
+		return 0;
+	}
+
+	for (u32 i = 0; i < watcher.count; i++)
+	{
+		if (watcher.directories[i].wd == wd)
+			return 1;
+	}
+
+	if (watcher.count == watcher.capacity)
+	{
+		const auto new_capacity = watcher.capacity ? watcher.capacity * 2 : 16;
+		const auto new_directories = (FileWatcher::Directory*)memory_alloc(new_capacity * sizeof(FileWatcher::Directory));
+		if (!new_directories)
+		{
+			wprintf(L"Failed to allocate memory!\n");
+			return 0;
+		}
+
+		if (watcher.directories)
+		{
+			memcpy(new_directories, watcher.directories, watcher.count * sizeof(FileWatcher::Directory));
+			memory_free(watcher.directories);
+		}
+		watcher.directories = new_directories;
+		watcher.capacity = new_capacity;
+	}
+
+	auto& watched = watcher.directories[watcher.count++];
+	watched.wd = wd;
+	watched.path = directory;
+	return 1;
+}
+
+// Calls proc with the path of every file that changed. Blocks until something
+// changes, then keeps collecting until nothing happened for debounce_ms, so a
+// burst of saves ends up in a single rebuild. The same path may come more than once.
+bool file_watcher_wait(FileWatcher& watcher, const u32 debounce_ms, ChangeProc proc, void* user)
+{
+	alignas(inotify_event) char events[16 * 1024];
+	auto timeout = -1;
+	while (true)
+	{
+		pollfd poll_fd = {.fd = watcher.fd, .events = POLLIN};
+		const auto ready = poll(&poll_fd, 1, timeout);
+		if (ready < 0)
+		{
+			if (errno == EINTR) continue;
+			wprintf(L"Failed to wait for file changes!\n");
+			return 0;
+		}
+		if (!ready)
+			return 1;
+
+		const auto size = read(watcher.fd, events, sizeof(events));
+		if (size < 0)
+		{
+			if (errno == EINTR) continue;
+			wprintf(L"Failed to read file changes!\n");
+			return 0;
+		}
+
+		for (auto c = events; c < events + size;)
+		{
+			const auto& event = *(const inotify_event*)c;
+			c += sizeof(inotify_event) + event.len;
+			if (!event.len) continue;
+
+			for (u32 i = 0; i < watcher.count; i++)
+			{
+				const auto& directory = watcher.directories[i];
+				if (directory.wd != event.wd) continue;
+
+				const auto& directory_entry = path_pool_entry(g_paths, directory.path);
+				const auto name_size = strlen(event.name);
+				char path[max_path_size];
+				if (directory_entry.size + name_size < sizeof(path))
+				{
+					memcpy(path, directory_entry.path, directory_entry.size);
+					memcpy(path + directory_entry.size, event.name, name_size);
+					proc(path, directory_entry.size + name_size, user);
+				}
+				break;
+			}
+		}
+
+		timeout = debounce_ms;
+	}
+}
+
+void file_watcher_free(FileWatcher& watcher)
+{
+	if (watcher.fd >= 0)
+		close(watcher.fd);
+	memory_free(watcher.directories);
+	watcher = {};
+}
+#endif